@@ -0,0 +1,442 @@
+// Throughput of utf8streams for every encoding and access pattern compared to
+// std::codecvt and iconv. Results are printed as CSV: MB/s refers to the UTF-8
+// output, ns/char to code points.
+//
+// Usage: utf8streams_bench [--size MiB] [--repeat N] [file...]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <locale>
+#include <sstream>
+#include <string>
+#include <utf8streams.hpp>
+#include <vector>
+
+#ifdef UTF8STREAMS_BENCH_ICONV
+#include <iconv.h>
+#endif
+
+struct Corpus {
+  std::string name;
+  std::string text;
+  size_t codePoints;
+};
+
+struct Options {
+  size_t size = 4 * 1024 * 1024;
+  int repeat = 3;
+  std::vector<std::string> files;
+};
+
+static const utf8streams::Encoding ENCODINGS[] = {
+    utf8streams::Encoding::Utf8, utf8streams::Encoding::Utf16LE,
+    utf8streams::Encoding::Utf16BE, utf8streams::Encoding::Utf32LE,
+    utf8streams::Encoding::Utf32BE};
+
+// Only measured on corpora without code points above U+00FF
+static const utf8streams::Encoding SINGLE_BYTE_ENCODINGS[] = {
+    utf8streams::Encoding::Latin1, utf8streams::Encoding::Windows1252,
+    utf8streams::Encoding::Iso8859_15};
+
+static const char *encodingName(utf8streams::Encoding encoding) {
+  switch (encoding) {
+  case utf8streams::Encoding::Utf8:
+    return "UTF-8";
+  case utf8streams::Encoding::Utf16LE:
+    return "UTF-16LE";
+  case utf8streams::Encoding::Utf16BE:
+    return "UTF-16BE";
+  case utf8streams::Encoding::Utf32LE:
+    return "UTF-32LE";
+  case utf8streams::Encoding::Utf32BE:
+    return "UTF-32BE";
+  case utf8streams::Encoding::Latin1:
+    return "ISO-8859-1";
+  case utf8streams::Encoding::Windows1252:
+    return "WINDOWS-1252";
+  case utf8streams::Encoding::Iso8859_15:
+    return "ISO-8859-15";
+  default:
+    return "unknown";
+  }
+}
+
+static void appendCodePoint(std::string &text, uint32_t codePoint) {
+  if (codePoint < 0x80) {
+    text += static_cast<char>(codePoint);
+  } else if (codePoint < 0x800) {
+    text += static_cast<char>(0xC0 | (codePoint >> 6));
+    text += static_cast<char>(0x80 | (codePoint & 0x3F));
+  } else if (codePoint < 0x10000) {
+    text += static_cast<char>(0xE0 | (codePoint >> 12));
+    text += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+    text += static_cast<char>(0x80 | (codePoint & 0x3F));
+  } else {
+    text += static_cast<char>(0xF0 | (codePoint >> 18));
+    text += static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+    text += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+    text += static_cast<char>(0x80 | (codePoint & 0x3F));
+  }
+}
+
+static size_t countCodePoints(const std::string &text) {
+  return static_cast<size_t>(
+      std::count_if(text.begin(), text.end(), [](char c) {
+        return (static_cast<unsigned char>(c) & 0xC0u) != 0x80u;
+      }));
+}
+
+static Corpus makeCorpus(const std::string &name, std::string text) {
+  auto codePoints = countCodePoints(text);
+  return Corpus{name, std::move(text), codePoints};
+}
+
+// Words of random length separated by spaces and newlines, with characters
+// drawn by pick
+static Corpus generate(const std::string &name, size_t size,
+                       const std::function<uint32_t(uint32_t)> &pick) {
+  std::string text;
+  uint32_t state = 12345;
+  auto next = [&state]() {
+    state = state * 1103515245u + 12345u;
+    return state >> 8u;
+  };
+
+  while (text.size() < size) {
+    auto length = 1 + next() % 10;
+    for (uint32_t i = 0; i < length; ++i) {
+      appendCodePoint(text, pick(next()));
+    }
+    text += next() % 12 == 0 ? '\n' : ' ';
+  }
+
+  return makeCorpus(name, std::move(text));
+}
+
+static std::string repeatToSize(const std::string &text, size_t size) {
+  std::string result;
+  while (!text.empty() && result.size() < size) {
+    result += text;
+  }
+  return result;
+}
+
+static std::vector<Corpus> makeCorpora(const Options &options) {
+  std::vector<Corpus> corpora;
+
+  corpora.push_back(generate("ascii", options.size, [](uint32_t r) {
+    return static_cast<uint32_t>('a' + r % 26);
+  }));
+  corpora.push_back(generate("latin", options.size, [](uint32_t r) {
+    return r % 8 == 0 ? 0xC0u + r % 0x40u
+                      : static_cast<uint32_t>('a' + r % 26);
+  }));
+  corpora.push_back(generate("cjk", options.size, [](uint32_t r) {
+    return r % 16 == 0 ? 0x3002u : 0x4E00u + r % 0x5000u;
+  }));
+  corpora.push_back(generate("emoji", options.size, [](uint32_t r) {
+    return 0x1F600u + r % 0x50u;
+  }));
+  corpora.push_back(generate("mixed", options.size, [](uint32_t r) {
+    switch (r % 8) {
+    case 0:
+      return 0xC0u + r % 0x40u;
+    case 1:
+      return 0x4E00u + r % 0x5000u;
+    case 2:
+      return 0x1F600u + r % 0x50u;
+    default:
+      return static_cast<uint32_t>('a' + r % 26);
+    }
+  }));
+
+  for (const auto &path : options.files) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      std::cerr << "Cannot open " << path << std::endl;
+      std::exit(1);
+    }
+
+    auto text = utf8streams::readAll(file, utf8streams::Encoding::Auto, true);
+    auto name = path.substr(path.find_last_of("/\\") + 1);
+    corpora.push_back(makeCorpus(name, repeatToSize(text, options.size)));
+  }
+
+  return corpora;
+}
+
+static std::string encode(const std::string &text,
+                          utf8streams::Encoding encoding) {
+  std::string output(text.size() * 4, '\0');
+  auto result = utf8streams::fromUtf8(encoding, text.data(), text.size(),
+                                      &output[0], output.size());
+  output.resize(result.produced);
+  return output;
+}
+
+// Code points from U+00C0 on are the same in all single-byte encodings
+static bool encodeSingleBytes(const std::string &text, std::string &output) {
+  output.clear();
+  for (size_t i = 0; i < text.size(); ++i) {
+    auto byte = static_cast<unsigned char>(text[i]);
+    if (byte < 0x80) {
+      output += text[i];
+    } else if (byte == 0xC3 && i + 1 < text.size()) {
+      output += static_cast<char>(0x40 | static_cast<unsigned char>(text[++i]));
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the best time of all runs in seconds
+static double measure(int repeat, const std::function<size_t()> &run) {
+  static volatile size_t sink;
+  auto best = 1e9;
+
+  for (int i = 0; i < repeat; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    sink = sink + run();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+
+  return best;
+}
+
+static void report(const Corpus &corpus, utf8streams::Encoding encoding,
+                   const std::string &method, double seconds) {
+  std::cout << corpus.name << ',' << encodingName(encoding) << ',' << method
+            << ',' << static_cast<double>(corpus.text.size()) / seconds / 1e6
+            << ','
+            << seconds * 1e9 / static_cast<double>(corpus.codePoints)
+            << std::endl;
+}
+
+static void benchStream(const Options &options, const Corpus &corpus,
+                        utf8streams::Encoding encoding,
+                        const std::string &input, const std::string &method,
+                        const std::function<size_t(std::istream &)> &consume) {
+  auto seconds = measure(options.repeat, [&]() {
+    std::istringstream stream(input);
+    utf8streams::UTF8StreamBuf buf(stream, encoding);
+    return consume(stream);
+  });
+
+  report(corpus, encoding, method, seconds);
+}
+
+static void benchStreams(const Options &options, const Corpus &corpus,
+                         utf8streams::Encoding encoding,
+                         const std::string &input) {
+  benchStream(options, corpus, encoding, input, "get",
+              [](std::istream &stream) {
+                size_t sum = 0;
+                char c;
+                while (stream.get(c)) {
+                  sum += static_cast<unsigned char>(c);
+                }
+                return sum;
+              });
+
+  for (size_t blockSize : {16, 4096, 65536}) {
+    benchStream(options, corpus, encoding, input,
+                "read/" + std::to_string(blockSize),
+                [blockSize](std::istream &stream) {
+                  std::vector<char> buffer(blockSize);
+                  size_t sum = 0;
+                  while (stream.read(buffer.data(),
+                                     static_cast<std::streamsize>(blockSize)) ||
+                         stream.gcount() > 0) {
+                    sum += static_cast<size_t>(stream.gcount());
+                  }
+                  return sum;
+                });
+  }
+
+  benchStream(options, corpus, encoding, input, "getline",
+              [](std::istream &stream) {
+                size_t sum = 0;
+                std::string line;
+                while (std::getline(stream, line)) {
+                  sum += line.size();
+                }
+                return sum;
+              });
+
+  auto seconds = measure(options.repeat, [&]() {
+    std::istringstream stream(input);
+    utf8streams::UTF8StreamBuf buf(stream, encoding);
+    utf8streams::LineReader reader(buf);
+
+    size_t sum = 0;
+    utf8streams::Line line;
+    while (reader.next(line)) {
+      sum += line.size;
+    }
+    return sum;
+  });
+  report(corpus, encoding, "LineReader", seconds);
+
+  benchStream(options, corpus, encoding, input, "extract",
+              [](std::istream &stream) {
+                size_t sum = 0;
+                std::string word;
+                while (stream >> word) {
+                  sum += word.size();
+                }
+                return sum;
+              });
+}
+
+static void benchConvert(const Options &options, const Corpus &corpus,
+                         utf8streams::Encoding encoding,
+                         const std::string &input) {
+  std::string output(corpus.text.size(), '\0');
+
+  auto seconds = measure(options.repeat, [&]() {
+    return utf8streams::toUtf8(encoding, input.data(), input.size(),
+                               &output[0], output.size())
+        .produced;
+  });
+  report(corpus, encoding, "toUtf8", seconds);
+
+  seconds = measure(options.repeat, [&]() {
+    return utf8streams::toUtf8Parallel(encoding, input.data(), input.size(),
+                                       &output[0], output.size())
+        .produced;
+  });
+  report(corpus, encoding, "toUtf8Parallel", seconds);
+}
+
+static bool isLittleEndian() {
+  const uint16_t value = 1;
+  char first;
+  std::memcpy(&first, &value, 1);
+  return first == 1;
+}
+
+template <typename CharT>
+static void benchCodecvt(const Options &options, const Corpus &corpus,
+                         utf8streams::Encoding encoding,
+                         const std::string &input) {
+  typedef std::codecvt<CharT, char, std::mbstate_t> Codecvt;
+  auto &codecvt = std::use_facet<Codecvt>(std::locale::classic());
+
+  std::vector<CharT> units(input.size() / sizeof(CharT));
+  std::memcpy(units.data(), input.data(), units.size() * sizeof(CharT));
+  std::string output(corpus.text.size(), '\0');
+
+  auto seconds = measure(options.repeat, [&]() {
+    std::mbstate_t state = std::mbstate_t();
+    const CharT *inNext;
+    char *outNext;
+    codecvt.out(state, units.data(), units.data() + units.size(), inNext,
+                &output[0], &output[0] + output.size(), outNext);
+    return static_cast<size_t>(outNext - &output[0]);
+  });
+  report(corpus, encoding, "codecvt", seconds);
+}
+
+#ifdef UTF8STREAMS_BENCH_ICONV
+static void benchIconv(const Options &options, const Corpus &corpus,
+                       utf8streams::Encoding encoding,
+                       const std::string &input) {
+  auto cd = iconv_open("UTF-8", encodingName(encoding));
+  if (cd == reinterpret_cast<iconv_t>(-1)) {
+    return;
+  }
+
+  std::string output(corpus.text.size(), '\0');
+  auto seconds = measure(options.repeat, [&]() {
+    auto inBuf = const_cast<char *>(input.data());
+    auto inLeft = input.size();
+    auto outBuf = &output[0];
+    auto outLeft = output.size();
+    iconv(cd, nullptr, nullptr, nullptr, nullptr);
+    iconv(cd, &inBuf, &inLeft, &outBuf, &outLeft);
+    return output.size() - outLeft;
+  });
+  report(corpus, encoding, "iconv", seconds);
+
+  iconv_close(cd);
+}
+#endif
+
+static void benchBaselines(const Options &options, const Corpus &corpus,
+                           utf8streams::Encoding encoding,
+                           const std::string &input) {
+  // std::codecvt only converts units in native byte order
+  auto nativeUtf16 = isLittleEndian() ? utf8streams::Encoding::Utf16LE
+                                      : utf8streams::Encoding::Utf16BE;
+  auto nativeUtf32 = isLittleEndian() ? utf8streams::Encoding::Utf32LE
+                                      : utf8streams::Encoding::Utf32BE;
+  if (encoding == nativeUtf16) {
+    benchCodecvt<char16_t>(options, corpus, encoding, input);
+  } else if (encoding == nativeUtf32) {
+    benchCodecvt<char32_t>(options, corpus, encoding, input);
+  }
+
+#ifdef UTF8STREAMS_BENCH_ICONV
+  benchIconv(options, corpus, encoding, input);
+#endif
+}
+
+static Options parseOptions(int argc, char const *const *argv) {
+  Options options;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--size" && i + 1 < argc) {
+      options.size = std::stoul(argv[++i]) * 1024 * 1024;
+    } else if (arg == "--repeat" && i + 1 < argc) {
+      options.repeat = std::max(1, std::stoi(argv[++i]));
+    } else {
+      options.files.push_back(arg);
+    }
+  }
+
+#ifdef UTF8STREAMS_BENCH_DATA
+  if (options.files.empty()) {
+    options.files.push_back(UTF8STREAMS_BENCH_DATA);
+  }
+#endif
+
+  return options;
+}
+
+int main(int argc, char const *const *argv) {
+  auto options = parseOptions(argc, argv);
+  auto corpora = makeCorpora(options);
+
+  std::cout << "corpus,encoding,method,mb_per_s,ns_per_char" << std::endl;
+
+  for (const auto &corpus : corpora) {
+    for (auto encoding : ENCODINGS) {
+      auto input = encode(corpus.text, encoding);
+
+      benchStreams(options, corpus, encoding, input);
+      benchConvert(options, corpus, encoding, input);
+      benchBaselines(options, corpus, encoding, input);
+    }
+
+    std::string input;
+    if (!encodeSingleBytes(corpus.text, input)) {
+      continue;
+    }
+    for (auto encoding : SINGLE_BYTE_ENCODINGS) {
+      benchStreams(options, corpus, encoding, input);
+      benchConvert(options, corpus, encoding, input);
+      benchBaselines(options, corpus, encoding, input);
+    }
+  }
+
+  return 0;
+}
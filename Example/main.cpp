@@ -9,16 +9,18 @@ int main(int argc, char const *const *argv) {
   }
 
   std::string path(argv[1]);
-  std::ifstream stream(path);
+  std::ifstream stream(path, std::ios::binary);
 
-  auto encoding = utf8streams::guessEncoding(stream);
+  auto encoding = utf8streams::detectEncoding(stream).encoding;
   if (encoding == utf8streams::Encoding::Unknown) {
     encoding = utf8streams::Encoding::Utf8;
   }
 
   utf8streams::UTF8StreamBuf streamBuf(stream, encoding);
 
-  char buffer[4096];
+  std::ios::sync_with_stdio(false);
+
+  char buffer[64 * 1024];
   while (true) {
     stream.read(buffer, sizeof(buffer));
     auto readBytes = stream.gcount();
@@ -26,7 +28,7 @@ int main(int argc, char const *const *argv) {
       break;
     }
 
-    std::cout << std::string(buffer, readBytes);
+    std::cout.write(buffer, readBytes);
   }
 
   return 0;
@@ -1,12 +1,153 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
+#include <exception>
 #include <istream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
 
 namespace utf8streams {
 
-enum class Encoding { Unknown, Utf8, Utf16LE, Utf16BE, Utf32LE, Utf32BE };
+namespace detail {
+struct DecodeResult;
+}
+
+enum class Encoding {
+  Unknown,
+  Utf8,
+  Utf16LE,
+  Utf16BE,
+  Utf32LE,
+  Utf32BE,
+  // Single-byte encodings, only supported as sources and never detected
+  Latin1,
+  Windows1252,
+  Iso8859_15,
+  // Detects the encoding based on an optional BOM and falls back to UTF-8
+  Auto
+};
 
 Encoding guessEncoding(std::istream &stream);
 
+struct EncodingGuess {
+  Encoding encoding;
+  // From 0 to 1, only a BOM yields 1
+  double confidence;
+};
+
+// Guesses the encoding of a sample such as the first few KiB of a file. Input
+// without a BOM is judged by its zero bytes and by trial decoding.
+EncodingGuess detectEncoding(const char *data, size_t size);
+
+// Samples up to 16 KiB and rewinds the stream like guessEncoding does
+EncodingGuess detectEncoding(std::istream &stream);
+
+enum class TranscodeError {
+  None,
+  IncompleteCodePoint,
+  UnpairedHighSurrogate,
+  UnpairedLowSurrogate,
+  InvalidCodePoint,
+  InvalidSequence,
+  UnknownEncoding
+};
+
+struct TranscodeResult {
+  size_t consumed;
+  size_t produced;
+  TranscodeError error;
+  // On error, consumed is the offset of the invalid sequence within the input
+  // and invalidLength its length in bytes
+  size_t invalidLength;
+  // The offending value of TranscodeError::InvalidCodePoint
+  uint32_t codePoint;
+};
+
+// Converts a buffer to UTF-8 without throwing or allocating. Conversion stops
+// at the first error or when the output is full. Unless final is set, an
+// incomplete sequence at the end is left unconsumed for the next call.
+// Encoding::Auto skips a BOM at the start of the input and falls back to UTF-8.
+TranscodeResult toUtf8(Encoding sourceEncoding, const char *input,
+                       size_t inputSize, char *output, size_t outputSize,
+                       bool final = true) noexcept;
+
+// Counterpart of toUtf8 converting UTF-8 to the target encoding
+TranscodeResult fromUtf8(Encoding targetEncoding, const char *input,
+                         size_t inputSize, char *output, size_t outputSize,
+                         bool final = true) noexcept;
+
+// Same as toUtf8 with final set, but large inputs are split into chunks which
+// are converted by up to threadCount threads (0 uses all cores). Chunks are
+// placed in the output by their precomputed lengths.
+TranscodeResult toUtf8Parallel(Encoding sourceEncoding, const char *input,
+                               size_t inputSize, char *output,
+                               size_t outputSize, unsigned threadCount = 0);
+
+// Returns the exact length toUtf8 produces for valid input. Each invalid
+// sequence is counted as a replacement character (U+FFFD).
+size_t utf8Length(Encoding sourceEncoding, const char *input,
+                  size_t inputSize) noexcept;
+
+// Validating variant of utf8Length, which stops at the first error like toUtf8
+// and returns the length as produced
+TranscodeResult checkedUtf8Length(Encoding sourceEncoding, const char *input,
+                                  size_t inputSize, bool final = true) noexcept;
+
+// Reads the rest of the stream and converts it to UTF-8. Seekable streams are
+// measured in blocks first, so the result is allocated once with its exact
+// size. Other streams are buffered completely before converting them.
+std::string readAll(std::istream &stream,
+                    Encoding sourceEncoding = Encoding::Auto,
+                    bool validateUtf8 = false);
+
+// How stream buffers handle invalid input. Replace writes U+FFFD for each
+// invalid sequence, Skip drops it.
+enum class ErrorPolicy { Throw, Replace, Skip };
+
+struct BatchFile {
+  std::string inputPath;
+  std::string outputPath;
+  // Encoding::Auto uses detectEncoding and falls back to UTF-8
+  Encoding sourceEncoding;
+};
+
+struct BatchResult {
+  // As given or detected
+  Encoding encoding;
+  size_t inputBytes;
+  size_t outputBytes;
+  // Invalid sequences replaced or skipped
+  size_t errorCount;
+  // Empty on success, output is not written for input which fails to decode
+  std::string error;
+};
+
+// Transcodes whole files to UTF-8 without BOM on up to threadCount threads (0
+// uses all cores), which steal files from each other once their own are done.
+// Results are in the order of files, failures do not stop the batch.
+std::vector<BatchResult> transcodeFiles(const std::vector<BatchFile> &files,
+                                        ErrorPolicy errorPolicy =
+                                            ErrorPolicy::Throw,
+                                        unsigned threadCount = 0);
+
+// Counters of a stream buffer, only collected if the library is built with
+// UTF8STREAMS_ENABLE_STATS
+struct StreamStats {
+  // Reads of the original stream and the bytes they returned
+  uint64_t sourceReads;
+  uint64_t sourceBytes;
+  // Calls of underflow and xsgetn made by the consumer
+  uint64_t underflows;
+  uint64_t reads;
+  // UTF-8 output and its ASCII part
+  uint64_t outputBytes;
+  uint64_t asciiBytes;
+  uint64_t errors;
+};
+
 class Error : public std::runtime_error {
 public:
   explicit Error(const std::string &message);
@@ -17,82 +158,557 @@ public:
   explicit UnicodeError(const std::string &message);
 };
 
-class UTF8StreamBuf : public std::streambuf {
+class LineReader;
+
+namespace detail {
+
+// Error policy and statistics shared by the stream buffers
+class ErrorTracker {
 private:
-  struct RingBuffer {
-  private:
-    uint8_t data[4];
-    uint8_t pos;
-    uint8_t filled;
+  ErrorPolicy policy;
+  size_t errors;
+  std::streamoff firstError;
 
-  public:
-    RingBuffer();
+protected:
+  ErrorTracker();
 
-    void put(uint8_t byte);
+  void countError(std::streamoff offset);
 
-    uint8_t get();
+public:
+  void setErrorPolicy(ErrorPolicy errorPolicy);
 
-    uint8_t peek();
+  ErrorPolicy errorPolicy() const;
 
-    bool hasData() const;
-  };
+  // Also counts errors which were thrown
+  size_t errorCount() const;
 
-  typedef std::streamsize (UTF8StreamBuf::*XsgetnCallback)(char *buffer,
-                                                           std::streamsize n);
-  typedef int (UTF8StreamBuf::*UnderflowCallback)();
-  typedef int (UTF8StreamBuf::*UflowCallback)();
+  // Offset in bytes of the first invalid sequence within the source, -1 if no
+  // error occurred
+  std::streamoff firstErrorOffset() const;
+};
 
-  std::streambuf *originalBuf;
-  XsgetnCallback xsgetnCallback;
-  UnderflowCallback underflowCallback;
-  UflowCallback uflowCallback;
-  RingBuffer byteBuff;
+// Pending error and statistics of decoding, shared by the stream buffers and
+// the readers of a source
+class DecodeTracker : public ErrorTracker {
+protected:
+  std::exception_ptr pendingError;
+  // Encoding of the decoded output, including replacement characters
+  Encoding outputEncoding = Encoding::Utf8;
 
-  void putUnicode(uint32_t unicode);
+#ifdef UTF8STREAMS_STATS
+  StreamStats counters = StreamStats();
+  size_t errorsAtReset = 0;
+#endif
 
-  std::streamsize xsgetnUtf8(char *buffer, std::streamsize n);
+  void setPendingError(const DecodeResult &result);
 
-  int underflowUtf8();
+  // Applies the error policy to an invalid sequence at offset in the source.
+  // Returns false without counting the error if the output has no room for a
+  // replacement character.
+  bool handleError(const DecodeResult &result, std::streamoff offset,
+                   char *output, size_t &produced, size_t n);
 
-  int uflowUtf8();
+  // Replaces with a single U+FFFD code point
+  bool handleError(const DecodeResult &result, std::streamoff offset,
+                   char32_t *output, size_t &produced, size_t n);
 
-  std::streamsize xsgetnUtf16LE(char *buffer, std::streamsize n);
+  void throwPendingError();
 
-  int underflowUtf16LE();
+  DecodeTracker() = default;
 
-  int uflowUtf16LE();
+public:
+  // Shared as a virtual base, which is never copied
+  DecodeTracker(const DecodeTracker &) = delete;
+
+  DecodeTracker &operator=(const DecodeTracker &) = delete;
+
+  // All zero unless the library is built with UTF8STREAMS_ENABLE_STATS
+  StreamStats stats() const;
+
+  void resetStats();
+};
+
+class DecodingStreamBuf : public std::streambuf, public virtual DecodeTracker {
+  friend class utf8streams::LineReader;
 
-  std::streamsize xsgetnUtf16BE(char *buffer, std::streamsize n);
+protected:
+  typedef DecodeResult (*DecodeCallback)(const char *input, size_t inputSize,
+                                         char *output, size_t outputSize,
+                                         bool final);
+
+  char outBuffer[32 * 1024];
 
-  int underflowUtf16BE();
+#ifdef UTF8STREAMS_STATS
+  void countOutput(const char *data, size_t n);
+#endif
 
-  int uflowUtf16BE();
+  // Returns 0 only at the end of the input
+  virtual size_t decodeInto(char *buffer, size_t n) = 0;
 
-  std::streamsize xsgetnUtf32LE(char *buffer, std::streamsize n);
+  virtual bool fill();
 
-  int underflowUtf32LE();
+  std::streamsize xsgetn(char *buffer, std::streamsize n) override;
 
-  int uflowUtf32LE();
+  int underflow() override;
+};
 
-  std::streamsize xsgetnUtf32BE(char *buffer, std::streamsize n);
+} // namespace detail
 
-  int underflowUtf32BE();
+namespace detail {
 
-  int uflowUtf32BE();
+class Prefetcher;
 
+// Reads the original stream or a descriptor into a buffer for decoding
+class SourceReader : public virtual DecodeTracker {
 protected:
+  // Decodes to code points, produced counts code points instead of bytes
+  typedef DecodeResult (*WidenCallback)(const char *input, size_t inputSize,
+                                        char32_t *output, size_t outputSize,
+                                        bool final);
+
+  // Position of the source at construction, -1 if it cannot seek
+  std::streamoff sourceStart;
+  std::unique_ptr<Prefetcher> prefetcher;
+  // Null if the source is read from descriptor
+  std::streambuf *originalBuf;
+  int descriptor;
+  // Offset of a seekable descriptor, -1 otherwise
+  std::streamoff descriptorOffset;
+  // Source offset of the start of inBuffer
+  std::streamoff sourceOffset;
+  std::streamsize unitSize;
+  bool sourceExhausted;
+  size_t inBegin;
+  size_t inEnd;
+  // Leaves room for a partial code unit carried over, so that aligned reads
+  // of whole blocks still fit
+  char inBuffer[16 * 1024 + 4];
+
+  SourceReader(std::streambuf *source, std::streamsize unitSize);
+
+  SourceReader(int descriptor, std::streamsize unitSize);
+
+  ~SourceReader();
+
+  std::streamsize readSource(char *buffer, std::streamsize n);
+
+  // Decodes blocks of the input buffer into bytes or code points
+  template <typename Unit, typename Decode>
+  size_t decodeUnits(Decode decode, Unit *buffer, size_t n);
+
+  size_t decodeSource(WidenCallback widen, char32_t *buffer, size_t n);
+
+  // Reads the first bytes into inBuffer and skips a BOM. Returns UTF-8 if
+  // there is none.
+  Encoding detectSourceEncoding();
+
+public:
+  // Reads the original stream ahead on a helper thread, which must not be
+  // used otherwise from then on
+  void startPrefetching();
+};
+
+// Buffers the bytes of the original stream for decoding. Seeking is backed by
+// a sparse index of UTF-8 offsets and their source offsets.
+class SourceStreamBuf : public DecodingStreamBuf, public SourceReader {
+private:
+  struct Checkpoint {
+    std::streamoff utf8Offset;
+    std::streamoff sourceOffset;
+  };
+
+  // UTF-8 offsets of the end of the decoded output and of the get area start
+  std::streamoff outputOffset;
+  std::streamoff getAreaOffset;
+  size_t checkpointCount;
+  std::streamoff checkpointInterval;
+  Checkpoint checkpoints[256];
+
+  void recordCheckpoint();
+
+  bool skipTo(std::streamoff utf8Offset);
+
+protected:
+  SourceStreamBuf(std::istream &stream, std::streamsize unitSize);
+
+  SourceStreamBuf(int descriptor, std::streamsize unitSize);
+
+  size_t copySource(char *buffer, size_t n);
+
+  // The decoder is bound at compile time, so it can be inlined into the loop
+  template <DecodeCallback Decode> size_t decodeSource(char *buffer, size_t n);
+
+  // For decoders selected at runtime
+  size_t decodeSource(DecodeCallback decode, char *buffer, size_t n);
+
+  // Decode path of BasicUTF8StreamBuf, resolved at compile time
+  template <Encoding SourceEncoding>
+  size_t decodeAs(char *buffer, size_t n, bool validateUtf8);
+
+  bool fill() override;
+
   int sync() override;
 
   std::streamsize showmanyc() override;
 
-  std::streamsize xsgetn(char *buffer, std::streamsize n) override;
+  // Only std::ios::beg and std::ios::cur are supported, as the UTF-8 length
+  // of the source is unknown
+  pos_type seekoff(off_type off, std::ios::seekdir dir,
+                   std::ios::openmode which) override;
 
-  int underflow() override;
+  pos_type seekpos(pos_type pos, std::ios::openmode which) override;
+
+public:
+  ~SourceStreamBuf() override;
+};
+
+} // namespace detail
+
+// Decoder for an encoding known at compile time, validateUtf8 only applies to
+// Encoding::Utf8
+template <Encoding SourceEncoding>
+class BasicUTF8StreamBuf : public detail::SourceStreamBuf {
+  static_assert(SourceEncoding != Encoding::Unknown &&
+                    SourceEncoding != Encoding::Auto,
+                "BasicUTF8StreamBuf requires a concrete encoding");
+
+private:
+  bool validate;
+
+protected:
+  size_t decodeInto(char *buffer, size_t n) override;
+
+public:
+  explicit BasicUTF8StreamBuf(std::istream &stream, bool validateUtf8 = false);
+
+  // Reads the descriptor directly, which stays open and must be blocking
+  explicit BasicUTF8StreamBuf(int descriptor, bool validateUtf8 = false);
+};
+
+extern template class BasicUTF8StreamBuf<Encoding::Utf8>;
+extern template class BasicUTF8StreamBuf<Encoding::Utf16LE>;
+extern template class BasicUTF8StreamBuf<Encoding::Utf16BE>;
+extern template class BasicUTF8StreamBuf<Encoding::Utf32LE>;
+extern template class BasicUTF8StreamBuf<Encoding::Utf32BE>;
+extern template class BasicUTF8StreamBuf<Encoding::Latin1>;
+extern template class BasicUTF8StreamBuf<Encoding::Windows1252>;
+extern template class BasicUTF8StreamBuf<Encoding::Iso8859_15>;
+
+// Selects a decoder at runtime, see BasicUTF8StreamBuf if the encoding is known
+// at compile time
+class UTF8StreamBuf : public detail::SourceStreamBuf {
+private:
+  typedef size_t (SourceStreamBuf::*DecodePath)(char *buffer, size_t n,
+                                                bool validateUtf8);
+
+  Encoding sourceEncoding;
+  DecodePath decodePath;
+  bool validate;
+
+  void selectEncoding(Encoding encoding);
+
+  void resolveEncoding();
+
+protected:
+  size_t decodeInto(char *buffer, size_t n) override;
+
+public:
+  // UTF-8 input is passed through unchecked unless validateUtf8 is set
+  explicit UTF8StreamBuf(std::istream &stream, Encoding sourceEncoding,
+                         bool validateUtf8 = false);
+
+  // Reads the descriptor directly with large reads, aligned for regular files.
+  // The descriptor stays open and must be blocking.
+  explicit UTF8StreamBuf(int descriptor, Encoding sourceEncoding,
+                         bool validateUtf8 = false);
+
+  // Encoding::Auto is resolved by reading the first bytes of the stream
+  Encoding encoding();
+};
+
+// Decodes any source encoding directly to UTF-8, UTF-16 or UTF-32, without
+// converting to UTF-8 first. Offsets for seeking count bytes of the target
+// encoding.
+class TranscodingStreamBuf : public detail::SourceStreamBuf {
+private:
+  Encoding sourceEncoding;
+  DecodeCallback transcodeCallback;
+
+  // Throws before the stream is taken over, returns the unit size
+  static std::streamsize checkEncodings(Encoding sourceEncoding,
+                                        Encoding targetEncoding);
+
+  void selectEncoding(Encoding encoding);
 
-  int uflow() override;
+protected:
+  size_t decodeInto(char *buffer, size_t n) override;
+
+public:
+  explicit TranscodingStreamBuf(std::istream &stream, Encoding sourceEncoding,
+                                Encoding targetEncoding);
+
+  // The descriptor stays open and must be blocking
+  explicit TranscodingStreamBuf(int descriptor, Encoding sourceEncoding,
+                                Encoding targetEncoding);
+
+  // Encoding::Auto is resolved by reading the first bytes of the stream
+  Encoding encoding();
+
+  Encoding targetEncoding() const;
+};
+
+class MappedUTF8StreamBuf : public detail::DecodingStreamBuf {
+private:
+  const char *data;
+  size_t size;
+  size_t pos;
+  void *mappingHandle;
+  Encoding sourceEncoding;
+  DecodeCallback decodeCallback;
+
+  void map(const std::string &path);
+
+  void unmap();
+
+  void init(Encoding encoding, bool validateUtf8);
+
+protected:
+  size_t decodeInto(char *buffer, size_t n) override;
+
+  bool fill() override;
+
+  std::streamsize showmanyc() override;
+
+public:
+  // Same as passing Encoding::Auto
+  explicit MappedUTF8StreamBuf(const std::string &path,
+                               bool validateUtf8 = false);
+
+  MappedUTF8StreamBuf(const std::string &path, Encoding sourceEncoding,
+                      bool validateUtf8 = false);
+
+  MappedUTF8StreamBuf(const MappedUTF8StreamBuf &) = delete;
+
+  MappedUTF8StreamBuf &operator=(const MappedUTF8StreamBuf &) = delete;
+
+  ~MappedUTF8StreamBuf() override;
+
+  Encoding encoding() const;
+};
+
+// Reads code points from a stream without the round trip through UTF-8. The
+// buffer of the stream is read directly and must not be used otherwise
+// meanwhile.
+class CodePointReader : private detail::SourceReader {
+private:
+  Encoding sourceEncoding;
+  WidenCallback widenCallback;
+  size_t codePointsBegin;
+  size_t codePointsEnd;
+  // Buffer of next()
+  char32_t codePoints[1024];
+
+  void selectEncoding(Encoding encoding);
+
+  void resolveEncoding();
+
+  size_t decode(char32_t *buffer, size_t n);
 
 public:
-  explicit UTF8StreamBuf(std::istream &stream, Encoding sourceEncoding);
+  class iterator {
+  private:
+    CodePointReader *reader;
+    char32_t value;
+
+  public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef char32_t value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const char32_t *pointer;
+    typedef const char32_t &reference;
+
+    // The end iterator
+    iterator();
+
+    explicit iterator(CodePointReader &reader);
+
+    reference operator*() const;
+
+    iterator &operator++();
+
+    iterator operator++(int);
+
+    bool operator==(const iterator &other) const;
+
+    bool operator!=(const iterator &other) const;
+  };
+
+  // Encoding::Auto detects a BOM and falls back to UTF-8
+  explicit CodePointReader(std::istream &stream,
+                           Encoding sourceEncoding = Encoding::Auto);
+
+  // Reads the descriptor directly, which stays open and must be blocking
+  explicit CodePointReader(int descriptor,
+                           Encoding sourceEncoding = Encoding::Auto);
+
+  CodePointReader(const CodePointReader &) = delete;
+
+  CodePointReader &operator=(const CodePointReader &) = delete;
+
+  // Reads up to n code points, returns 0 only at the end of the input
+  size_t read(char32_t *buffer, size_t n);
+
+  // Returns false at the end of the input
+  bool next(char32_t &codePoint);
+
+  iterator begin();
+
+  iterator end();
+
+  Encoding encoding();
+
+  using ErrorTracker::setErrorPolicy;
+  using ErrorTracker::errorPolicy;
+  using ErrorTracker::errorCount;
+  using ErrorTracker::firstErrorOffset;
+
+  // Only the source reads and errors are counted
+  using DecodeTracker::stats;
+  using DecodeTracker::resetStats;
+
+  using SourceReader::startPrefetching;
+};
+
+// Decodes input pushed in chunks of any size, such as data received from a
+// socket, into a buffer of the caller. Sequences split between chunks are
+// carried over to the next call. Decoding never blocks, allocates or throws.
+class Decoder : public detail::ErrorTracker {
+private:
+  typedef detail::DecodeResult (*DecodeCallback)(const char *input,
+                                                 size_t inputSize,
+                                                 char *output,
+                                                 size_t outputSize,
+                                                 bool final);
+
+  Encoding initialEncoding;
+  Encoding sourceEncoding;
+  Encoding outputEncoding;
+  DecodeCallback decodeCallback;
+  // Bytes of all chunks consumed so far, including the carried ones
+  std::streamoff inputOffset;
+  char carry[4];
+  size_t carrySize;
+
+  void selectEncoding(Encoding encoding);
+
+  bool resolveEncoding(const char *input, size_t inputSize, bool final,
+                       TranscodeResult &status);
+
+  bool handleError(const detail::DecodeResult &result, std::streamoff offset,
+                   char *output, size_t outputSize, TranscodeResult &status);
+
+  bool decodeCarry(const char *input, size_t inputSize, char *output,
+                   size_t outputSize, bool final, TranscodeResult &status);
+
+  void decodeInput(const char *input, size_t inputSize, char *output,
+                   size_t outputSize, bool final, TranscodeResult &status);
+
+public:
+  // Encoding::Auto detects a BOM within the first four bytes and falls back to
+  // UTF-8. The output may also be UTF-16 or UTF-32.
+  explicit Decoder(Encoding sourceEncoding = Encoding::Auto,
+                   Encoding targetEncoding = Encoding::Utf8);
+
+  // Converts as much input as fits into the output, which needs room for 16
+  // bytes, so that a final call also writes all carried bytes. Bytes of an
+  // incomplete sequence are carried over to the next call and count as
+  // consumed, so consumed is less than inputSize only if the output is full or
+  // decoding stopped at an error.
+  // If final is set, carried bytes are reported as an incomplete code point.
+  // ErrorPolicy::Throw stops behind the first invalid sequence and returns its
+  // error instead of throwing, so the next call continues after it.
+  TranscodeResult decode(const char *input, size_t inputSize, char *output,
+                         size_t outputSize, bool final = false) noexcept;
+
+  // Drops carried bytes to start a new input, error counts are kept
+  void reset();
+
+  // Encoding::Auto until enough input was decoded to detect the encoding
+  Encoding encoding() const;
+};
+
+// A line without its terminator
+struct Line {
+  const char *data;
+  size_t size;
+
+  std::string str() const;
+};
+
+// Splits the output of a stream buffer into lines without copying them, unless
+// a line crosses the boundary of two decoded blocks
+class LineReader {
+private:
+  detail::DecodingStreamBuf &streamBuf;
+  bool stripCarriageReturn;
+  std::string carry;
+
+public:
+  // A carriage return before the line feed is removed if
+  // stripCarriageReturn is set. The output of the stream buffer must be UTF-8.
+  explicit LineReader(detail::DecodingStreamBuf &streamBuf,
+                      bool stripCarriageReturn = false);
+
+  // The line stays valid until the next call or the next read of the stream
+  // buffer. Returns false at the end of the input.
+  bool next(Line &line);
+};
+
+// Encodes UTF-8 written to the stream into the target encoding. Incomplete
+// sequences are kept until the next write.
+class UTF8OutputStreamBuf : public std::streambuf,
+                            public detail::ErrorTracker {
+private:
+  typedef detail::DecodeResult (*EncodeCallback)(const char *input,
+                                                 size_t inputSize,
+                                                 char *output,
+                                                 size_t outputSize,
+                                                 bool final);
+
+  std::streambuf *originalBuf;
+  EncodeCallback encodeCallback;
+  std::exception_ptr pendingError;
+  // Number of UTF-8 bytes encoded so far
+  std::streamoff inputOffset;
+  char inBuffer[16 * 1024];
+  char outBuffer[64 * 1024];
+
+  bool encode(const char *input, size_t inputSize, size_t &consumed,
+              bool final);
+
+  bool writeReplacementCharacter();
+
+  bool flushBuffer(bool final);
+
+  void throwPendingError();
+
+protected:
+  int overflow(int c) override;
+
+  std::streamsize xsputn(const char *buffer, std::streamsize n) override;
+
+  int sync() override;
+
+public:
+  explicit UTF8OutputStreamBuf(std::ostream &stream, Encoding targetEncoding,
+                               bool writeBom = false);
+
+  UTF8OutputStreamBuf(const UTF8OutputStreamBuf &) = delete;
+
+  UTF8OutputStreamBuf &operator=(const UTF8OutputStreamBuf &) = delete;
+
+  // Writes remaining output, an incomplete trailing sequence is dropped
+  ~UTF8OutputStreamBuf() override;
 };
 
 } // namespace utf8streams
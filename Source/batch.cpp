@@ -0,0 +1,220 @@
+#include "transcode.hpp"
+#include "utf8streams.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace utf8streams {
+
+// Size of the sample passed to detectEncoding
+constexpr size_t DETECTION_SAMPLE_SIZE = 16 * 1024;
+
+// Files of a worker, which it takes from the front while idle workers steal
+// from the back
+struct WorkQueue {
+  std::mutex mutex;
+  std::deque<size_t> files;
+};
+
+struct BatchContext {
+  const std::vector<BatchFile> &files;
+  std::vector<BatchResult> &results;
+  std::vector<WorkQueue> &queues;
+  ErrorPolicy errorPolicy;
+};
+
+// Buffers reused for all files of a worker
+struct WorkerBuffers {
+  std::vector<char> input;
+  std::vector<char> output;
+};
+
+static bool takeFile(WorkQueue &queue, bool steal, size_t &file) {
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.files.empty()) {
+    return false;
+  }
+
+  if (steal) {
+    file = queue.files.back();
+    queue.files.pop_back();
+  } else {
+    file = queue.files.front();
+    queue.files.pop_front();
+  }
+  return true;
+}
+
+static bool nextFile(std::vector<WorkQueue> &queues, size_t worker,
+                     size_t &file) {
+  if (takeFile(queues[worker], false, file)) {
+    return true;
+  }
+
+  for (size_t i = 1; i < queues.size(); ++i) {
+    if (takeFile(queues[(worker + i) % queues.size()], true, file)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool readFile(const std::string &path, std::vector<char> &buffer,
+                     size_t &size) {
+  auto file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+
+  const size_t chunkSize = 64 * 1024;
+  size = 0;
+  while (true) {
+    if (buffer.size() - size < chunkSize) {
+      buffer.resize(std::max(buffer.size() * 2, size + chunkSize));
+    }
+
+    auto readBytes = std::fread(&buffer[size], 1, buffer.size() - size, file);
+    size += readBytes;
+    if (readBytes == 0) {
+      break;
+    }
+  }
+
+  auto failed = std::ferror(file) != 0;
+  std::fclose(file);
+  return !failed;
+}
+
+static bool writeFile(const std::string &path, const char *data, size_t size) {
+  auto file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+
+  auto written = size == 0 || std::fwrite(data, 1, size, file) == size;
+  return std::fclose(file) == 0 && written;
+}
+
+static void transcodeFile(const BatchFile &file, ErrorPolicy errorPolicy,
+                          WorkerBuffers &buffers, BatchResult &result) {
+  size_t inputSize;
+  if (!readFile(file.inputPath, buffers.input, inputSize)) {
+    result.error = "Cannot read file " + file.inputPath;
+    return;
+  }
+  result.inputBytes = inputSize;
+  auto input = buffers.input.data();
+
+  size_t bomSize = 0;
+  result.encoding = file.sourceEncoding;
+  if (result.encoding == Encoding::Auto) {
+    result.encoding =
+        detectEncoding(input, std::min(inputSize, DETECTION_SAMPLE_SIZE))
+            .encoding;
+    detail::detectBom(input, inputSize, bomSize);
+    if (result.encoding == Encoding::Unknown) {
+      result.encoding = Encoding::Utf8;
+    }
+  } else {
+    // A BOM of the given encoding is not part of the text either
+    size_t size;
+    auto bom = detail::byteOrderMark(result.encoding, size);
+    if (bom != nullptr && inputSize >= size &&
+        std::memcmp(input, bom, size) == 0) {
+      bomSize = size;
+    }
+  }
+
+  // No input byte yields more than a replacement character
+  auto outputSize = 3 * inputSize;
+  if (buffers.output.size() < outputSize) {
+    buffers.output.resize(outputSize);
+  }
+  auto output = buffers.output.data();
+
+  size_t pos = bomSize;
+  size_t produced = 0;
+  while (true) {
+    auto transcoded = toUtf8(result.encoding, input + pos, inputSize - pos,
+                             output + produced, outputSize - produced);
+    pos += transcoded.consumed;
+    produced += transcoded.produced;
+
+    if (transcoded.error == TranscodeError::None) {
+      break;
+    }
+    if (transcoded.error == TranscodeError::UnknownEncoding) {
+      result.error = "Cannot transcode file with unknown encoding";
+      return;
+    }
+    if (errorPolicy == ErrorPolicy::Throw) {
+      result.error = detail::errorMessage(transcoded) + " at offset " +
+                     std::to_string(pos) + " of " + file.inputPath;
+      return;
+    }
+
+    ++result.errorCount;
+    if (errorPolicy == ErrorPolicy::Replace) {
+      std::memcpy(output + produced, detail::REPLACEMENT_CHARACTER,
+                  sizeof(detail::REPLACEMENT_CHARACTER));
+      produced += sizeof(detail::REPLACEMENT_CHARACTER);
+    }
+    pos += transcoded.invalidLength;
+  }
+
+  if (!writeFile(file.outputPath, output, produced)) {
+    result.error = "Cannot write file " + file.outputPath;
+    return;
+  }
+  result.outputBytes = produced;
+}
+
+static void runWorker(const BatchContext &context, size_t worker) {
+  WorkerBuffers buffers;
+  size_t file;
+  while (nextFile(context.queues, worker, file)) {
+    transcodeFile(context.files[file], context.errorPolicy, buffers,
+                  context.results[file]);
+  }
+}
+
+std::vector<BatchResult> transcodeFiles(const std::vector<BatchFile> &files,
+                                        ErrorPolicy errorPolicy,
+                                        unsigned threadCount) {
+  std::vector<BatchResult> results(
+      files.size(), BatchResult{Encoding::Unknown, 0, 0, 0, std::string()});
+  if (files.empty()) {
+    return results;
+  }
+
+  if (threadCount == 0) {
+    threadCount = std::max(1u, std::thread::hardware_concurrency());
+  }
+  auto workerCount = std::min<size_t>(threadCount, files.size());
+
+  // Neighbouring files start on the same worker
+  std::vector<WorkQueue> queues(workerCount);
+  for (size_t i = 0; i < files.size(); ++i) {
+    queues[i * workerCount / files.size()].files.push_back(i);
+  }
+
+  BatchContext context{files, results, queues, errorPolicy};
+  std::vector<std::thread> threads;
+  threads.reserve(workerCount - 1);
+  for (size_t i = 1; i < workerCount; ++i) {
+    threads.emplace_back(&runWorker, std::cref(context), i);
+  }
+  runWorker(context, 0);
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  return results;
+}
+
+} // namespace utf8streams
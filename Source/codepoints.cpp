@@ -0,0 +1,146 @@
+#include "transcode.hpp"
+#include "utf8streams.hpp"
+#include <algorithm>
+
+namespace utf8streams {
+
+CodePointReader::iterator::iterator() : reader(nullptr), value(0) {}
+
+CodePointReader::iterator::iterator(CodePointReader &reader)
+    : reader(&reader), value(0) {
+  ++*this;
+}
+
+CodePointReader::iterator::reference
+CodePointReader::iterator::operator*() const {
+  return value;
+}
+
+CodePointReader::iterator &CodePointReader::iterator::operator++() {
+  if (!reader->next(value)) {
+    reader = nullptr;
+  }
+  return *this;
+}
+
+CodePointReader::iterator CodePointReader::iterator::operator++(int) {
+  auto previous = *this;
+  ++*this;
+  return previous;
+}
+
+bool CodePointReader::iterator::operator==(const iterator &other) const {
+  return reader == other.reader;
+}
+
+bool CodePointReader::iterator::operator!=(const iterator &other) const {
+  return reader != other.reader;
+}
+
+void CodePointReader::selectEncoding(Encoding encoding) {
+  sourceEncoding = encoding;
+  unitSize = detail::unitSizeOf(encoding);
+
+  switch (encoding) {
+  case Encoding::Unknown:
+    throw Error("Cannot create CodePointReader with unknown encoding");
+  case Encoding::Utf8:
+    widenCallback = &detail::widenUtf8;
+    break;
+  case Encoding::Utf16LE:
+    widenCallback = &detail::widenUtf16LE;
+    break;
+  case Encoding::Utf16BE:
+    widenCallback = &detail::widenUtf16BE;
+    break;
+  case Encoding::Utf32LE:
+    widenCallback = &detail::widenUtf32LE;
+    break;
+  case Encoding::Utf32BE:
+    widenCallback = &detail::widenUtf32BE;
+    break;
+  case Encoding::Latin1:
+    widenCallback = &detail::widenLatin1;
+    break;
+  case Encoding::Windows1252:
+    widenCallback = &detail::widenWindows1252;
+    break;
+  case Encoding::Iso8859_15:
+    widenCallback = &detail::widenIso8859_15;
+    break;
+  case Encoding::Auto:
+    break;
+  }
+}
+
+void CodePointReader::resolveEncoding() {
+  selectEncoding(detectSourceEncoding());
+}
+
+size_t CodePointReader::decode(char32_t *buffer, size_t n) {
+  // An error is thrown after the code points before it were returned
+  if (pendingError) {
+    throwPendingError();
+  }
+  if (sourceEncoding == Encoding::Auto) {
+    resolveEncoding();
+  }
+
+  return decodeSource(widenCallback, buffer, n);
+}
+
+CodePointReader::CodePointReader(std::istream &stream, Encoding sourceEncoding)
+    : SourceReader(stream.rdbuf(), 1), sourceEncoding(sourceEncoding),
+      widenCallback(nullptr), codePointsBegin(0), codePointsEnd(0) {
+  selectEncoding(sourceEncoding);
+}
+
+CodePointReader::CodePointReader(int descriptor, Encoding sourceEncoding)
+    : SourceReader(descriptor, 1), sourceEncoding(sourceEncoding),
+      widenCallback(nullptr), codePointsBegin(0), codePointsEnd(0) {
+  selectEncoding(sourceEncoding);
+}
+
+size_t CodePointReader::read(char32_t *buffer, size_t n) {
+  if (n == 0) {
+    return 0;
+  }
+
+  // Code points buffered by next() come first
+  if (codePointsBegin != codePointsEnd) {
+    auto count = std::min(n, codePointsEnd - codePointsBegin);
+    std::copy(codePoints + codePointsBegin,
+              codePoints + codePointsBegin + count, buffer);
+    codePointsBegin += count;
+    return count;
+  }
+
+  return decode(buffer, n);
+}
+
+bool CodePointReader::next(char32_t &codePoint) {
+  if (codePointsBegin == codePointsEnd) {
+    codePointsBegin = 0;
+    codePointsEnd = decode(codePoints, sizeof(codePoints) / sizeof(char32_t));
+    if (codePointsEnd == 0) {
+      return false;
+    }
+  }
+
+  codePoint = codePoints[codePointsBegin++];
+  return true;
+}
+
+CodePointReader::iterator CodePointReader::begin() { return iterator(*this); }
+
+CodePointReader::iterator CodePointReader::end() { return iterator(); }
+
+Encoding CodePointReader::encoding() {
+  if (sourceEncoding == Encoding::Auto) {
+    resolveEncoding();
+  }
+
+  return sourceEncoding;
+}
+
+} // namespace utf8streams
@@ -0,0 +1,269 @@
+#include "transcode.hpp"
+#include "utf8streams.hpp"
+#include <cstring>
+#include <memory>
+
+namespace utf8streams {
+
+// Invalid sequences are assumed to be replaced by U+FFFD
+constexpr size_t REPLACEMENT_CHARACTER_LENGTH =
+    sizeof(detail::REPLACEMENT_CHARACTER);
+
+// Blocks in which readAll measures and decodes seekable streams
+constexpr size_t READ_BLOCK_SIZE = 64 * 1024;
+
+namespace detail {
+
+TranscodeError convertError(DecodeError error) {
+  switch (error) {
+  case DecodeError::None:
+    return TranscodeError::None;
+  case DecodeError::IncompleteCodePoint:
+    return TranscodeError::IncompleteCodePoint;
+  case DecodeError::UnpairedHighSurrogate:
+    return TranscodeError::UnpairedHighSurrogate;
+  case DecodeError::UnpairedLowSurrogate:
+    return TranscodeError::UnpairedLowSurrogate;
+  case DecodeError::InvalidCodePoint:
+    return TranscodeError::InvalidCodePoint;
+  default:
+    return TranscodeError::InvalidSequence;
+  }
+}
+
+} // namespace detail
+
+static TranscodeResult convert(detail::DecodeFunction convertFunction,
+                               const char *input, size_t inputSize,
+                               char *output, size_t outputSize, bool final) {
+  if (convertFunction == nullptr) {
+    return TranscodeResult{0, 0, TranscodeError::UnknownEncoding, 0, 0};
+  }
+
+  auto result = convertFunction(input, inputSize, output, outputSize, final);
+  return TranscodeResult{result.consumed, result.produced,
+                         detail::convertError(result.error),
+                         result.invalidLength, result.codePoint};
+}
+
+// Resolves Encoding::Auto by the BOM at the start of the input
+static Encoding resolveEncoding(Encoding encoding, const char *input,
+                                size_t inputSize, size_t &bomSize) {
+  bomSize = 0;
+  if (encoding != Encoding::Auto) {
+    return encoding;
+  }
+
+  encoding = detail::detectBom(input, inputSize, bomSize);
+  return encoding == Encoding::Unknown ? Encoding::Utf8 : encoding;
+}
+
+TranscodeResult toUtf8(Encoding sourceEncoding, const char *input,
+                       size_t inputSize, char *output, size_t outputSize,
+                       bool final) noexcept {
+  size_t bomSize;
+  sourceEncoding = resolveEncoding(sourceEncoding, input, inputSize, bomSize);
+
+  auto result = convert(detail::decoderFor(sourceEncoding), input + bomSize,
+                        inputSize - bomSize, output, outputSize, final);
+  result.consumed += bomSize;
+  return result;
+}
+
+TranscodeResult fromUtf8(Encoding targetEncoding, const char *input,
+                         size_t inputSize, char *output, size_t outputSize,
+                         bool final) noexcept {
+  detail::DecodeFunction convertFunction = nullptr;
+  switch (targetEncoding) {
+  case Encoding::Utf8:
+    convertFunction = &detail::decodeUtf8;
+    break;
+  case Encoding::Utf16LE:
+    convertFunction = &detail::encodeUtf16LE;
+    break;
+  case Encoding::Utf16BE:
+    convertFunction = &detail::encodeUtf16BE;
+    break;
+  case Encoding::Utf32LE:
+    convertFunction = &detail::encodeUtf32LE;
+    break;
+  case Encoding::Utf32BE:
+    convertFunction = &detail::encodeUtf32BE;
+    break;
+  default:
+    break;
+  }
+
+  return convert(convertFunction, input, inputSize, output, outputSize, final);
+}
+
+TranscodeResult checkedUtf8Length(Encoding sourceEncoding, const char *input,
+                                  size_t inputSize, bool final) noexcept {
+  size_t bomSize;
+  sourceEncoding = resolveEncoding(sourceEncoding, input, inputSize, bomSize);
+
+  auto measureFunction = detail::measurerFor(sourceEncoding);
+  if (measureFunction == nullptr) {
+    return TranscodeResult{0, 0, TranscodeError::UnknownEncoding, 0, 0};
+  }
+
+  auto result = measureFunction(input + bomSize, inputSize - bomSize, final);
+  return TranscodeResult{result.consumed + bomSize, result.produced,
+                         detail::convertError(result.error),
+                         result.invalidLength, result.codePoint};
+}
+
+size_t utf8Length(Encoding sourceEncoding, const char *input,
+                  size_t inputSize) noexcept {
+  size_t bomSize;
+  sourceEncoding = resolveEncoding(sourceEncoding, input, inputSize, bomSize);
+
+  auto measureFunction = detail::measurerFor(sourceEncoding);
+  if (measureFunction == nullptr) {
+    return 0;
+  }
+
+  size_t pos = bomSize;
+  size_t length = 0;
+  while (pos < inputSize) {
+    auto result = measureFunction(input + pos, inputSize - pos, true);
+    pos += result.consumed;
+    length += result.produced;
+
+    if (result.error != detail::DecodeError::None) {
+      pos += result.invalidLength;
+      length += REPLACEMENT_CHARACTER_LENGTH;
+    }
+  }
+
+  return length;
+}
+
+// Decodes the rest of the stream block by block into the output, or only
+// measures it if output is null
+static size_t decodeBlocks(std::istream &stream, Encoding sourceEncoding,
+                           char *output, size_t outputSize) {
+  auto measureFunction = detail::measurerFor(sourceEncoding);
+  auto decodeFunction = detail::decoderFor(sourceEncoding);
+  std::unique_ptr<char[]> block(new char[READ_BLOCK_SIZE]);
+  size_t carried = 0;
+  size_t produced = 0;
+
+  while (true) {
+    stream.read(block.get() + carried,
+                static_cast<std::streamsize>(READ_BLOCK_SIZE - carried));
+    auto size = carried + static_cast<size_t>(stream.gcount());
+    auto final = stream.eof();
+
+    auto result = output == nullptr
+                      ? measureFunction(block.get(), size, final)
+                      : decodeFunction(block.get(), size, output + produced,
+                                       outputSize - produced, final);
+    if (result.error != detail::DecodeError::None) {
+      throw detail::makeDecodeError(result);
+    }
+    produced += result.produced;
+
+    // Only an incomplete sequence is carried over, unless the stream changed
+    // between measuring and decoding
+    carried = size - result.consumed;
+    if (final || result.consumed == 0) {
+      if (carried != 0) {
+        throw Error("Stream changed while reading it");
+      }
+      return produced;
+    }
+    std::memmove(block.get(), block.get() + result.consumed, carried);
+  }
+}
+
+// Reads the rest of a stream which cannot seek and converts it at once
+static std::string readBuffered(std::istream &stream, Encoding sourceEncoding,
+                                bool validateUtf8) {
+  std::string input;
+  const size_t chunkSize = 64 * 1024;
+  while (stream.peek() != std::istream::traits_type::eof()) {
+    auto size = input.size();
+    input.resize(size + chunkSize);
+    stream.read(&input[size], static_cast<std::streamsize>(chunkSize));
+    input.resize(size + static_cast<size_t>(stream.gcount()));
+  }
+  stream.clear(std::ios::eofbit);
+
+  size_t bomSize;
+  sourceEncoding =
+      resolveEncoding(sourceEncoding, input.data(), input.size(), bomSize);
+
+  if (sourceEncoding == Encoding::Utf8 && !validateUtf8) {
+    input.erase(0, bomSize);
+    return input;
+  }
+
+  auto measureFunction = detail::measurerFor(sourceEncoding);
+  if (measureFunction == nullptr) {
+    throw Error("Cannot read stream with unknown encoding");
+  }
+
+  auto result =
+      measureFunction(input.data() + bomSize, input.size() - bomSize, true);
+  if (result.error != detail::DecodeError::None) {
+    throw detail::makeDecodeError(result);
+  }
+
+  if (sourceEncoding == Encoding::Utf8) {
+    input.erase(0, bomSize);
+    return input;
+  }
+
+  std::string output(result.produced, '\0');
+  detail::decoderFor(sourceEncoding)(input.data() + bomSize,
+                                     input.size() - bomSize, &output[0],
+                                     output.size(), true);
+  return output;
+}
+
+std::string readAll(std::istream &stream, Encoding sourceEncoding,
+                    bool validateUtf8) {
+  auto startPos = stream.tellg();
+  if (startPos == std::streampos(-1) || !stream.seekg(0, std::ios::end)) {
+    stream.clear();
+    return readBuffered(stream, sourceEncoding, validateUtf8);
+  }
+  auto endPos = stream.tellg();
+  stream.seekg(startPos);
+
+  char bom[4];
+  stream.read(bom, sizeof(bom));
+  size_t bomSize;
+  sourceEncoding = resolveEncoding(
+      sourceEncoding, bom, static_cast<size_t>(stream.gcount()), bomSize);
+  stream.clear();
+  stream.seekg(startPos + static_cast<std::streamoff>(bomSize));
+
+  // UTF-8 is read as it is, everything else is measured first
+  std::string output;
+  if (sourceEncoding == Encoding::Utf8 && !validateUtf8) {
+    output.resize(static_cast<size_t>(endPos - startPos) - bomSize);
+    stream.read(&output[0], static_cast<std::streamsize>(output.size()));
+    output.resize(static_cast<size_t>(stream.gcount()));
+    stream.clear(std::ios::eofbit);
+    return output;
+  }
+
+  if (detail::measurerFor(sourceEncoding) == nullptr) {
+    throw Error("Cannot read stream with unknown encoding");
+  }
+
+  output.resize(decodeBlocks(stream, sourceEncoding, nullptr, 0));
+  stream.clear();
+  stream.seekg(startPos + static_cast<std::streamoff>(bomSize));
+  if (decodeBlocks(stream, sourceEncoding, &output[0], output.size()) !=
+      output.size()) {
+    throw Error("Stream changed while reading it");
+  }
+
+  stream.clear(std::ios::eofbit);
+  return output;
+}
+
+} // namespace utf8streams
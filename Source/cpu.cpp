@@ -0,0 +1,36 @@
+#include "cpu.hpp"
+
+#if defined(UTF8STREAMS_X86_64) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace utf8streams {
+namespace detail {
+
+bool cpuSupportsAvx2() {
+#if !defined(UTF8STREAMS_X86_64)
+  return false;
+#elif defined(_MSC_VER)
+  int info[4];
+
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+
+  // The OS has to save the YMM registers (OSXSAVE, AVX and XCR0 bits)
+  __cpuid(info, 1);
+  if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 ||
+      (_xgetbv(0) & 6) != 6) {
+    return false;
+  }
+
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+} // namespace detail
+} // namespace utf8streams
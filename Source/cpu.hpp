@@ -0,0 +1,20 @@
+#pragma once
+
+#if !defined(UTF8STREAMS_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#define UTF8STREAMS_X86_64 1
+#include <immintrin.h>
+#endif
+
+#if defined(UTF8STREAMS_X86_64) && (defined(__GNUC__) || defined(__clang__))
+#define UTF8STREAMS_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define UTF8STREAMS_TARGET_AVX2
+#endif
+
+namespace utf8streams {
+namespace detail {
+
+bool cpuSupportsAvx2();
+
+} // namespace detail
+} // namespace utf8streams
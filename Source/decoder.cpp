@@ -0,0 +1,205 @@
+#include "transcode.hpp"
+#include "utf8streams.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace utf8streams {
+
+// Room for any sequence or replacement character in every output encoding.
+// Each of the four carried bytes yields at most one of them, so the 16 bytes
+// of output which decode() requires drain the carry within one call.
+constexpr size_t MIN_OUTPUT_SIZE = 4;
+
+void Decoder::selectEncoding(Encoding encoding) {
+  sourceEncoding = encoding;
+  decodeCallback = detail::transcoderFor(encoding, outputEncoding);
+  if (decodeCallback == nullptr) {
+    throw Error("Cannot create Decoder with unknown encoding");
+  }
+}
+
+// Collects the first four bytes in the carry to look for a BOM. Returns false
+// if more input is needed.
+bool Decoder::resolveEncoding(const char *input, size_t inputSize, bool final,
+                              TranscodeResult &status) {
+  auto count = std::min(inputSize, sizeof(carry) - carrySize);
+  if (count != 0) {
+    std::memcpy(carry + carrySize, input, count);
+  }
+  carrySize += count;
+  status.consumed += count;
+
+  if (carrySize < sizeof(carry) && !final) {
+    return false;
+  }
+
+  size_t bomSize;
+  auto encoding = detail::detectBom(carry, carrySize, bomSize);
+  selectEncoding(encoding == Encoding::Unknown ? Encoding::Utf8 : encoding);
+
+  std::memmove(carry, carry + bomSize, carrySize - bomSize);
+  carrySize -= bomSize;
+  return true;
+}
+
+// Applies the error policy to an invalid sequence at offset in the input.
+// Returns false without counting the error if the output has no room for a
+// replacement character.
+bool Decoder::handleError(const detail::DecodeResult &result,
+                          std::streamoff offset, char *output,
+                          size_t outputSize, TranscodeResult &status) {
+  switch (errorPolicy()) {
+  case ErrorPolicy::Throw:
+    status.error = detail::convertError(result.error);
+    status.invalidLength = result.invalidLength;
+    status.codePoint = result.codePoint;
+    break;
+  case ErrorPolicy::Replace: {
+    size_t size;
+    auto replacement = detail::replacementCharacter(outputEncoding, size);
+    if (outputSize - status.produced < size) {
+      return false;
+    }
+    std::memcpy(output + status.produced, replacement, size);
+    status.produced += size;
+    break;
+  }
+  case ErrorPolicy::Skip:
+    break;
+  }
+
+  countError(offset);
+  return true;
+}
+
+// Decodes the carried bytes together with the start of the input. Returns
+// false if decoding cannot continue with the rest of the input.
+bool Decoder::decodeCarry(const char *input, size_t inputSize, char *output,
+                          size_t outputSize, bool final,
+                          TranscodeResult &status) {
+  // Long enough to complete any sequence which starts in the carry
+  char window[2 * sizeof(carry)];
+
+  while (carrySize != 0) {
+    if (outputSize - status.produced < MIN_OUTPUT_SIZE) {
+      return false;
+    }
+
+    auto count =
+        std::min(inputSize - status.consumed, sizeof(window) - carrySize);
+    std::memcpy(window, carry, carrySize);
+    if (count != 0) {
+      std::memcpy(window + carrySize, input + status.consumed, count);
+    }
+
+    auto last = final && status.consumed + count == inputSize;
+    auto result =
+        decodeCallback(window, carrySize + count, output + status.produced,
+                       outputSize - status.produced, last);
+    status.produced += result.produced;
+
+    // Errors behind the carry are handled when decoding the input
+    auto used = result.consumed;
+    auto handled = true;
+    if (result.error != detail::DecodeError::None && used < carrySize) {
+      auto offset = inputOffset + static_cast<std::streamoff>(
+                                      status.consumed - carrySize + used);
+      handled = handleError(result, offset, output, outputSize, status);
+      if (handled) {
+        used += result.invalidLength;
+      }
+    }
+
+    if (used >= carrySize) {
+      status.consumed += used - carrySize;
+      carrySize = 0;
+    } else if (used != 0) {
+      std::memmove(carry, carry + used, carrySize - used);
+      carrySize -= used;
+    } else if (result.error == detail::DecodeError::None &&
+               status.consumed + count == inputSize && !last) {
+      // Still incomplete, so the whole input joins the carry
+      std::memcpy(carry + carrySize, window + carrySize, count);
+      carrySize += count;
+      status.consumed += count;
+      return false;
+    }
+
+    if (!handled || status.error != TranscodeError::None || used == 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void Decoder::decodeInput(const char *input, size_t inputSize, char *output,
+                          size_t outputSize, bool final,
+                          TranscodeResult &status) {
+  while (status.consumed < inputSize) {
+    auto result = decodeCallback(
+        input + status.consumed, inputSize - status.consumed,
+        output + status.produced, outputSize - status.produced, final);
+    status.consumed += result.consumed;
+    status.produced += result.produced;
+
+    if (result.error == detail::DecodeError::None) {
+      break;
+    }
+
+    auto offset = inputOffset + static_cast<std::streamoff>(status.consumed);
+    if (!handleError(result, offset, output, outputSize, status)) {
+      return;
+    }
+    status.consumed += result.invalidLength;
+    if (status.error != TranscodeError::None) {
+      return;
+    }
+  }
+
+  // Sequences are shorter than the carry unless the output is full
+  auto remaining = inputSize - status.consumed;
+  if (!final && remaining != 0 && remaining < sizeof(carry)) {
+    std::memcpy(carry, input + status.consumed, remaining);
+    carrySize = remaining;
+    status.consumed = inputSize;
+  }
+}
+
+Decoder::Decoder(Encoding sourceEncoding, Encoding targetEncoding)
+    : initialEncoding(sourceEncoding), sourceEncoding(sourceEncoding),
+      outputEncoding(targetEncoding), decodeCallback(nullptr), inputOffset(0),
+      carrySize(0) {
+  if (detail::transcoderFor(Encoding::Utf8, targetEncoding) == nullptr) {
+    throw Error("Decoder can only decode to UTF-8, UTF-16 or UTF-32");
+  }
+
+  if (sourceEncoding != Encoding::Auto) {
+    selectEncoding(sourceEncoding);
+  }
+}
+
+TranscodeResult Decoder::decode(const char *input, size_t inputSize,
+                                char *output, size_t outputSize,
+                                bool final) noexcept {
+  TranscodeResult status{0, 0, TranscodeError::None, 0, 0};
+
+  if ((sourceEncoding != Encoding::Auto ||
+       resolveEncoding(input, inputSize, final, status)) &&
+      decodeCarry(input, inputSize, output, outputSize, final, status)) {
+    decodeInput(input, inputSize, output, outputSize, final, status);
+  }
+
+  inputOffset += static_cast<std::streamoff>(status.consumed);
+  return status;
+}
+
+void Decoder::reset() {
+  sourceEncoding = initialEncoding;
+  inputOffset = 0;
+  carrySize = 0;
+}
+
+Encoding Decoder::encoding() const { return sourceEncoding; }
+
+} // namespace utf8streams
@@ -0,0 +1,84 @@
+#include "transcode.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace utf8streams {
+namespace detail {
+
+// Reads of seekable descriptors end at multiples of this file offset
+constexpr size_t READ_ALIGNMENT = 4096;
+
+#ifdef _WIN32
+
+std::streamoff prepareDescriptor(int descriptor) {
+  return static_cast<std::streamoff>(_lseeki64(descriptor, 0, SEEK_CUR));
+}
+
+static std::streamoff readOnce(int descriptor, char *buffer, size_t n) {
+  return _read(descriptor, buffer,
+               static_cast<unsigned>(std::min<size_t>(n, INT_MAX)));
+}
+
+bool seekDescriptor(int descriptor, std::streamoff offset) {
+  return _lseeki64(descriptor, offset, SEEK_SET) != -1;
+}
+
+#else
+
+std::streamoff prepareDescriptor(int descriptor) {
+  struct stat fileStat;
+  if (fstat(descriptor, &fileStat) == -1 || !S_ISREG(fileStat.st_mode)) {
+    return -1;
+  }
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+  posix_fadvise(descriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  return static_cast<std::streamoff>(lseek(descriptor, 0, SEEK_CUR));
+}
+
+static std::streamoff readOnce(int descriptor, char *buffer, size_t n) {
+  return static_cast<std::streamoff>(
+      read(descriptor, buffer, std::min<size_t>(n, SSIZE_MAX)));
+}
+
+bool seekDescriptor(int descriptor, std::streamoff offset) {
+  return lseek(descriptor, static_cast<off_t>(offset), SEEK_SET) != -1;
+}
+
+#endif
+
+size_t readDescriptor(int descriptor, char *buffer, size_t n,
+                      std::streamoff &offset) {
+  if (offset >= 0 && n > READ_ALIGNMENT) {
+    n -= (static_cast<size_t>(offset) + n) % READ_ALIGNMENT;
+  }
+
+  while (true) {
+    auto readBytes = readOnce(descriptor, buffer, n);
+    if (readBytes >= 0) {
+      if (offset >= 0) {
+        offset += readBytes;
+      }
+      return static_cast<size_t>(readBytes);
+    }
+    if (errno != EINTR) {
+      throw Error(std::string("Cannot read file descriptor: ") +
+                  std::strerror(errno));
+    }
+  }
+}
+
+} // namespace detail
+} // namespace utf8streams
@@ -0,0 +1,132 @@
+#include "transcode.hpp"
+#include "utf8streams.hpp"
+#include <algorithm>
+
+namespace utf8streams {
+
+// The sample may end within a sequence, so only real errors count
+static bool decodesCleanly(detail::DecodeFunction decodeCallback,
+                           const char *data, size_t size) {
+  char output[4096];
+  size_t pos = 0;
+
+  while (pos < size) {
+    auto result = decodeCallback(data + pos, size - pos, output,
+                                 sizeof(output), false);
+    if (result.error != detail::DecodeError::None) {
+      return false;
+    }
+    if (result.consumed == 0) {
+      break;
+    }
+
+    pos += result.consumed;
+  }
+
+  return true;
+}
+
+static size_t distinctBytes(const char *data, size_t size, size_t offset) {
+  bool seen[256] = {};
+  size_t distinct = 0;
+
+  for (auto i = offset; i < size; i += 2) {
+    auto byte = static_cast<uint8_t>(data[i]);
+    distinct += seen[byte] ? 0 : 1;
+    seen[byte] = true;
+  }
+
+  return distinct;
+}
+
+EncodingGuess detectEncoding(const char *data, size_t size) {
+  size_t bomSize;
+  auto encoding = detail::detectBom(data, size, bomSize);
+  if (encoding != Encoding::Unknown) {
+    return EncodingGuess{encoding, 1.0};
+  }
+  if (size == 0) {
+    return EncodingGuess{Encoding::Unknown, 0.0};
+  }
+
+  size_t counts[4] = {0, 0, 0, 0};
+  detail::countZeros(data, size, counts);
+
+  // Share of zero bytes at each offset modulo 4
+  double ratios[4];
+  for (size_t i = 0; i < 4; ++i) {
+    auto positions = std::max<size_t>(1, (size - std::min(size, i) + 3) / 4);
+    ratios[i] = static_cast<double>(counts[i]) / positions;
+  }
+
+  auto even = (ratios[0] + ratios[2]) / 2;
+  auto odd = (ratios[1] + ratios[3]) / 2;
+
+  // Mostly BMP text leaves the two high bytes of every UTF-32 unit empty
+  if (ratios[2] > 0.9 && ratios[3] > 0.9 && ratios[0] < 0.5 &&
+      decodesCleanly(&detail::decodeUtf32LE, data, size)) {
+    return EncodingGuess{Encoding::Utf32LE,
+                         0.95 * (std::min(ratios[2], ratios[3]) - ratios[0])};
+  }
+  if (ratios[0] > 0.9 && ratios[1] > 0.9 && ratios[3] < 0.5 &&
+      decodesCleanly(&detail::decodeUtf32BE, data, size)) {
+    return EncodingGuess{Encoding::Utf32BE,
+                         0.95 * (std::min(ratios[0], ratios[1]) - ratios[3])};
+  }
+
+  // Latin text in UTF-16 has a zero high byte in most units
+  if (odd - even > 0.2 && decodesCleanly(&detail::decodeUtf16LE, data, size)) {
+    return EncodingGuess{Encoding::Utf16LE, 0.95 * (odd - even)};
+  }
+  if (even - odd > 0.2 && decodesCleanly(&detail::decodeUtf16BE, data, size)) {
+    return EncodingGuess{Encoding::Utf16BE, 0.95 * (even - odd)};
+  }
+
+  if (decodesCleanly(&detail::decodeUtf8, data, size)) {
+    auto zeros = counts[0] + counts[1] + counts[2] + counts[3];
+    return EncodingGuess{Encoding::Utf8,
+                         0.9 * (1 - static_cast<double>(zeros) / size)};
+  }
+
+  // Other scripts in UTF-16 are told apart by their surrogates or else by
+  // the high bytes, which vary less than the low bytes within a script
+  auto le = decodesCleanly(&detail::decodeUtf16LE, data, size);
+  auto be = decodesCleanly(&detail::decodeUtf16BE, data, size);
+  if (le && be) {
+    auto evenDistinct = distinctBytes(data, size, 0);
+    auto oddDistinct = distinctBytes(data, size, 1);
+    if (evenDistinct != oddDistinct) {
+      return EncodingGuess{oddDistinct < evenDistinct ? Encoding::Utf16LE
+                                                      : Encoding::Utf16BE,
+                           0.3};
+    }
+  }
+  if (le != be) {
+    return EncodingGuess{le ? Encoding::Utf16LE : Encoding::Utf16BE, 0.5};
+  }
+
+  return EncodingGuess{Encoding::Unknown, 0.0};
+}
+
+EncodingGuess detectEncoding(std::istream &stream) {
+  char sample[16 * 1024];
+
+  auto startPos = stream.tellg();
+  stream.read(sample, sizeof(sample));
+  auto readBytes = static_cast<size_t>(stream.gcount());
+
+  stream.clear();
+  stream.seekg(startPos);
+
+  auto guess = detectEncoding(sample, readBytes);
+
+  size_t bomSize;
+  detail::detectBom(sample, readBytes, bomSize);
+  if (bomSize != 0) {
+    stream.seekg(static_cast<std::streamoff>(bomSize), std::ios::cur);
+  }
+
+  return guess;
+}
+
+} // namespace utf8streams
@@ -0,0 +1,62 @@
+#include "transcode.hpp"
+#include "utf8streams.hpp"
+
+namespace utf8streams {
+
+std::string Line::str() const { return std::string(data, size); }
+
+LineReader::LineReader(detail::DecodingStreamBuf &streamBuf,
+                       bool stripCarriageReturn)
+    : streamBuf(streamBuf), stripCarriageReturn(stripCarriageReturn) {
+  if (streamBuf.outputEncoding != Encoding::Utf8) {
+    throw Error("LineReader requires UTF-8 output");
+  }
+}
+
+bool LineReader::next(Line &line) {
+  carry.clear();
+  auto hasData = false;
+
+  while (true) {
+    if (streamBuf.gptr() == streamBuf.egptr() &&
+        std::streambuf::traits_type::eq_int_type(
+            streamBuf.underflow(), std::streambuf::traits_type::eof())) {
+      if (!hasData) {
+        return false;
+      }
+
+      line = Line{carry.data(), carry.size()};
+      break;
+    }
+
+    hasData = true;
+    auto begin = streamBuf.gptr();
+    auto available = static_cast<size_t>(streamBuf.egptr() - begin);
+    auto length = detail::findByte(begin, available, '\n');
+
+    if (length == available) {
+      // The line continues in the next block
+      carry.append(begin, available);
+      streamBuf.gbump(static_cast<int>(available));
+      continue;
+    }
+
+    streamBuf.gbump(static_cast<int>(length + 1));
+    if (carry.empty()) {
+      line = Line{begin, length};
+    } else {
+      carry.append(begin, length);
+      line = Line{carry.data(), carry.size()};
+    }
+    break;
+  }
+
+  if (stripCarriageReturn && line.size != 0 &&
+      line.data[line.size - 1] == '\r') {
+    --line.size;
+  }
+
+  return true;
+}
+
+} // namespace utf8streams
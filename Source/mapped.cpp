@@ -0,0 +1,214 @@
+#include "transcode.hpp"
+#include "utf8streams.hpp"
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace utf8streams {
+
+// Upper bound of a zero-copy get area, gbump only accepts int offsets
+constexpr size_t MAX_WINDOW_SIZE = 1u << 30u;
+
+#ifdef _WIN32
+
+void MappedUTF8StreamBuf::map(const std::string &path) {
+  auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                          OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    throw Error("Cannot open file " + path);
+  }
+
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize)) {
+    CloseHandle(file);
+    throw Error("Cannot determine size of file " + path);
+  }
+
+  size = static_cast<size_t>(fileSize.QuadPart);
+  if (size == 0) {
+    CloseHandle(file);
+    return;
+  }
+
+  auto mapping =
+      CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (mapping == nullptr) {
+    throw Error("Cannot map file " + path);
+  }
+
+  auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (view == nullptr) {
+    CloseHandle(mapping);
+    throw Error("Cannot map file " + path);
+  }
+
+  data = static_cast<const char *>(view);
+  mappingHandle = mapping;
+}
+
+void MappedUTF8StreamBuf::unmap() {
+  if (data != nullptr) {
+    UnmapViewOfFile(data);
+    CloseHandle(mappingHandle);
+  }
+}
+
+#else
+
+void MappedUTF8StreamBuf::map(const std::string &path) {
+  auto fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw Error("Cannot open file " + path);
+  }
+
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) == -1) {
+    close(fd);
+    throw Error("Cannot determine size of file " + path);
+  }
+
+  size = static_cast<size_t>(fileStat.st_size);
+  if (size == 0) {
+    close(fd);
+    return;
+  }
+
+  auto address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    throw Error("Cannot map file " + path);
+  }
+
+  madvise(address, size, MADV_SEQUENTIAL);
+  data = static_cast<const char *>(address);
+}
+
+void MappedUTF8StreamBuf::unmap() {
+  if (data != nullptr) {
+    munmap(const_cast<char *>(data), size);
+  }
+}
+
+#endif
+
+void MappedUTF8StreamBuf::init(Encoding encoding, bool validateUtf8) {
+  sourceEncoding = encoding;
+  decodeCallback = detail::decoderFor(encoding);
+  if (decodeCallback == nullptr) {
+    unmap();
+    throw Error("Cannot create MappedUTF8StreamBuf with unknown encoding");
+  }
+
+  // Unchecked UTF-8 is copied
+  if (encoding == Encoding::Utf8 && !validateUtf8) {
+    decodeCallback = nullptr;
+  }
+}
+
+size_t MappedUTF8StreamBuf::decodeInto(char *buffer, size_t n) {
+  if (decodeCallback == nullptr) {
+    auto count = std::min(n, size - pos);
+    if (count != 0) {
+      std::memcpy(buffer, data + pos, count);
+    }
+    pos += count;
+    UTF8STREAMS_COUNT(sourceBytes, count);
+    return count;
+  }
+
+  auto start = pos;
+  size_t produced = 0;
+  while (pos != size) {
+    auto result = decodeCallback(data + pos, size - pos, buffer + produced,
+                                 n - produced, true);
+    pos += result.consumed;
+    produced += result.produced;
+
+    if (result.error == detail::DecodeError::None ||
+        !handleError(result, static_cast<std::streamoff>(pos), buffer,
+                     produced, n)) {
+      break;
+    }
+
+    pos += result.invalidLength;
+    if (pendingError) {
+      break;
+    }
+  }
+
+  UTF8STREAMS_COUNT(sourceBytes, pos - start);
+  if (produced == 0 && pendingError) {
+    throwPendingError();
+  }
+  return produced;
+}
+
+bool MappedUTF8StreamBuf::fill() {
+  if (decodeCallback != nullptr) {
+    return DecodingStreamBuf::fill();
+  }
+
+  // Unvalidated UTF-8 is served straight from the mapping
+  auto count = std::min(MAX_WINDOW_SIZE, size - pos);
+  auto begin = const_cast<char *>(data + pos);
+  setg(begin, begin, begin + count);
+  pos += count;
+  UTF8STREAMS_COUNT(sourceBytes, count);
+#ifdef UTF8STREAMS_STATS
+  countOutput(begin, count);
+#endif
+
+  return count != 0;
+}
+
+std::streamsize MappedUTF8StreamBuf::showmanyc() {
+  if (pos == size) {
+    return -1;
+  }
+
+  auto remaining = static_cast<std::streamsize>(size - pos);
+  return decodeCallback == nullptr
+             ? remaining
+             : std::max<std::streamsize>(1, remaining / 4);
+}
+
+MappedUTF8StreamBuf::MappedUTF8StreamBuf(const std::string &path,
+                                         bool validateUtf8)
+    : MappedUTF8StreamBuf(path, Encoding::Auto, validateUtf8) {}
+
+MappedUTF8StreamBuf::MappedUTF8StreamBuf(const std::string &path,
+                                         Encoding sourceEncoding,
+                                         bool validateUtf8)
+    : data(nullptr), size(0), pos(0), mappingHandle(nullptr),
+      sourceEncoding(sourceEncoding), decodeCallback(nullptr) {
+  map(path);
+
+  if (sourceEncoding == Encoding::Auto) {
+    auto encoding = detail::detectBom(data, size, pos);
+    sourceEncoding = encoding == Encoding::Unknown ? Encoding::Utf8 : encoding;
+  }
+
+  init(sourceEncoding, validateUtf8);
+}
+
+MappedUTF8StreamBuf::~MappedUTF8StreamBuf() { unmap(); }
+
+Encoding MappedUTF8StreamBuf::encoding() const { return sourceEncoding; }
+
+} // namespace utf8streams
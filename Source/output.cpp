@@ -0,0 +1,195 @@
+#include "transcode.hpp"
+#include "utf8streams.hpp"
+#include <cstring>
+
+namespace utf8streams {
+
+bool UTF8OutputStreamBuf::encode(const char *input, size_t inputSize,
+                                 size_t &consumed, bool final) {
+  if (encodeCallback == nullptr) {
+    consumed = inputSize;
+    inputOffset += static_cast<std::streamoff>(inputSize);
+    auto n = static_cast<std::streamsize>(inputSize);
+    return originalBuf->sputn(input, n) == n;
+  }
+
+  consumed = 0;
+  while (consumed < inputSize) {
+    auto result = encodeCallback(input + consumed, inputSize - consumed,
+                                 outBuffer, sizeof(outBuffer), final);
+
+    auto n = static_cast<std::streamsize>(result.produced);
+    if (originalBuf->sputn(outBuffer, n) != n) {
+      return false;
+    }
+
+    consumed += result.consumed;
+    if (result.error != detail::DecodeError::None) {
+      countError(inputOffset + static_cast<std::streamoff>(consumed));
+      consumed += result.invalidLength;
+
+      if (errorPolicy() == ErrorPolicy::Throw) {
+        pendingError =
+            std::make_exception_ptr(detail::makeDecodeError(result));
+        break;
+      }
+      if (errorPolicy() == ErrorPolicy::Replace &&
+          !writeReplacementCharacter()) {
+        return false;
+      }
+      continue;
+    }
+    if (result.consumed == 0) {
+      break;
+    }
+  }
+
+  inputOffset += static_cast<std::streamoff>(consumed);
+  return true;
+}
+
+bool UTF8OutputStreamBuf::writeReplacementCharacter() {
+  auto result = encodeCallback(detail::REPLACEMENT_CHARACTER,
+                               sizeof(detail::REPLACEMENT_CHARACTER),
+                               outBuffer, sizeof(outBuffer), true);
+
+  auto n = static_cast<std::streamsize>(result.produced);
+  return originalBuf->sputn(outBuffer, n) == n;
+}
+
+bool UTF8OutputStreamBuf::flushBuffer(bool final) {
+  size_t consumed;
+  if (!encode(pbase(), static_cast<size_t>(pptr() - pbase()), consumed,
+              final)) {
+    return false;
+  }
+
+  auto remaining = static_cast<size_t>(pptr() - pbase()) - consumed;
+  std::memmove(inBuffer, pbase() + consumed, remaining);
+  setp(inBuffer, inBuffer + sizeof(inBuffer));
+  pbump(static_cast<int>(remaining));
+
+  return true;
+}
+
+void UTF8OutputStreamBuf::throwPendingError() {
+  auto error = pendingError;
+  pendingError = nullptr;
+  std::rethrow_exception(error);
+}
+
+int UTF8OutputStreamBuf::overflow(int c) {
+  if (!flushBuffer(false)) {
+    return traits_type::eof();
+  }
+  if (pendingError) {
+    throwPendingError();
+  }
+
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+
+  return traits_type::not_eof(c);
+}
+
+std::streamsize UTF8OutputStreamBuf::xsputn(const char *buffer,
+                                            std::streamsize n) {
+  if (n < static_cast<std::streamsize>(sizeof(inBuffer))) {
+    return std::streambuf::xsputn(buffer, n);
+  }
+
+  if (!flushBuffer(false)) {
+    return 0;
+  }
+  if (pendingError) {
+    throwPendingError();
+  }
+
+  // A split sequence has to be completed in the put area first
+  if (pptr() != pbase()) {
+    return std::streambuf::xsputn(buffer, n);
+  }
+
+  // Large writes bypass the put area
+  size_t consumed;
+  if (!encode(buffer, static_cast<size_t>(n), consumed, false)) {
+    return 0;
+  }
+  if (pendingError) {
+    throwPendingError();
+  }
+
+  auto remaining = static_cast<size_t>(n) - consumed;
+  std::memcpy(pptr(), buffer + consumed, remaining);
+  pbump(static_cast<int>(remaining));
+
+  return n;
+}
+
+int UTF8OutputStreamBuf::sync() {
+  if (!flushBuffer(false)) {
+    return -1;
+  }
+  if (pendingError) {
+    throwPendingError();
+  }
+
+  return originalBuf->pubsync();
+}
+
+UTF8OutputStreamBuf::UTF8OutputStreamBuf(std::ostream &stream,
+                                         Encoding targetEncoding,
+                                         bool writeBom)
+    : originalBuf(stream.rdbuf()), encodeCallback(nullptr), inputOffset(0) {
+  setp(inBuffer, inBuffer + sizeof(inBuffer));
+
+  if (originalBuf == nullptr) {
+    throw Error("Buffer of stream is not set");
+  }
+
+  switch (targetEncoding) {
+  case Encoding::Unknown:
+  case Encoding::Auto:
+    throw Error("Cannot create UTF8OutputStreamBuf with unknown encoding");
+  case Encoding::Utf8:
+    break;
+  case Encoding::Utf16LE:
+    encodeCallback = &detail::encodeUtf16LE;
+    break;
+  case Encoding::Utf16BE:
+    encodeCallback = &detail::encodeUtf16BE;
+    break;
+  case Encoding::Utf32LE:
+    encodeCallback = &detail::encodeUtf32LE;
+    break;
+  case Encoding::Utf32BE:
+    encodeCallback = &detail::encodeUtf32BE;
+    break;
+  case Encoding::Latin1:
+  case Encoding::Windows1252:
+  case Encoding::Iso8859_15:
+    throw Error("UTF8OutputStreamBuf cannot encode to single-byte encodings");
+  }
+
+  // Only taken over once nothing throws anymore
+  stream.rdbuf(this);
+
+  if (writeBom) {
+    size_t bomSize;
+    auto bom = detail::byteOrderMark(targetEncoding, bomSize);
+    originalBuf->sputn(bom, static_cast<std::streamsize>(bomSize));
+  }
+}
+
+UTF8OutputStreamBuf::~UTF8OutputStreamBuf() {
+  // Invalid input is skipped, the stream cannot report it anymore
+  while (flushBuffer(true) && pendingError && pptr() != pbase()) {
+    pendingError = nullptr;
+  }
+
+  originalBuf->pubsync();
+}
+
+} // namespace utf8streams
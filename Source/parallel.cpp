@@ -0,0 +1,165 @@
+#include "transcode.hpp"
+#include "utf8streams.hpp"
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace utf8streams {
+
+// Chunks below this size are not worth a thread
+constexpr size_t MIN_CHUNK_SIZE = 1024 * 1024;
+
+struct Chunk {
+  size_t begin;
+  size_t end;
+  size_t offset;
+  detail::DecodeResult result;
+};
+
+static bool isUtf16Pair(Encoding encoding, const char *units) {
+  auto in = reinterpret_cast<const uint8_t *>(units);
+  auto high = encoding == Encoding::Utf16BE ? in[0] : in[1];
+  auto low = encoding == Encoding::Utf16BE ? in[2] : in[3];
+  return (high & 0xFCu) == 0xD8u && (low & 0xFCu) == 0xDCu;
+}
+
+// Moves pos to a boundary which does not split a code point of valid input
+static size_t alignBoundary(Encoding encoding, const char *input,
+                            size_t inputSize, size_t pos) {
+  switch (encoding) {
+  case Encoding::Utf8: {
+    auto in = reinterpret_cast<const uint8_t *>(input);
+    for (int i = 0; i < 3 && pos < inputSize && (in[pos] & 0xC0u) == 0x80u;
+         ++i) {
+      ++pos;
+    }
+    return pos;
+  }
+  case Encoding::Utf16LE:
+  case Encoding::Utf16BE:
+    pos -= pos % 2;
+    if (pos >= 2 && pos + 2 <= inputSize &&
+        isUtf16Pair(encoding, input + pos - 2)) {
+      pos += 2;
+    }
+    return pos;
+  case Encoding::Utf32LE:
+  case Encoding::Utf32BE:
+    return pos - pos % 4;
+  default:
+    return pos;
+  }
+}
+
+static void runChunks(std::vector<Chunk> &chunks,
+                      void (*work)(Chunk &chunk, const void *context),
+                      const void *context) {
+  std::vector<std::thread> threads;
+  threads.reserve(chunks.size() - 1);
+
+  for (size_t i = 1; i < chunks.size(); ++i) {
+    threads.emplace_back(work, std::ref(chunks[i]), context);
+  }
+  work(chunks[0], context);
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+struct ParallelContext {
+  const char *input;
+  char *output;
+  detail::DecodeFunction convertFunction;
+  detail::MeasureFunction measureFunction;
+};
+
+static void measureChunk(Chunk &chunk, const void *context) {
+  auto ctx = static_cast<const ParallelContext *>(context);
+  chunk.result = ctx->measureFunction(ctx->input + chunk.begin,
+                                      chunk.end - chunk.begin, true);
+}
+
+static void convertChunk(Chunk &chunk, const void *context) {
+  auto ctx = static_cast<const ParallelContext *>(context);
+  ctx->convertFunction(ctx->input + chunk.begin, chunk.end - chunk.begin,
+                       ctx->output + chunk.offset, chunk.result.produced,
+                       true);
+}
+
+TranscodeResult toUtf8Parallel(Encoding sourceEncoding, const char *input,
+                               size_t inputSize, char *output,
+                               size_t outputSize, unsigned threadCount) {
+  size_t bomSize = 0;
+  if (sourceEncoding == Encoding::Auto) {
+    sourceEncoding = detail::detectBom(input, inputSize, bomSize);
+    if (sourceEncoding == Encoding::Unknown) {
+      sourceEncoding = Encoding::Utf8;
+    }
+  }
+
+  if (threadCount == 0) {
+    threadCount = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  auto dataSize = inputSize - bomSize;
+  auto chunkCount = std::min<size_t>(threadCount, dataSize / MIN_CHUNK_SIZE);
+  if (chunkCount <= 1 || sourceEncoding == Encoding::Unknown) {
+    auto result = toUtf8(sourceEncoding, input + bomSize, dataSize, output,
+                         outputSize);
+    result.consumed += bomSize;
+    return result;
+  }
+
+  ParallelContext context{input + bomSize, output,
+                          detail::decoderFor(sourceEncoding),
+                          detail::measurerFor(sourceEncoding)};
+
+  std::vector<Chunk> chunks(chunkCount);
+  size_t begin = 0;
+  for (size_t i = 0; i < chunkCount; ++i) {
+    auto end = i + 1 == chunkCount
+                   ? dataSize
+                   : alignBoundary(sourceEncoding, context.input, dataSize,
+                                   std::max(begin, dataSize / chunkCount *
+                                                       (i + 1)));
+    chunks[i].begin = begin;
+    chunks[i].end = end;
+    begin = end;
+  }
+
+  runChunks(chunks, &measureChunk, &context);
+
+  // Chunks up to the first invalid one are placed by a prefix sum of their
+  // lengths
+  size_t offset = 0;
+  size_t validChunks = 0;
+  for (; validChunks < chunkCount; ++validChunks) {
+    auto &chunk = chunks[validChunks];
+    if (chunk.result.error != detail::DecodeError::None ||
+        outputSize - offset < chunk.result.produced) {
+      break;
+    }
+
+    chunk.offset = offset;
+    offset += chunk.result.produced;
+  }
+
+  if (validChunks != 0) {
+    chunks.resize(validChunks);
+    runChunks(chunks, &convertChunk, &context);
+  }
+  if (validChunks == chunkCount) {
+    return TranscodeResult{inputSize, offset, TranscodeError::None, 0, 0};
+  }
+
+  // The rest is converted sequentially to report the first error exactly
+  auto pos = bomSize + (validChunks != 0 ? chunks.back().end : 0);
+  auto result = toUtf8(sourceEncoding, input + pos, inputSize - pos,
+                       output + offset, outputSize - offset);
+  result.consumed += pos;
+  result.produced += offset;
+  return result;
+}
+
+} // namespace utf8streams
@@ -0,0 +1,88 @@
+#include "prefetch.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace utf8streams {
+namespace detail {
+
+// Spins briefly before sleeping, so a stalled source does not occupy a core
+static void backOff(unsigned &spins) {
+  if (++spins < 64) {
+    std::this_thread::yield();
+  } else {
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+}
+
+Prefetcher::Prefetcher(ReadFunction readFunction)
+    : readFunction(std::move(readFunction)), filled(0), drained(0),
+      stopping(false), readPos(0) {
+  thread = std::thread(&Prefetcher::run, this);
+}
+
+Prefetcher::~Prefetcher() {
+  stopping.store(true, std::memory_order_relaxed);
+  thread.join();
+}
+
+void Prefetcher::run() {
+  unsigned spins = 0;
+
+  while (!stopping.load(std::memory_order_relaxed)) {
+    auto slotIndex = filled.load(std::memory_order_relaxed);
+    if (slotIndex - drained.load(std::memory_order_acquire) == 2) {
+      backOff(spins);
+      continue;
+    }
+    spins = 0;
+
+    auto &slot = slots[slotIndex % 2];
+    try {
+      slot.size = readFunction(slot.data, sizeof(slot.data));
+    } catch (...) {
+      error = std::current_exception();
+      slot.size = 0;
+    }
+
+    filled.store(slotIndex + 1, std::memory_order_release);
+
+    // An empty slot marks the end of the source
+    if (slot.size == 0) {
+      break;
+    }
+  }
+}
+
+size_t Prefetcher::read(char *buffer, size_t n) {
+  auto slotIndex = drained.load(std::memory_order_relaxed);
+
+  unsigned spins = 0;
+  while (filled.load(std::memory_order_acquire) == slotIndex) {
+    backOff(spins);
+  }
+
+  auto &slot = slots[slotIndex % 2];
+  if (slot.size == 0) {
+    if (error) {
+      auto sourceError = error;
+      error = nullptr;
+      std::rethrow_exception(sourceError);
+    }
+    return 0;
+  }
+
+  auto count = std::min(n, slot.size - readPos);
+  std::memcpy(buffer, slot.data + readPos, count);
+  readPos += count;
+
+  if (readPos == slot.size) {
+    readPos = 0;
+    drained.store(slotIndex + 1, std::memory_order_release);
+  }
+
+  return count;
+}
+
+} // namespace detail
+} // namespace utf8streams
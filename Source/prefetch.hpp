@@ -0,0 +1,51 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <thread>
+
+namespace utf8streams {
+namespace detail {
+
+// Reads a source ahead on a helper thread. Two buffers are handed over
+// through a lock-free single-producer/single-consumer ring.
+class Prefetcher {
+public:
+  typedef std::function<size_t(char *buffer, size_t n)> ReadFunction;
+
+  explicit Prefetcher(ReadFunction readFunction);
+
+  Prefetcher(const Prefetcher &) = delete;
+
+  Prefetcher &operator=(const Prefetcher &) = delete;
+
+  // Waits for a pending read of the source to return
+  ~Prefetcher();
+
+  // Blocks until data is available, returns 0 at the end of the source.
+  // Exceptions of the source are rethrown here.
+  size_t read(char *buffer, size_t n);
+
+private:
+  struct Slot {
+    size_t size;
+    char data[64 * 1024];
+  };
+
+  ReadFunction readFunction;
+  Slot slots[2];
+  // Number of slots filled by the helper thread and drained by the consumer
+  std::atomic<uint64_t> filled;
+  std::atomic<uint64_t> drained;
+  std::atomic<bool> stopping;
+  std::exception_ptr error;
+  size_t readPos;
+  std::thread thread;
+
+  void run();
+};
+
+} // namespace detail
+} // namespace utf8streams
@@ -0,0 +1,2475 @@
+#include "transcode.hpp"
+#include "cpu.hpp"
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+namespace utf8streams {
+namespace detail {
+
+static uint16_t swap16(uint16_t n) {
+  return (static_cast<uint32_t>(n & 0xFF00u) >> 8u) |
+         (static_cast<uint32_t>(n & 0xFFu) << 8u);
+}
+
+static uint16_t fromLE16(uint16_t n) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return n;
+#else
+  return swap16(n);
+#endif
+}
+
+static uint16_t fromBE16(uint16_t n) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return swap16(n);
+#else
+  return n;
+#endif
+}
+
+static uint32_t swap32(uint32_t n) {
+  return (n >> 24u) | ((n & 0xFF0000u) >> 8u) | ((n & 0xFF00u) << 8u) |
+         (n << 24u);
+}
+
+static uint32_t fromLE32(uint32_t n) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return n;
+#else
+  return swap32(n);
+#endif
+}
+
+static uint32_t fromBE32(uint32_t n) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return swap32(n);
+#else
+  return n;
+#endif
+}
+
+template <bool BigEndian> static uint16_t loadUnit16(const char *input) {
+  uint16_t unit;
+  std::memcpy(&unit, input, sizeof(unit));
+  return BigEndian ? fromBE16(unit) : fromLE16(unit);
+}
+
+template <bool BigEndian> static uint32_t loadUnit32(const char *input) {
+  uint32_t unit;
+  std::memcpy(&unit, input, sizeof(unit));
+  return BigEndian ? fromBE32(unit) : fromLE32(unit);
+}
+
+static bool isHighSurrogate(uint32_t codePoint) {
+  return codePoint >= 0xD800 && codePoint <= 0xDBFF;
+}
+
+static bool isLowSurrogate(uint32_t codePoint) {
+  return codePoint >= 0xDC00 && codePoint <= 0xDFFF;
+}
+
+static size_t utf8Length(uint32_t unicode) {
+  if (unicode < 0x80) {
+    return 1;
+  }
+  if (unicode < 0x800) {
+    return 2;
+  }
+  if (unicode < 0x10000) {
+    return 3;
+  }
+  return 4;
+}
+
+static void putUnicode(uint32_t unicode, char *output) {
+  auto out = reinterpret_cast<uint8_t *>(output);
+
+  if (unicode < 0x80) {
+    out[0] = static_cast<uint8_t>(unicode);
+  } else if (unicode < 0x800) {
+    out[0] = static_cast<uint8_t>(0xC0u | (unicode >> 6u));
+    out[1] = static_cast<uint8_t>(0x80u | (unicode & 0x3Fu));
+  } else if (unicode < 0x10000) {
+    out[0] = static_cast<uint8_t>(0xE0u | (unicode >> 12u));
+    out[1] = static_cast<uint8_t>(0x80u | ((unicode >> 6u) & 0x3Fu));
+    out[2] = static_cast<uint8_t>(0x80u | (unicode & 0x3Fu));
+  } else {
+    out[0] = static_cast<uint8_t>(0xF0u | (unicode >> 18u));
+    out[1] = static_cast<uint8_t>(0x80u | ((unicode >> 12u) & 0x3Fu));
+    out[2] = static_cast<uint8_t>(0x80u | ((unicode >> 6u) & 0x3Fu));
+    out[3] = static_cast<uint8_t>(0x80u | (unicode & 0x3Fu));
+  }
+}
+
+static DecodeResult success(size_t consumed, size_t produced) {
+  return DecodeResult{consumed, produced, DecodeError::None, 0, 0};
+}
+
+static DecodeResult failure(size_t consumed, size_t produced,
+                            DecodeError error, size_t invalidLength,
+                            uint32_t codePoint = 0) {
+  return DecodeResult{consumed, produced, error, invalidLength, codePoint};
+}
+
+// Only measures the UTF-8 length unless Store is set
+template <bool BigEndian, bool Store = true>
+static DecodeResult decodeUtf16(const char *input, size_t inputSize,
+                                char *output, size_t outputSize, bool final) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 2) {
+    auto codePoint = loadUnit16<BigEndian>(input + pos);
+    uint32_t unicode = codePoint;
+    size_t units = 2;
+
+    if (isHighSurrogate(codePoint)) {
+      if (inputSize - pos < 4) {
+        if (!final) {
+          break;
+        }
+        if (inputSize - pos == 2) {
+          return failure(pos, produced, DecodeError::UnpairedHighSurrogate, 2);
+        }
+        return failure(pos, produced, DecodeError::IncompleteCodePoint,
+                       inputSize - pos);
+      }
+
+      auto codePoint2 = loadUnit16<BigEndian>(input + pos + 2);
+      if (!isLowSurrogate(codePoint2)) {
+        return failure(pos, produced, DecodeError::UnpairedHighSurrogate, 2);
+      }
+
+      unicode = 0x10000 + ((static_cast<uint32_t>(codePoint - 0xD800) << 10u) |
+                           (static_cast<uint32_t>(codePoint2 - 0xDC00)));
+      units = 4;
+    } else if (isLowSurrogate(codePoint)) {
+      return failure(pos, produced, DecodeError::UnpairedLowSurrogate, 2);
+    }
+
+    auto len = utf8Length(unicode);
+    if (outputSize - produced < len) {
+      return success(pos, produced);
+    }
+
+    if (Store) {
+      putUnicode(unicode, output + produced);
+    }
+    produced += len;
+    pos += units;
+  }
+
+  if (final && pos < inputSize && inputSize - pos < 2) {
+    return failure(pos, produced, DecodeError::IncompleteCodePoint,
+                   inputSize - pos);
+  }
+
+  return success(pos, produced);
+}
+
+template <bool BigEndian, bool Store = true>
+static DecodeResult decodeUtf32(const char *input, size_t inputSize,
+                                char *output, size_t outputSize, bool final) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 4) {
+    auto unicode = loadUnit32<BigEndian>(input + pos);
+    if (unicode > 0x10FFFF || (unicode >= 0xD800 && unicode <= 0xDFFF)) {
+      return failure(pos, produced, DecodeError::InvalidCodePoint, 4, unicode);
+    }
+
+    auto len = utf8Length(unicode);
+    if (outputSize - produced < len) {
+      return success(pos, produced);
+    }
+
+    if (Store) {
+      putUnicode(unicode, output + produced);
+    }
+    produced += len;
+    pos += 4;
+  }
+
+  if (final && pos < inputSize) {
+    return failure(pos, produced, DecodeError::IncompleteCodePoint,
+                   inputSize - pos);
+  }
+
+  return success(pos, produced);
+}
+
+template <bool BigEndian>
+static DecodeResult widenUtf16(const char *input, size_t inputSize,
+                               char32_t *output, size_t outputSize,
+                               bool final) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 2 && produced < outputSize) {
+    auto codePoint = loadUnit16<BigEndian>(input + pos);
+    uint32_t unicode = codePoint;
+    size_t units = 2;
+
+    if (isHighSurrogate(codePoint)) {
+      if (inputSize - pos < 4) {
+        if (!final) {
+          break;
+        }
+        if (inputSize - pos == 2) {
+          return failure(pos, produced, DecodeError::UnpairedHighSurrogate, 2);
+        }
+        return failure(pos, produced, DecodeError::IncompleteCodePoint,
+                       inputSize - pos);
+      }
+
+      auto codePoint2 = loadUnit16<BigEndian>(input + pos + 2);
+      if (!isLowSurrogate(codePoint2)) {
+        return failure(pos, produced, DecodeError::UnpairedHighSurrogate, 2);
+      }
+
+      unicode = 0x10000 + ((static_cast<uint32_t>(codePoint - 0xD800) << 10u) |
+                           (static_cast<uint32_t>(codePoint2 - 0xDC00)));
+      units = 4;
+    } else if (isLowSurrogate(codePoint)) {
+      return failure(pos, produced, DecodeError::UnpairedLowSurrogate, 2);
+    }
+
+    output[produced++] = unicode;
+    pos += units;
+  }
+
+  if (final && produced < outputSize && pos < inputSize &&
+      inputSize - pos < 2) {
+    return failure(pos, produced, DecodeError::IncompleteCodePoint,
+                   inputSize - pos);
+  }
+
+  return success(pos, produced);
+}
+
+template <bool BigEndian>
+static DecodeResult widenUtf32(const char *input, size_t inputSize,
+                               char32_t *output, size_t outputSize,
+                               bool final) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 4 && produced < outputSize) {
+    auto unicode = loadUnit32<BigEndian>(input + pos);
+    if (unicode > 0x10FFFF || (unicode >= 0xD800 && unicode <= 0xDFFF)) {
+      return failure(pos, produced, DecodeError::InvalidCodePoint, 4, unicode);
+    }
+
+    output[produced++] = unicode;
+    pos += 4;
+  }
+
+  if (final && produced < outputSize && pos < inputSize &&
+      inputSize - pos < 4) {
+    return failure(pos, produced, DecodeError::IncompleteCodePoint,
+                   inputSize - pos);
+  }
+
+  return success(pos, produced);
+}
+
+// Returns the length of the sequence at the start of the input, or 0 if it is
+// invalid or incomplete
+static size_t checkSequence(const uint8_t *in, size_t size, DecodeError &error,
+                            size_t &invalidLength) {
+  auto lead = in[0];
+  size_t len = 1;
+  uint8_t lower = 0x80;
+  uint8_t upper = 0xBF;
+
+  if (lead < 0x80) {
+    return 1;
+  } else if (lead >= 0xC2 && lead <= 0xDF) {
+    len = 2;
+  } else if (lead >= 0xE0 && lead <= 0xEF) {
+    len = 3;
+    lower = lead == 0xE0 ? 0xA0 : lower;
+    upper = lead == 0xED ? 0x9F : upper;
+  } else if (lead >= 0xF0 && lead <= 0xF4) {
+    len = 4;
+    lower = lead == 0xF0 ? 0x90 : lower;
+    upper = lead == 0xF4 ? 0x8F : upper;
+  } else {
+    error = DecodeError::InvalidSequence;
+    invalidLength = 1;
+    return 0;
+  }
+
+  size_t i = 1;
+  for (; i < len && i < size; ++i) {
+    auto byte = in[i];
+    if (byte < lower || byte > upper) {
+      error = DecodeError::InvalidSequence;
+      invalidLength = i;
+      return 0;
+    }
+
+    lower = 0x80;
+    upper = 0xBF;
+  }
+
+  if (i < len) {
+    error = DecodeError::IncompleteCodePoint;
+    invalidLength = size;
+    return 0;
+  }
+
+  return len;
+}
+
+// Decodes a sequence which was accepted by checkSequence
+static uint32_t loadSequence(const uint8_t *in, size_t len) {
+  switch (len) {
+  case 1:
+    return in[0];
+  case 2:
+    return (static_cast<uint32_t>(in[0] & 0x1Fu) << 6u) | (in[1] & 0x3Fu);
+  case 3:
+    return (static_cast<uint32_t>(in[0] & 0x0Fu) << 12u) |
+           (static_cast<uint32_t>(in[1] & 0x3Fu) << 6u) | (in[2] & 0x3Fu);
+  default:
+    return (static_cast<uint32_t>(in[0] & 0x07u) << 18u) |
+           (static_cast<uint32_t>(in[1] & 0x3Fu) << 12u) |
+           (static_cast<uint32_t>(in[2] & 0x3Fu) << 6u) | (in[3] & 0x3Fu);
+  }
+}
+
+// Validates UTF-8 while copying it unless Copy is unset. The output is laid
+// out exactly like the input, so consumed and produced are always equal.
+template <bool Copy = true>
+static DecodeResult validateUtf8(const char *input, size_t inputSize,
+                                 char *output, size_t outputSize, bool final) {
+  auto in = reinterpret_cast<const uint8_t *>(input);
+  size_t pos = 0;
+
+  while (pos < inputSize) {
+    DecodeError error;
+    size_t invalidLength;
+    auto len = checkSequence(in + pos, inputSize - pos, error, invalidLength);
+    if (len == 0) {
+      if (error == DecodeError::IncompleteCodePoint && !final) {
+        break;
+      }
+      return failure(pos, pos, error, invalidLength);
+    }
+
+    if (outputSize - pos < len) {
+      break;
+    }
+
+    if (Copy) {
+      std::memcpy(output + pos, input + pos, len);
+    }
+    pos += len;
+  }
+
+  return success(pos, pos);
+}
+
+static DecodeResult widenUtf8Sequences(const char *input, size_t inputSize,
+                                       char32_t *output, size_t outputSize,
+                                       bool final) {
+  auto in = reinterpret_cast<const uint8_t *>(input);
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (pos < inputSize && produced < outputSize) {
+    DecodeError error;
+    size_t invalidLength;
+    auto len = checkSequence(in + pos, inputSize - pos, error, invalidLength);
+    if (len == 0) {
+      if (error == DecodeError::IncompleteCodePoint && !final) {
+        break;
+      }
+      return failure(pos, produced, error, invalidLength);
+    }
+
+    output[produced++] = loadSequence(in + pos, len);
+    pos += len;
+  }
+
+  return success(pos, produced);
+}
+
+template <bool BigEndian> static void storeUnit16(uint16_t unit, char *output) {
+  unit = BigEndian ? fromBE16(unit) : fromLE16(unit);
+  std::memcpy(output, &unit, sizeof(unit));
+}
+
+template <bool BigEndian> static void storeUnit32(uint32_t unit, char *output) {
+  unit = BigEndian ? fromBE32(unit) : fromLE32(unit);
+  std::memcpy(output, &unit, sizeof(unit));
+}
+
+// Stores a code point as UTF-16 (UnitSize 2) or UTF-32 (UnitSize 4) and
+// returns its size in bytes
+template <size_t UnitSize, bool BigEndian>
+static size_t putUnit(uint32_t unicode, char *output) {
+  if (UnitSize == 4) {
+    storeUnit32<BigEndian>(unicode, output);
+    return 4;
+  }
+  if (unicode < 0x10000) {
+    storeUnit16<BigEndian>(static_cast<uint16_t>(unicode), output);
+    return 2;
+  }
+
+  unicode -= 0x10000;
+  storeUnit16<BigEndian>(static_cast<uint16_t>(0xD800u | (unicode >> 10u)),
+                         output);
+  storeUnit16<BigEndian>(static_cast<uint16_t>(0xDC00u | (unicode & 0x3FFu)),
+                         output + 2);
+  return 4;
+}
+
+// Encodes UTF-8 as UTF-16 (UnitSize 2) or UTF-32 (UnitSize 4)
+template <size_t UnitSize, bool BigEndian>
+static DecodeResult encodeUnits(const char *input, size_t inputSize,
+                                char *output, size_t outputSize, bool final) {
+  auto in = reinterpret_cast<const uint8_t *>(input);
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (pos < inputSize) {
+    DecodeError error;
+    size_t invalidLength;
+    auto len = checkSequence(in + pos, inputSize - pos, error, invalidLength);
+    if (len == 0) {
+      if (error == DecodeError::IncompleteCodePoint && !final) {
+        break;
+      }
+      return failure(pos, produced, error, invalidLength);
+    }
+
+    auto unicode = loadSequence(in + pos, len);
+    auto size = UnitSize == 2 && unicode >= 0x10000 ? 4 : UnitSize;
+    if (outputSize - produced < size) {
+      break;
+    }
+
+    produced += putUnit<UnitSize, BigEndian>(unicode, output + produced);
+    pos += len;
+  }
+
+  return success(pos, produced);
+}
+
+static void countZeroBytes(const char *input, size_t inputSize,
+                           size_t counts[4]) {
+  for (size_t i = 0; i < inputSize; ++i) {
+    if (input[i] == 0) {
+      ++counts[i % 4];
+    }
+  }
+}
+
+static size_t searchByte(const char *input, size_t inputSize, char byte) {
+  auto found = std::memchr(input, byte, inputSize);
+  return found != nullptr ? static_cast<size_t>(
+                                static_cast<const char *>(found) - input)
+                          : inputSize;
+}
+
+template <bool BigEndian>
+static DecodeResult measureUtf16(const char *input, size_t inputSize,
+                                 bool final) {
+  return decodeUtf16<BigEndian, false>(input, inputSize, nullptr, SIZE_MAX,
+                                       final);
+}
+
+template <bool BigEndian>
+static DecodeResult measureUtf32(const char *input, size_t inputSize,
+                                 bool final) {
+  return decodeUtf32<BigEndian, false>(input, inputSize, nullptr, SIZE_MAX,
+                                       final);
+}
+
+// Code points of the bytes 0x80 to 0xFF of the single-byte encodings. The
+// bytes left undefined by Windows-1252 map to the C1 controls, as in the
+// WHATWG Encoding Standard, so the single-byte decoders never fail.
+static const uint16_t LATIN1_TABLE[128] = {
+    0x0080, 0x0081, 0x0082, 0x0083, 0x0084, 0x0085, 0x0086, 0x0087,
+    0x0088, 0x0089, 0x008A, 0x008B, 0x008C, 0x008D, 0x008E, 0x008F,
+    0x0090, 0x0091, 0x0092, 0x0093, 0x0094, 0x0095, 0x0096, 0x0097,
+    0x0098, 0x0099, 0x009A, 0x009B, 0x009C, 0x009D, 0x009E, 0x009F,
+    0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+    0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+    0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+    0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
+    0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+    0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+    0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+    0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF,
+    0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+    0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+    0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+    0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF,
+};
+
+static const uint16_t WINDOWS1252_TABLE[128] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178,
+    0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x00A4, 0x00A5, 0x00A6, 0x00A7,
+    0x00A8, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+    0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x00B4, 0x00B5, 0x00B6, 0x00B7,
+    0x00B8, 0x00B9, 0x00BA, 0x00BB, 0x00BC, 0x00BD, 0x00BE, 0x00BF,
+    0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+    0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+    0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+    0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF,
+    0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+    0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+    0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+    0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF,
+};
+
+static const uint16_t ISO8859_15_TABLE[128] = {
+    0x0080, 0x0081, 0x0082, 0x0083, 0x0084, 0x0085, 0x0086, 0x0087,
+    0x0088, 0x0089, 0x008A, 0x008B, 0x008C, 0x008D, 0x008E, 0x008F,
+    0x0090, 0x0091, 0x0092, 0x0093, 0x0094, 0x0095, 0x0096, 0x0097,
+    0x0098, 0x0099, 0x009A, 0x009B, 0x009C, 0x009D, 0x009E, 0x009F,
+    0x00A0, 0x00A1, 0x00A2, 0x00A3, 0x20AC, 0x00A5, 0x0160, 0x00A7,
+    0x0161, 0x00A9, 0x00AA, 0x00AB, 0x00AC, 0x00AD, 0x00AE, 0x00AF,
+    0x00B0, 0x00B1, 0x00B2, 0x00B3, 0x017D, 0x00B5, 0x00B6, 0x00B7,
+    0x017E, 0x00B9, 0x00BA, 0x00BB, 0x0152, 0x0153, 0x0178, 0x00BF,
+    0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00C7,
+    0x00C8, 0x00C9, 0x00CA, 0x00CB, 0x00CC, 0x00CD, 0x00CE, 0x00CF,
+    0x00D0, 0x00D1, 0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6, 0x00D7,
+    0x00D8, 0x00D9, 0x00DA, 0x00DB, 0x00DC, 0x00DD, 0x00DE, 0x00DF,
+    0x00E0, 0x00E1, 0x00E2, 0x00E3, 0x00E4, 0x00E5, 0x00E6, 0x00E7,
+    0x00E8, 0x00E9, 0x00EA, 0x00EB, 0x00EC, 0x00ED, 0x00EE, 0x00EF,
+    0x00F0, 0x00F1, 0x00F2, 0x00F3, 0x00F4, 0x00F5, 0x00F6, 0x00F7,
+    0x00F8, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF,
+};
+
+static DecodeResult decodeSingleBytes(const uint16_t *table, const char *input,
+                                      size_t inputSize, char *output,
+                                      size_t outputSize) {
+  auto in = reinterpret_cast<const uint8_t *>(input);
+  size_t pos = 0;
+  size_t produced = 0;
+
+  for (; pos < inputSize; ++pos) {
+    if (in[pos] < 0x80u) {
+      if (produced == outputSize) {
+        break;
+      }
+      output[produced++] = input[pos];
+      continue;
+    }
+
+    uint32_t unicode = table[in[pos] - 0x80u];
+    auto len = utf8Length(unicode);
+    if (outputSize - produced < len) {
+      break;
+    }
+
+    putUnicode(unicode, output + produced);
+    produced += len;
+  }
+
+  return success(pos, produced);
+}
+
+static size_t measureSingleBytes(const uint16_t *table, const char *input,
+                                 size_t inputSize) {
+  auto in = reinterpret_cast<const uint8_t *>(input);
+  size_t length = 0;
+  for (size_t i = 0; i < inputSize; ++i) {
+    length += in[i] < 0x80u ? 1 : utf8Length(table[in[i] - 0x80u]);
+  }
+  return length;
+}
+
+static DecodeResult widenSingleBytes(const uint16_t *table, const char *input,
+                                     size_t inputSize, char32_t *output,
+                                     size_t outputSize) {
+  auto in = reinterpret_cast<const uint8_t *>(input);
+  auto count = std::min(inputSize, outputSize);
+  for (size_t i = 0; i < count; ++i) {
+    output[i] = in[i] < 0x80u ? in[i] : table[in[i] - 0x80u];
+  }
+  return success(count, count);
+}
+
+#if defined(UTF8STREAMS_X86_64)
+static bool isContinuation(uint8_t byte) { return (byte & 0xC0u) == 0x80u; }
+
+// Returns the start of the sequence containing pos, assuming the input before
+// pos is valid
+static size_t sequenceStart(const char *input, size_t pos) {
+  auto in = reinterpret_cast<const uint8_t *>(input);
+
+  for (size_t back = 0; back < 4 && back < pos + 1; ++back) {
+    if (!isContinuation(in[pos - back])) {
+      return pos - back;
+    }
+  }
+
+  return pos;
+}
+
+// Encodes code units which are known not to be surrogates
+static size_t putBmpUnits(const uint16_t *units, size_t count, char *output) {
+  size_t produced = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    putUnicode(units[i], output + produced);
+    produced += utf8Length(units[i]);
+  }
+
+  return produced;
+}
+
+// Encodes code points which are known to be valid
+static size_t putUnicodes(const uint32_t *unicodes, size_t count,
+                          char *output) {
+  size_t produced = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    putUnicode(unicodes[i], output + produced);
+    produced += utf8Length(unicodes[i]);
+  }
+
+  return produced;
+}
+
+static __m128i swapBytes16Sse2(__m128i units) {
+  return _mm_or_si128(_mm_slli_epi16(units, 8), _mm_srli_epi16(units, 8));
+}
+
+static __m128i swapBytes32Sse2(__m128i units) {
+  units = swapBytes16Sse2(units);
+  units = _mm_shufflelo_epi16(units, _MM_SHUFFLE(2, 3, 0, 1));
+  return _mm_shufflehi_epi16(units, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+static bool hasSurrogatesSse2(__m128i units) {
+  auto highBits =
+      _mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xF800)));
+  return _mm_movemask_epi8(_mm_cmpeq_epi16(
+             highBits, _mm_set1_epi16(static_cast<short>(0xD800)))) != 0;
+}
+
+// Encodes eight code units which are known not to be surrogates. Writes up to
+// 24 bytes.
+static size_t putBmpUnitsSse2(__m128i units, char *output) {
+  const auto zero = _mm_setzero_si128();
+
+  auto ascii = _mm_movemask_epi8(_mm_cmpeq_epi16(
+      _mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xFF80))), zero));
+  if (ascii == 0xFFFF) {
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(output),
+                     _mm_packus_epi16(units, units));
+    return 8;
+  }
+
+  auto belowThreeBytes = _mm_movemask_epi8(_mm_cmpeq_epi16(
+      _mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xF800))), zero));
+  if (ascii == 0 && belowThreeBytes == 0xFFFF) {
+    // Only two byte sequences: 110xxxxx 10xxxxxx
+    auto lead = _mm_or_si128(_mm_srli_epi16(units, 6), _mm_set1_epi16(0xC0));
+    auto trail = _mm_or_si128(_mm_and_si128(units, _mm_set1_epi16(0x3F)),
+                              _mm_set1_epi16(0x80));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output),
+                     _mm_or_si128(lead, _mm_slli_epi16(trail, 8)));
+    return 16;
+  }
+
+  uint16_t buffer[8];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(buffer), units);
+  return putBmpUnits(buffer, 8, output);
+}
+
+// Returns a mask of code points above U+10FFFF or in the surrogate range
+static __m128i invalidUnicodesSse2(__m128i unicodes) {
+  auto tooLarge =
+      _mm_cmpgt_epi32(_mm_srli_epi32(unicodes, 16), _mm_set1_epi32(0x10));
+  auto surrogate = _mm_cmpeq_epi32(
+      _mm_and_si128(unicodes, _mm_set1_epi32(static_cast<int>(0xFFFFF800))),
+      _mm_set1_epi32(0xD800));
+  return _mm_or_si128(tooLarge, surrogate);
+}
+
+// Narrows code points below U+10000 to code units
+static __m128i packUnicodesSse2(__m128i unicodes1, __m128i unicodes2) {
+  const auto bias = _mm_set1_epi32(0x8000);
+  auto packed = _mm_packs_epi32(_mm_sub_epi32(unicodes1, bias),
+                                _mm_sub_epi32(unicodes2, bias));
+  return _mm_xor_si128(packed, _mm_set1_epi16(static_cast<short>(0x8000)));
+}
+
+template <bool BigEndian>
+static DecodeResult decodeUtf16Sse2(const char *input, size_t inputSize,
+                                    char *output, size_t outputSize,
+                                    bool final) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 16 && outputSize - produced >= 24) {
+    auto units =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+    if (BigEndian) {
+      units = swapBytes16Sse2(units);
+    }
+
+    if (hasSurrogatesSse2(units)) {
+      auto result = decodeUtf16<BigEndian>(
+          input + pos, 16, output + produced, outputSize - produced, false);
+      if (result.error != DecodeError::None) {
+        result.consumed += pos;
+        result.produced += produced;
+        return result;
+      }
+
+      pos += result.consumed;
+      produced += result.produced;
+      continue;
+    }
+
+    produced += putBmpUnitsSse2(units, output + produced);
+    pos += 16;
+  }
+
+  auto result = decodeUtf16<BigEndian>(input + pos, inputSize - pos,
+                                       output + produced,
+                                       outputSize - produced, final);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+template <bool BigEndian>
+static DecodeResult decodeUtf32Sse2(const char *input, size_t inputSize,
+                                    char *output, size_t outputSize,
+                                    bool final) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 32 && outputSize - produced >= 32) {
+    auto unicodes1 =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+    auto unicodes2 =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos + 16));
+    if (BigEndian) {
+      unicodes1 = swapBytes32Sse2(unicodes1);
+      unicodes2 = swapBytes32Sse2(unicodes2);
+    }
+
+    auto invalid = _mm_or_si128(invalidUnicodesSse2(unicodes1),
+                                invalidUnicodesSse2(unicodes2));
+    if (_mm_movemask_epi8(invalid) != 0) {
+      auto result = decodeUtf32<BigEndian>(
+          input + pos, 32, output + produced, outputSize - produced, false);
+      result.consumed += pos;
+      result.produced += produced;
+      return result;
+    }
+
+    auto supplementary = _mm_and_si128(
+        _mm_or_si128(unicodes1, unicodes2),
+        _mm_set1_epi32(static_cast<int>(0xFFFF0000)));
+    if (_mm_movemask_epi8(
+            _mm_cmpeq_epi32(supplementary, _mm_setzero_si128())) == 0xFFFF) {
+      produced += putBmpUnitsSse2(packUnicodesSse2(unicodes1, unicodes2),
+                                  output + produced);
+      pos += 32;
+      continue;
+    }
+
+    uint32_t buffer[8];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(buffer), unicodes1);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(buffer + 4), unicodes2);
+    produced += putUnicodes(buffer, 8, output + produced);
+    pos += 32;
+  }
+
+  auto result = decodeUtf32<BigEndian>(input + pos, inputSize - pos,
+                                       output + produced,
+                                       outputSize - produced, final);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+template <bool Copy = true>
+static DecodeResult validateUtf8Sse2(const char *input, size_t inputSize,
+                                     char *output, size_t outputSize,
+                                     bool final) {
+  size_t pos = 0;
+
+  while (inputSize - pos >= 16 && outputSize - pos >= 16) {
+    auto bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+
+    if (_mm_movemask_epi8(bytes) == 0) {
+      if (Copy) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output + pos), bytes);
+      }
+      pos += 16;
+      continue;
+    }
+
+    auto result = validateUtf8<Copy>(input + pos, 16,
+                                     Copy ? output + pos : output,
+                                     outputSize - pos, false);
+    if (result.error != DecodeError::None) {
+      result.consumed += pos;
+      result.produced += pos;
+      return result;
+    }
+
+    pos += result.consumed;
+  }
+
+  auto result =
+      validateUtf8<Copy>(input + pos, inputSize - pos,
+                         Copy ? output + pos : output, outputSize - pos, final);
+  result.consumed += pos;
+  result.produced += pos;
+  return result;
+}
+
+template <bool BigEndian>
+static DecodeResult widenUtf16Sse2(const char *input, size_t inputSize,
+                                   char32_t *output, size_t outputSize,
+                                   bool final) {
+  const auto zero = _mm_setzero_si128();
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 16 && outputSize - produced >= 8) {
+    auto units =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+    if (BigEndian) {
+      units = swapBytes16Sse2(units);
+    }
+
+    if (hasSurrogatesSse2(units)) {
+      auto result = widenUtf16<BigEndian>(input + pos, 16, output + produced,
+                                          outputSize - produced, false);
+      if (result.error != DecodeError::None) {
+        result.consumed += pos;
+        result.produced += produced;
+        return result;
+      }
+
+      pos += result.consumed;
+      produced += result.produced;
+      continue;
+    }
+
+    auto out = reinterpret_cast<__m128i *>(output + produced);
+    _mm_storeu_si128(out, _mm_unpacklo_epi16(units, zero));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(units, zero));
+    pos += 16;
+    produced += 8;
+  }
+
+  auto result = widenUtf16<BigEndian>(input + pos, inputSize - pos,
+                                      output + produced, outputSize - produced,
+                                      final);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+template <bool BigEndian>
+static DecodeResult widenUtf32Sse2(const char *input, size_t inputSize,
+                                   char32_t *output, size_t outputSize,
+                                   bool final) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 16 && outputSize - produced >= 4) {
+    auto unicodes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+    if (BigEndian) {
+      unicodes = swapBytes32Sse2(unicodes);
+    }
+
+    if (_mm_movemask_epi8(invalidUnicodesSse2(unicodes)) != 0) {
+      break;
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + produced),
+                     unicodes);
+    pos += 16;
+    produced += 4;
+  }
+
+  auto result = widenUtf32<BigEndian>(input + pos, inputSize - pos,
+                                      output + produced, outputSize - produced,
+                                      final);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+static void widenAsciiSse2(__m128i bytes, char32_t *output) {
+  const auto zero = _mm_setzero_si128();
+  auto units1 = _mm_unpacklo_epi8(bytes, zero);
+  auto units2 = _mm_unpackhi_epi8(bytes, zero);
+  auto out = reinterpret_cast<__m128i *>(output);
+  _mm_storeu_si128(out, _mm_unpacklo_epi16(units1, zero));
+  _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(units1, zero));
+  _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(units2, zero));
+  _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(units2, zero));
+}
+
+static DecodeResult widenUtf8Sse2(const char *input, size_t inputSize,
+                                  char32_t *output, size_t outputSize,
+                                  bool final) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 16 && outputSize - produced >= 16) {
+    auto bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+
+    if (_mm_movemask_epi8(bytes) == 0) {
+      widenAsciiSse2(bytes, output + produced);
+      pos += 16;
+      produced += 16;
+      continue;
+    }
+
+    // Continues with the sequence which crosses the end of the block
+    auto result = widenUtf8Sequences(input + pos, 16, output + produced,
+                                     outputSize - produced, false);
+    if (result.error != DecodeError::None || result.consumed == 0) {
+      break;
+    }
+
+    pos += result.consumed;
+    produced += result.produced;
+  }
+
+  auto result =
+      widenUtf8Sequences(input + pos, inputSize - pos, output + produced,
+                         outputSize - produced, final);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+// Widens 16 ASCII bytes to 16 code units
+template <size_t UnitSize, bool BigEndian>
+static void putAsciiUnitsSse2(__m128i bytes, char *output) {
+  const auto zero = _mm_setzero_si128();
+  auto out = reinterpret_cast<__m128i *>(output);
+
+  auto low = BigEndian ? _mm_unpacklo_epi8(zero, bytes)
+                       : _mm_unpacklo_epi8(bytes, zero);
+  auto high = BigEndian ? _mm_unpackhi_epi8(zero, bytes)
+                        : _mm_unpackhi_epi8(bytes, zero);
+  if (UnitSize == 2) {
+    _mm_storeu_si128(out, low);
+    _mm_storeu_si128(out + 1, high);
+    return;
+  }
+
+  if (BigEndian) {
+    _mm_storeu_si128(out, _mm_unpacklo_epi16(zero, low));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(zero, low));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(zero, high));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(zero, high));
+  } else {
+    _mm_storeu_si128(out, _mm_unpacklo_epi16(low, zero));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(low, zero));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(high, zero));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(high, zero));
+  }
+}
+
+template <size_t UnitSize, bool BigEndian>
+static DecodeResult encodeUnitsSse2(const char *input, size_t inputSize,
+                                    char *output, size_t outputSize,
+                                    bool final) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 16 && outputSize - produced >= 16 * UnitSize) {
+    auto bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+
+    if (_mm_movemask_epi8(bytes) == 0) {
+      putAsciiUnitsSse2<UnitSize, BigEndian>(bytes, output + produced);
+      pos += 16;
+      produced += 16 * UnitSize;
+      continue;
+    }
+
+    auto result = encodeUnits<UnitSize, BigEndian>(
+        input + pos, 16, output + produced, outputSize - produced, false);
+    if (result.error != DecodeError::None) {
+      result.consumed += pos;
+      result.produced += produced;
+      return result;
+    }
+
+    pos += result.consumed;
+    produced += result.produced;
+  }
+
+  auto result = encodeUnits<UnitSize, BigEndian>(
+      input + pos, inputSize - pos, output + produced, outputSize - produced,
+      final);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+static size_t countBits(uint32_t n) {
+  n = n - ((n >> 1u) & 0x55555555u);
+  n = (n & 0x33333333u) + ((n >> 2u) & 0x33333333u);
+  return (((n + (n >> 4u)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24u;
+}
+
+static size_t lowestBit(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+  return static_cast<size_t>(__builtin_ctz(mask));
+#else
+  size_t bit = 0;
+  for (; (mask & 1u) == 0; mask >>= 1u) {
+    ++bit;
+  }
+  return bit;
+#endif
+}
+
+static size_t searchByteSse2(const char *input, size_t inputSize, char byte) {
+  const auto pattern = _mm_set1_epi8(byte);
+  size_t pos = 0;
+
+  for (; inputSize - pos >= 16; pos += 16) {
+    auto bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+    auto mask = static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, pattern)));
+    if (mask != 0) {
+      return pos + lowestBit(mask);
+    }
+  }
+
+  return pos + searchByte(input + pos, inputSize - pos, byte);
+}
+
+// ASCII blocks are copied as they are, the rest of a block after its ASCII
+// prefix goes through the table
+static DecodeResult decodeSingleBytesSse2(const uint16_t *table,
+                                          const char *input, size_t inputSize,
+                                          char *output, size_t outputSize) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 16 && outputSize - produced >= 48) {
+    auto bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output + produced), bytes);
+
+    auto mask = static_cast<uint32_t>(_mm_movemask_epi8(bytes));
+    auto ascii = mask == 0 ? 16 : lowestBit(mask);
+    pos += ascii;
+    produced += ascii;
+    if (ascii == 16) {
+      continue;
+    }
+
+    auto result = decodeSingleBytes(table, input + pos, 16 - ascii,
+                                    output + produced, outputSize - produced);
+    pos += result.consumed;
+    produced += result.produced;
+  }
+
+  auto result = decodeSingleBytes(table, input + pos, inputSize - pos,
+                                  output + produced, outputSize - produced);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+static size_t measureSingleBytesSse2(const uint16_t *table, const char *input,
+                                     size_t inputSize) {
+  size_t pos = 0;
+  size_t length = 0;
+
+  for (; inputSize - pos >= 16; pos += 16) {
+    auto bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+    length += _mm_movemask_epi8(bytes) == 0
+                  ? 16
+                  : measureSingleBytes(table, input + pos, 16);
+  }
+
+  return length + measureSingleBytes(table, input + pos, inputSize - pos);
+}
+
+static DecodeResult widenSingleBytesSse2(const uint16_t *table,
+                                         const char *input, size_t inputSize,
+                                         char32_t *output, size_t outputSize) {
+  size_t pos = 0;
+
+  for (; inputSize - pos >= 16 && outputSize - pos >= 16; pos += 16) {
+    auto bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+    if (_mm_movemask_epi8(bytes) == 0) {
+      widenAsciiSse2(bytes, output + pos);
+    } else {
+      widenSingleBytes(table, input + pos, 16, output + pos, 16);
+    }
+  }
+
+  auto result = widenSingleBytes(table, input + pos, inputSize - pos,
+                                 output + pos, outputSize - pos);
+  result.consumed += pos;
+  result.produced += pos;
+  return result;
+}
+
+static void countZeroBytesSse2(const char *input, size_t inputSize,
+                               size_t counts[4]) {
+  const auto zero = _mm_setzero_si128();
+  size_t pos = 0;
+
+  for (; inputSize - pos >= 16; pos += 16) {
+    auto bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+    auto mask = static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zero)));
+    for (uint32_t i = 0; i < 4; ++i) {
+      counts[i] += countBits(mask & (0x1111u << i));
+    }
+  }
+
+  countZeroBytes(input + pos, inputSize - pos, counts);
+}
+
+template <bool BigEndian>
+static DecodeResult measureUtf16Sse2(const char *input, size_t inputSize,
+                                     bool final) {
+  const auto zero = _mm_setzero_si128();
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 16) {
+    auto units =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+    if (BigEndian) {
+      units = swapBytes16Sse2(units);
+    }
+
+    if (hasSurrogatesSse2(units)) {
+      auto result = measureUtf16<BigEndian>(input + pos, 16, false);
+      if (result.error != DecodeError::None) {
+        result.consumed += pos;
+        result.produced += produced;
+        return result;
+      }
+
+      pos += result.consumed;
+      produced += result.produced;
+      continue;
+    }
+
+    // Every unit takes three bytes, minus one below U+0800 and U+0080
+    auto ascii = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi16(
+        _mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xFF80))),
+        zero)));
+    auto belowThreeBytes =
+        static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi16(
+            _mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xF800))),
+            zero)));
+    produced += 24 - (countBits(ascii) + countBits(belowThreeBytes)) / 2;
+    pos += 16;
+  }
+
+  auto result = measureUtf16<BigEndian>(input + pos, inputSize - pos, final);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+template <bool BigEndian>
+static DecodeResult measureUtf32Sse2(const char *input, size_t inputSize,
+                                     bool final) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 16) {
+    auto unicodes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + pos));
+    if (BigEndian) {
+      unicodes = swapBytes32Sse2(unicodes);
+    }
+
+    if (_mm_movemask_epi8(invalidUnicodesSse2(unicodes)) != 0) {
+      auto result = measureUtf32<BigEndian>(input + pos, 16, false);
+      result.consumed += pos;
+      result.produced += produced;
+      return result;
+    }
+
+    // Valid code points are positive, so signed comparisons work
+    auto shorter = [&](int limit) {
+      return countBits(static_cast<uint32_t>(_mm_movemask_epi8(
+          _mm_cmplt_epi32(unicodes, _mm_set1_epi32(limit)))));
+    };
+    produced += 16 - (shorter(0x80) + shorter(0x800) + shorter(0x10000)) / 4;
+    pos += 16;
+  }
+
+  auto result = measureUtf32<BigEndian>(input + pos, inputSize - pos, final);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+// Encodes eight code units in the range U+0800 to U+FFFF (no surrogates)
+// as 24 bytes. Writes up to 28 bytes.
+static UTF8STREAMS_TARGET_AVX2 void putThreeByteUnits(__m128i units,
+                                                       char *output) {
+  auto lead = _mm_or_si128(_mm_srli_epi16(units, 12), _mm_set1_epi16(0xE0));
+  auto middle = _mm_or_si128(
+      _mm_and_si128(_mm_srli_epi16(units, 6), _mm_set1_epi16(0x3F)),
+      _mm_set1_epi16(0x80));
+  auto trail = _mm_or_si128(_mm_and_si128(units, _mm_set1_epi16(0x3F)),
+                            _mm_set1_epi16(0x80));
+  auto leadMiddle = _mm_or_si128(lead, _mm_slli_epi16(middle, 8));
+
+  const auto compress =
+      _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  _mm_storeu_si128(
+      reinterpret_cast<__m128i *>(output),
+      _mm_shuffle_epi8(_mm_unpacklo_epi16(leadMiddle, trail), compress));
+  _mm_storeu_si128(
+      reinterpret_cast<__m128i *>(output + 12),
+      _mm_shuffle_epi8(_mm_unpackhi_epi16(leadMiddle, trail), compress));
+}
+
+static UTF8STREAMS_TARGET_AVX2 __m256i swapBytes16Avx2(__m256i units) {
+  return _mm256_or_si256(_mm256_slli_epi16(units, 8),
+                         _mm256_srli_epi16(units, 8));
+}
+
+static UTF8STREAMS_TARGET_AVX2 __m256i swapBytes32Avx2(__m256i units) {
+  const auto swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15,
+                                     14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11,
+                                     10, 9, 8, 15, 14, 13, 12);
+  return _mm256_shuffle_epi8(units, swap);
+}
+
+static UTF8STREAMS_TARGET_AVX2 bool hasSurrogatesAvx2(__m256i units) {
+  auto highBits =
+      _mm256_and_si256(units, _mm256_set1_epi16(static_cast<short>(0xF800)));
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi16(
+             highBits, _mm256_set1_epi16(static_cast<short>(0xD800)))) != 0;
+}
+
+// Encodes sixteen code units which are known not to be surrogates. Writes up
+// to 52 bytes.
+static UTF8STREAMS_TARGET_AVX2 size_t putBmpUnitsAvx2(__m256i units,
+                                                       char *output) {
+  const auto zero = _mm256_setzero_si256();
+
+  if (_mm256_testz_si256(units,
+                         _mm256_set1_epi16(static_cast<short>(0xFF80)))) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output),
+                     _mm_packus_epi16(_mm256_castsi256_si128(units),
+                                      _mm256_extracti128_si256(units, 1)));
+    return 16;
+  }
+
+  auto ascii = _mm256_movemask_epi8(_mm256_cmpeq_epi16(
+      _mm256_and_si256(units, _mm256_set1_epi16(static_cast<short>(0xFF80))),
+      zero));
+  auto belowThreeBytes = _mm256_movemask_epi8(_mm256_cmpeq_epi16(
+      _mm256_and_si256(units, _mm256_set1_epi16(static_cast<short>(0xF800))),
+      zero));
+
+  if (ascii == 0 && belowThreeBytes == -1) {
+    // Only two byte sequences: 110xxxxx 10xxxxxx
+    auto lead = _mm256_or_si256(_mm256_srli_epi16(units, 6),
+                                _mm256_set1_epi16(0xC0));
+    auto trail =
+        _mm256_or_si256(_mm256_and_si256(units, _mm256_set1_epi16(0x3F)),
+                        _mm256_set1_epi16(0x80));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(output),
+                        _mm256_or_si256(lead, _mm256_slli_epi16(trail, 8)));
+    return 32;
+  }
+
+  if (belowThreeBytes == 0) {
+    // Only three byte sequences: 1110xxxx 10xxxxxx 10xxxxxx
+    putThreeByteUnits(_mm256_castsi256_si128(units), output);
+    putThreeByteUnits(_mm256_extracti128_si256(units, 1), output + 24);
+    return 48;
+  }
+
+  uint16_t buffer[16];
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(buffer), units);
+  return putBmpUnits(buffer, 16, output);
+}
+
+// Returns a mask of code points above U+10FFFF or in the surrogate range
+static UTF8STREAMS_TARGET_AVX2 __m256i invalidUnicodesAvx2(__m256i unicodes) {
+  auto tooLarge = _mm256_cmpgt_epi32(_mm256_srli_epi32(unicodes, 16),
+                                     _mm256_set1_epi32(0x10));
+  auto surrogate = _mm256_cmpeq_epi32(
+      _mm256_and_si256(unicodes,
+                       _mm256_set1_epi32(static_cast<int>(0xFFFFF800))),
+      _mm256_set1_epi32(0xD800));
+  return _mm256_or_si256(tooLarge, surrogate);
+}
+
+// Narrows code points below U+10000 to code units
+static UTF8STREAMS_TARGET_AVX2 __m256i packUnicodesAvx2(__m256i unicodes1,
+                                                         __m256i unicodes2) {
+  const auto bias = _mm256_set1_epi32(0x8000);
+  auto packed = _mm256_packs_epi32(_mm256_sub_epi32(unicodes1, bias),
+                                   _mm256_sub_epi32(unicodes2, bias));
+  packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+  return _mm256_xor_si256(packed,
+                          _mm256_set1_epi16(static_cast<short>(0x8000)));
+}
+
+template <int N>
+static UTF8STREAMS_TARGET_AVX2 __m256i previousBytesAvx2(__m256i bytes,
+                                                          __m256i previous) {
+  return _mm256_alignr_epi8(
+      bytes, _mm256_permute2x128_si256(previous, bytes, 0x21), 16 - N);
+}
+
+// Error classes of two adjacent bytes for the lookup table validation
+const uint8_t TOO_SHORT = 1u << 0u;
+const uint8_t TOO_LONG = 1u << 1u;
+const uint8_t OVERLONG_3 = 1u << 2u;
+const uint8_t TOO_LARGE = 1u << 3u;
+const uint8_t SURROGATE = 1u << 4u;
+const uint8_t OVERLONG_2 = 1u << 5u;
+const uint8_t TOO_LARGE_1000 = 1u << 6u;
+const uint8_t OVERLONG_4 = 1u << 6u;
+const uint8_t TWO_CONTS = 1u << 7u;
+const uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+// Indexed by the high nibble of the first byte
+const uint8_t BYTE_1_HIGH[16] = {
+    TOO_LONG,
+    TOO_LONG,
+    TOO_LONG,
+    TOO_LONG,
+    TOO_LONG,
+    TOO_LONG,
+    TOO_LONG,
+    TOO_LONG,
+    TWO_CONTS,
+    TWO_CONTS,
+    TWO_CONTS,
+    TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4};
+
+// Indexed by the low nibble of the first byte
+const uint8_t BYTE_1_LOW[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000};
+
+// Indexed by the high nibble of the second byte
+const uint8_t BYTE_2_HIGH[16] = {
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 |
+        OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT};
+
+static UTF8STREAMS_TARGET_AVX2 __m256i loadTableAvx2(const uint8_t *table) {
+  return _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(table)));
+}
+
+// Lookup table based validation as described by Keiser and Lemire in
+// "Validating UTF-8 In Less Than One Instruction Per Byte". Every pair of
+// adjacent bytes is classified by three table lookups whose intersection is
+// non zero for invalid pairs.
+static UTF8STREAMS_TARGET_AVX2 __m256i utf8ErrorsAvx2(__m256i bytes,
+                                                       __m256i previous) {
+  const auto byte1HighTable = loadTableAvx2(BYTE_1_HIGH);
+  const auto byte1LowTable = loadTableAvx2(BYTE_1_LOW);
+  const auto byte2HighTable = loadTableAvx2(BYTE_2_HIGH);
+  const auto lowNibble = _mm256_set1_epi8(0x0F);
+
+  auto previous1 = previousBytesAvx2<1>(bytes, previous);
+  auto byte1High = _mm256_shuffle_epi8(
+      byte1HighTable,
+      _mm256_and_si256(_mm256_srli_epi16(previous1, 4), lowNibble));
+  auto byte1Low = _mm256_shuffle_epi8(byte1LowTable,
+                                      _mm256_and_si256(previous1, lowNibble));
+  auto byte2High = _mm256_shuffle_epi8(
+      byte2HighTable, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), lowNibble));
+  auto specialCases =
+      _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+  // Third and fourth bytes of a sequence have to be continuations
+  auto thirdByte =
+      _mm256_subs_epu8(previousBytesAvx2<2>(bytes, previous),
+                       _mm256_set1_epi8(static_cast<char>(0xE0 - 1)));
+  auto fourthByte =
+      _mm256_subs_epu8(previousBytesAvx2<3>(bytes, previous),
+                       _mm256_set1_epi8(static_cast<char>(0xF0 - 1)));
+  auto mustBeContinuation = _mm256_andnot_si256(
+      _mm256_cmpeq_epi8(_mm256_or_si256(thirdByte, fourthByte),
+                        _mm256_setzero_si256()),
+      _mm256_set1_epi8(static_cast<char>(0x80)));
+
+  return _mm256_xor_si256(mustBeContinuation, specialCases);
+}
+
+// Returns non zero bytes if the last bytes start an incomplete sequence
+static UTF8STREAMS_TARGET_AVX2 __m256i incompleteAvx2(__m256i bytes) {
+  const auto maxValues = _mm256_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, static_cast<char>(0xF0 - 1),
+      static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+  return _mm256_subs_epu8(bytes, maxValues);
+}
+
+template <bool Copy = true>
+static UTF8STREAMS_TARGET_AVX2 DecodeResult
+validateUtf8Avx2(const char *input, size_t inputSize, char *output,
+                 size_t outputSize, bool final) {
+  auto errors = _mm256_setzero_si256();
+  auto previous = _mm256_setzero_si256();
+  auto previousIncomplete = _mm256_setzero_si256();
+  size_t pos = 0;
+
+  while (inputSize - pos >= 32 && outputSize - pos >= 32) {
+    auto bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + pos));
+    if (Copy) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + pos), bytes);
+    }
+
+    if (_mm256_movemask_epi8(bytes) == 0) {
+      errors = _mm256_or_si256(errors, previousIncomplete);
+    } else {
+      errors = _mm256_or_si256(errors, utf8ErrorsAvx2(bytes, previous));
+      previousIncomplete = incompleteAvx2(bytes);
+    }
+
+    if (!_mm256_testz_si256(errors, errors)) {
+      // Let the scalar code locate the error
+      break;
+    }
+
+    previous = bytes;
+    pos += 32;
+  }
+
+  // The last sequence before pos may be incomplete, so restart there
+  if (pos != 0) {
+    pos = sequenceStart(input, pos - 1);
+  }
+
+  auto result =
+      validateUtf8<Copy>(input + pos, inputSize - pos,
+                         Copy ? output + pos : output, outputSize - pos, final);
+  result.consumed += pos;
+  result.produced += pos;
+  return result;
+}
+
+template <bool BigEndian>
+static UTF8STREAMS_TARGET_AVX2 DecodeResult
+decodeUtf16Avx2(const char *input, size_t inputSize, char *output,
+                size_t outputSize, bool final) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 32 && outputSize - produced >= 52) {
+    auto units =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + pos));
+    if (BigEndian) {
+      units = swapBytes16Avx2(units);
+    }
+
+    if (hasSurrogatesAvx2(units)) {
+      auto result = decodeUtf16<BigEndian>(
+          input + pos, 32, output + produced, outputSize - produced, false);
+      if (result.error != DecodeError::None) {
+        result.consumed += pos;
+        result.produced += produced;
+        return result;
+      }
+
+      pos += result.consumed;
+      produced += result.produced;
+      continue;
+    }
+
+    produced += putBmpUnitsAvx2(units, output + produced);
+    pos += 32;
+  }
+
+  auto result = decodeUtf16<BigEndian>(input + pos, inputSize - pos,
+                                       output + produced,
+                                       outputSize - produced, final);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+template <bool BigEndian>
+static UTF8STREAMS_TARGET_AVX2 DecodeResult
+decodeUtf32Avx2(const char *input, size_t inputSize, char *output,
+                size_t outputSize, bool final) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 64 && outputSize - produced >= 64) {
+    auto unicodes1 =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + pos));
+    auto unicodes2 = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(input + pos + 32));
+    if (BigEndian) {
+      unicodes1 = swapBytes32Avx2(unicodes1);
+      unicodes2 = swapBytes32Avx2(unicodes2);
+    }
+
+    auto invalid = _mm256_or_si256(invalidUnicodesAvx2(unicodes1),
+                                   invalidUnicodesAvx2(unicodes2));
+    if (!_mm256_testz_si256(invalid, invalid)) {
+      auto result = decodeUtf32<BigEndian>(
+          input + pos, 64, output + produced, outputSize - produced, false);
+      result.consumed += pos;
+      result.produced += produced;
+      return result;
+    }
+
+    if (_mm256_testz_si256(_mm256_or_si256(unicodes1, unicodes2),
+                           _mm256_set1_epi32(static_cast<int>(0xFFFF0000)))) {
+      produced += putBmpUnitsAvx2(packUnicodesAvx2(unicodes1, unicodes2),
+                                  output + produced);
+      pos += 64;
+      continue;
+    }
+
+    uint32_t buffer[16];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(buffer), unicodes1);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(buffer + 8), unicodes2);
+    produced += putUnicodes(buffer, 16, output + produced);
+    pos += 64;
+  }
+
+  auto result = decodeUtf32<BigEndian>(input + pos, inputSize - pos,
+                                       output + produced,
+                                       outputSize - produced, final);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+// Shuffles moving the 16-bit lanes whose bit is clear in the index to the
+// front
+struct CompressTable {
+  uint8_t shuffles[256][16];
+};
+
+static CompressTable makeCompressTable() {
+  CompressTable table;
+  for (size_t mask = 0; mask < 256; ++mask) {
+    size_t kept = 0;
+    for (size_t lane = 0; lane < 8; ++lane) {
+      if ((mask & (1u << lane)) == 0) {
+        table.shuffles[mask][2 * kept] = static_cast<uint8_t>(2 * lane);
+        table.shuffles[mask][2 * kept + 1] = static_cast<uint8_t>(2 * lane + 1);
+        ++kept;
+      }
+    }
+    std::fill(table.shuffles[mask] + 2 * kept, table.shuffles[mask] + 16,
+              static_cast<uint8_t>(0x80));
+  }
+  return table;
+}
+
+// Stores the 16-bit lanes of units whose bit is clear in dropped as code
+// units. Writes up to 8 * UnitSize bytes.
+template <size_t UnitSize, bool BigEndian>
+static UTF8STREAMS_TARGET_AVX2 size_t putCompressedUnits(
+    __m128i units, uint32_t dropped, const CompressTable &table, char *output) {
+  auto out = reinterpret_cast<__m128i *>(output);
+  auto shuffle = reinterpret_cast<const __m128i *>(table.shuffles[dropped]);
+  auto packed = _mm_shuffle_epi8(units, _mm_loadu_si128(shuffle));
+  auto count = 8 - countBits(dropped);
+
+  if (UnitSize == 2) {
+    _mm_storeu_si128(out, BigEndian ? swapBytes16Sse2(packed) : packed);
+    return 2 * count;
+  }
+
+  auto units1 = _mm_cvtepu16_epi32(packed);
+  auto units2 = _mm_cvtepu16_epi32(_mm_srli_si128(packed, 8));
+  _mm_storeu_si128(out, BigEndian ? swapBytes32Sse2(units1) : units1);
+  _mm_storeu_si128(out + 1, BigEndian ? swapBytes32Sse2(units2) : units2);
+  return 4 * count;
+}
+
+// Converts 16 bytes of ASCII and two-byte sequences, as in Latin, Greek or
+// Cyrillic text, to code units. Returns the bytes consumed, which are 15 if
+// the last byte starts a sequence, or 0 if the scalar code has to handle the
+// bytes. Writes up to 16 * UnitSize bytes.
+template <size_t UnitSize, bool BigEndian>
+static UTF8STREAMS_TARGET_AVX2 size_t
+putTwoByteUnitsAvx2(__m128i bytes, const CompressTable &table, char *output,
+                    size_t &produced) {
+  const auto zero = _mm_setzero_si128();
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(
+          _mm_subs_epu8(bytes, _mm_set1_epi8('\xDF')), zero)) != 0xFFFF) {
+    return 0;
+  }
+
+  // C0 and C1 only start overlong sequences
+  auto leadMask = _mm_cmpeq_epi8(_mm_max_epu8(bytes, _mm_set1_epi8('\xC0')),
+                                 bytes);
+  auto leads = static_cast<uint32_t>(_mm_movemask_epi8(leadMask));
+  auto validLeads = static_cast<uint32_t>(_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_max_epu8(bytes, _mm_set1_epi8('\xC2')), bytes)));
+  if (leads != validLeads) {
+    return 0;
+  }
+
+  auto continuations =
+      static_cast<uint32_t>(_mm_movemask_epi8(bytes)) & ~leads;
+  auto dropped = continuations;
+  size_t length = 16;
+  if ((leads & 0x8000u) != 0) {
+    leads &= 0x7FFFu;
+    dropped |= 0x8000u;
+    length = 15;
+  }
+  if (continuations != leads << 1u) {
+    return 0;
+  }
+
+  auto next = _mm_srli_si128(bytes, 1);
+  __m128i units[2] = {_mm_unpacklo_epi8(bytes, zero),
+                      _mm_unpackhi_epi8(bytes, zero)};
+  __m128i nextUnits[2] = {_mm_unpacklo_epi8(next, zero),
+                          _mm_unpackhi_epi8(next, zero)};
+  __m128i leadMasks[2] = {_mm_unpacklo_epi8(leadMask, leadMask),
+                          _mm_unpackhi_epi8(leadMask, leadMask)};
+
+  for (int i = 0; i < 2; ++i) {
+    auto twoBytes = _mm_or_si128(
+        _mm_slli_epi16(_mm_and_si128(units[i], _mm_set1_epi16(0x1F)), 6),
+        _mm_and_si128(nextUnits[i], _mm_set1_epi16(0x3F)));
+    units[i] = _mm_or_si128(_mm_and_si128(leadMasks[i], twoBytes),
+                            _mm_andnot_si128(leadMasks[i], units[i]));
+
+    produced += putCompressedUnits<UnitSize, BigEndian>(
+        units[i], (dropped >> (8 * i)) & 0xFFu, table, output + produced);
+  }
+
+  return length;
+}
+
+// Widens 32 ASCII bytes to 32 code units
+template <size_t UnitSize, bool BigEndian>
+static UTF8STREAMS_TARGET_AVX2 void putAsciiUnitsAvx2(__m256i bytes,
+                                                      char *output) {
+  auto out = reinterpret_cast<__m256i *>(output);
+  auto low = _mm256_castsi256_si128(bytes);
+  auto high = _mm256_extracti128_si256(bytes, 1);
+
+  if (UnitSize == 2) {
+    auto units1 = _mm256_cvtepu8_epi16(low);
+    auto units2 = _mm256_cvtepu8_epi16(high);
+    if (BigEndian) {
+      units1 = swapBytes16Avx2(units1);
+      units2 = swapBytes16Avx2(units2);
+    }
+
+    _mm256_storeu_si256(out, units1);
+    _mm256_storeu_si256(out + 1, units2);
+    return;
+  }
+
+  __m256i units[4] = {_mm256_cvtepu8_epi32(low),
+                      _mm256_cvtepu8_epi32(_mm_srli_si128(low, 8)),
+                      _mm256_cvtepu8_epi32(high),
+                      _mm256_cvtepu8_epi32(_mm_srli_si128(high, 8))};
+  for (int i = 0; i < 4; ++i) {
+    _mm256_storeu_si256(out + i,
+                        BigEndian ? swapBytes32Avx2(units[i]) : units[i]);
+  }
+}
+
+template <size_t UnitSize, bool BigEndian>
+static UTF8STREAMS_TARGET_AVX2 DecodeResult
+encodeUnitsAvx2(const char *input, size_t inputSize, char *output,
+                size_t outputSize, bool final) {
+  static const auto compressTable = makeCompressTable();
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 32 && outputSize - produced >= 32 * UnitSize) {
+    auto bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + pos));
+
+    if (_mm256_movemask_epi8(bytes) == 0) {
+      putAsciiUnitsAvx2<UnitSize, BigEndian>(bytes, output + produced);
+      pos += 32;
+      produced += 32 * UnitSize;
+      continue;
+    }
+
+    auto consumed = putTwoByteUnitsAvx2<UnitSize, BigEndian>(
+        _mm256_castsi256_si128(bytes), compressTable, output, produced);
+    if (consumed != 0) {
+      pos += consumed;
+      continue;
+    }
+
+    auto result = encodeUnits<UnitSize, BigEndian>(
+        input + pos, 32, output + produced, outputSize - produced, false);
+    if (result.error != DecodeError::None) {
+      result.consumed += pos;
+      result.produced += produced;
+      return result;
+    }
+
+    pos += result.consumed;
+    produced += result.produced;
+  }
+
+  auto result = encodeUnits<UnitSize, BigEndian>(
+      input + pos, inputSize - pos, output + produced, outputSize - produced,
+      final);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+static UTF8STREAMS_TARGET_AVX2 size_t searchByteAvx2(const char *input,
+                                                     size_t inputSize,
+                                                     char byte) {
+  const auto pattern = _mm256_set1_epi8(byte);
+  size_t pos = 0;
+
+  for (; inputSize - pos >= 32; pos += 32) {
+    auto bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + pos));
+    auto mask = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, pattern)));
+    if (mask != 0) {
+      return pos + lowestBit(mask);
+    }
+  }
+
+  return pos + searchByteSse2(input + pos, inputSize - pos, byte);
+}
+
+static UTF8STREAMS_TARGET_AVX2 DecodeResult
+decodeSingleBytesAvx2(const uint16_t *table, const char *input,
+                      size_t inputSize, char *output, size_t outputSize) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 32 && outputSize - produced >= 96) {
+    auto bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + pos));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + produced),
+                        bytes);
+
+    auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(bytes));
+    auto ascii = mask == 0 ? 32 : lowestBit(mask);
+    pos += ascii;
+    produced += ascii;
+    if (ascii == 32) {
+      continue;
+    }
+
+    auto result = decodeSingleBytes(table, input + pos, 32 - ascii,
+                                    output + produced, outputSize - produced);
+    pos += result.consumed;
+    produced += result.produced;
+  }
+
+  auto result = decodeSingleBytesSse2(table, input + pos, inputSize - pos,
+                                      output + produced,
+                                      outputSize - produced);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+static UTF8STREAMS_TARGET_AVX2 size_t measureSingleBytesAvx2(
+    const uint16_t *table, const char *input, size_t inputSize) {
+  size_t pos = 0;
+  size_t length = 0;
+
+  for (; inputSize - pos >= 32; pos += 32) {
+    auto bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + pos));
+    length += _mm256_movemask_epi8(bytes) == 0
+                  ? 32
+                  : measureSingleBytes(table, input + pos, 32);
+  }
+
+  return length + measureSingleBytesSse2(table, input + pos, inputSize - pos);
+}
+
+static UTF8STREAMS_TARGET_AVX2 void
+countZeroBytesAvx2(const char *input, size_t inputSize, size_t counts[4]) {
+  const auto zero = _mm256_setzero_si256();
+  size_t pos = 0;
+
+  for (; inputSize - pos >= 32; pos += 32) {
+    auto bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + pos));
+    auto mask = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, zero)));
+    for (uint32_t i = 0; i < 4; ++i) {
+      counts[i] += countBits(mask & (0x11111111u << i));
+    }
+  }
+
+  countZeroBytes(input + pos, inputSize - pos, counts);
+}
+
+template <bool BigEndian>
+static UTF8STREAMS_TARGET_AVX2 DecodeResult
+measureUtf16Avx2(const char *input, size_t inputSize, bool final) {
+  const auto zero = _mm256_setzero_si256();
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 32) {
+    auto units =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + pos));
+    if (BigEndian) {
+      units = swapBytes16Avx2(units);
+    }
+
+    if (hasSurrogatesAvx2(units)) {
+      auto result = measureUtf16<BigEndian>(input + pos, 32, false);
+      if (result.error != DecodeError::None) {
+        result.consumed += pos;
+        result.produced += produced;
+        return result;
+      }
+
+      pos += result.consumed;
+      produced += result.produced;
+      continue;
+    }
+
+    auto ascii = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi16(
+        _mm256_and_si256(units,
+                         _mm256_set1_epi16(static_cast<short>(0xFF80))),
+        zero)));
+    auto belowThreeBytes =
+        static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi16(
+            _mm256_and_si256(units,
+                             _mm256_set1_epi16(static_cast<short>(0xF800))),
+            zero)));
+    produced += 48 - (countBits(ascii) + countBits(belowThreeBytes)) / 2;
+    pos += 32;
+  }
+
+  auto result = measureUtf16<BigEndian>(input + pos, inputSize - pos, final);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+
+template <bool BigEndian>
+static UTF8STREAMS_TARGET_AVX2 DecodeResult
+measureUtf32Avx2(const char *input, size_t inputSize, bool final) {
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (inputSize - pos >= 32) {
+    auto unicodes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + pos));
+    if (BigEndian) {
+      unicodes = swapBytes32Avx2(unicodes);
+    }
+
+    auto invalid = invalidUnicodesAvx2(unicodes);
+    if (!_mm256_testz_si256(invalid, invalid)) {
+      auto result = measureUtf32<BigEndian>(input + pos, 32, false);
+      result.consumed += pos;
+      result.produced += produced;
+      return result;
+    }
+
+    auto below80 = _mm256_cmpgt_epi32(_mm256_set1_epi32(0x80), unicodes);
+    auto below800 = _mm256_cmpgt_epi32(_mm256_set1_epi32(0x800), unicodes);
+    auto below10000 = _mm256_cmpgt_epi32(_mm256_set1_epi32(0x10000), unicodes);
+    produced += 32 - (countBits(static_cast<uint32_t>(
+                          _mm256_movemask_epi8(below80))) +
+                      countBits(static_cast<uint32_t>(
+                          _mm256_movemask_epi8(below800))) +
+                      countBits(static_cast<uint32_t>(
+                          _mm256_movemask_epi8(below10000)))) /
+                         4;
+    pos += 32;
+  }
+
+  auto result = measureUtf32<BigEndian>(input + pos, inputSize - pos, final);
+  result.consumed += pos;
+  result.produced += produced;
+  return result;
+}
+#endif
+
+template <bool BigEndian> static DecodeFunction selectDecodeUtf16() {
+#if defined(UTF8STREAMS_X86_64)
+  if (cpuSupportsAvx2()) {
+    return &decodeUtf16Avx2<BigEndian>;
+  }
+  return &decodeUtf16Sse2<BigEndian>;
+#else
+  return &decodeUtf16<BigEndian>;
+#endif
+}
+
+template <bool BigEndian> static DecodeFunction selectDecodeUtf32() {
+#if defined(UTF8STREAMS_X86_64)
+  if (cpuSupportsAvx2()) {
+    return &decodeUtf32Avx2<BigEndian>;
+  }
+  return &decodeUtf32Sse2<BigEndian>;
+#else
+  return &decodeUtf32<BigEndian>;
+#endif
+}
+
+static DecodeFunction selectDecodeUtf8() {
+#if defined(UTF8STREAMS_X86_64)
+  if (cpuSupportsAvx2()) {
+    return &validateUtf8Avx2;
+  }
+  return &validateUtf8Sse2;
+#else
+  return &validateUtf8;
+#endif
+}
+
+template <size_t UnitSize, bool BigEndian>
+static DecodeFunction selectEncodeUnits() {
+#if defined(UTF8STREAMS_X86_64)
+  if (cpuSupportsAvx2()) {
+    return &encodeUnitsAvx2<UnitSize, BigEndian>;
+  }
+  return &encodeUnitsSse2<UnitSize, BigEndian>;
+#else
+  return &encodeUnits<UnitSize, BigEndian>;
+#endif
+}
+
+DecodeResult decodeUtf8(const char *input, size_t inputSize, char *output,
+                        size_t outputSize, bool final) {
+  static const auto decode = selectDecodeUtf8();
+  return decode(input, inputSize, output, outputSize, final);
+}
+
+DecodeResult decodeUtf16LE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final) {
+  static const auto decode = selectDecodeUtf16<false>();
+  return decode(input, inputSize, output, outputSize, final);
+}
+
+DecodeResult decodeUtf16BE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final) {
+  static const auto decode = selectDecodeUtf16<true>();
+  return decode(input, inputSize, output, outputSize, final);
+}
+
+DecodeResult decodeUtf32LE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final) {
+  static const auto decode = selectDecodeUtf32<false>();
+  return decode(input, inputSize, output, outputSize, final);
+}
+
+DecodeResult decodeUtf32BE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final) {
+  static const auto decode = selectDecodeUtf32<true>();
+  return decode(input, inputSize, output, outputSize, final);
+}
+
+DecodeResult encodeUtf16LE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final) {
+  static const auto encode = selectEncodeUnits<2, false>();
+  return encode(input, inputSize, output, outputSize, final);
+}
+
+DecodeResult encodeUtf16BE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final) {
+  static const auto encode = selectEncodeUnits<2, true>();
+  return encode(input, inputSize, output, outputSize, final);
+}
+
+DecodeResult encodeUtf32LE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final) {
+  static const auto encode = selectEncodeUnits<4, false>();
+  return encode(input, inputSize, output, outputSize, final);
+}
+
+DecodeResult encodeUtf32BE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final) {
+  static const auto encode = selectEncodeUnits<4, true>();
+  return encode(input, inputSize, output, outputSize, final);
+}
+
+// Widening only uses SSE2, which every x86-64 CPU supports
+DecodeResult widenUtf8(const char *input, size_t inputSize, char32_t *output,
+                       size_t outputSize, bool final) {
+#if defined(UTF8STREAMS_X86_64)
+  return widenUtf8Sse2(input, inputSize, output, outputSize, final);
+#else
+  return widenUtf8Sequences(input, inputSize, output, outputSize, final);
+#endif
+}
+
+DecodeResult widenUtf16LE(const char *input, size_t inputSize,
+                          char32_t *output, size_t outputSize, bool final) {
+#if defined(UTF8STREAMS_X86_64)
+  return widenUtf16Sse2<false>(input, inputSize, output, outputSize, final);
+#else
+  return widenUtf16<false>(input, inputSize, output, outputSize, final);
+#endif
+}
+
+DecodeResult widenUtf16BE(const char *input, size_t inputSize,
+                          char32_t *output, size_t outputSize, bool final) {
+#if defined(UTF8STREAMS_X86_64)
+  return widenUtf16Sse2<true>(input, inputSize, output, outputSize, final);
+#else
+  return widenUtf16<true>(input, inputSize, output, outputSize, final);
+#endif
+}
+
+DecodeResult widenUtf32LE(const char *input, size_t inputSize,
+                          char32_t *output, size_t outputSize, bool final) {
+#if defined(UTF8STREAMS_X86_64)
+  return widenUtf32Sse2<false>(input, inputSize, output, outputSize, final);
+#else
+  return widenUtf32<false>(input, inputSize, output, outputSize, final);
+#endif
+}
+
+DecodeResult widenUtf32BE(const char *input, size_t inputSize,
+                          char32_t *output, size_t outputSize, bool final) {
+#if defined(UTF8STREAMS_X86_64)
+  return widenUtf32Sse2<true>(input, inputSize, output, outputSize, final);
+#else
+  return widenUtf32<true>(input, inputSize, output, outputSize, final);
+#endif
+}
+
+typedef void (*CountFunction)(const char *input, size_t inputSize,
+                              size_t counts[4]);
+
+static CountFunction selectCountZeroBytes() {
+#if defined(UTF8STREAMS_X86_64)
+  if (cpuSupportsAvx2()) {
+    return &countZeroBytesAvx2;
+  }
+  return &countZeroBytesSse2;
+#else
+  return &countZeroBytes;
+#endif
+}
+
+void countZeros(const char *input, size_t inputSize, size_t counts[4]) {
+  static const auto count = selectCountZeroBytes();
+  count(input, inputSize, counts);
+}
+
+typedef size_t (*SearchFunction)(const char *input, size_t inputSize,
+                                 char byte);
+
+static SearchFunction selectSearchByte() {
+#if defined(UTF8STREAMS_X86_64)
+  if (cpuSupportsAvx2()) {
+    return &searchByteAvx2;
+  }
+  return &searchByteSse2;
+#else
+  return &searchByte;
+#endif
+}
+
+size_t findByte(const char *input, size_t inputSize, char byte) {
+  static const auto search = selectSearchByte();
+  return search(input, inputSize, byte);
+}
+
+#if defined(UTF8STREAMS_X86_64)
+static DecodeResult checkUtf8Sse2(const char *input, size_t inputSize,
+                                  bool final) {
+  return validateUtf8Sse2<false>(input, inputSize, nullptr, SIZE_MAX, final);
+}
+
+static UTF8STREAMS_TARGET_AVX2 DecodeResult
+checkUtf8Avx2(const char *input, size_t inputSize, bool final) {
+  return validateUtf8Avx2<false>(input, inputSize, nullptr, SIZE_MAX, final);
+}
+#else
+static DecodeResult checkUtf8(const char *input, size_t inputSize,
+                              bool final) {
+  return validateUtf8<false>(input, inputSize, nullptr, SIZE_MAX, final);
+}
+#endif
+
+static MeasureFunction selectMeasureUtf8() {
+#if defined(UTF8STREAMS_X86_64)
+  if (cpuSupportsAvx2()) {
+    return &checkUtf8Avx2;
+  }
+  return &checkUtf8Sse2;
+#else
+  return &checkUtf8;
+#endif
+}
+
+template <bool BigEndian> static MeasureFunction selectMeasureUtf16() {
+#if defined(UTF8STREAMS_X86_64)
+  if (cpuSupportsAvx2()) {
+    return &measureUtf16Avx2<BigEndian>;
+  }
+  return &measureUtf16Sse2<BigEndian>;
+#else
+  return &measureUtf16<BigEndian>;
+#endif
+}
+
+template <bool BigEndian> static MeasureFunction selectMeasureUtf32() {
+#if defined(UTF8STREAMS_X86_64)
+  if (cpuSupportsAvx2()) {
+    return &measureUtf32Avx2<BigEndian>;
+  }
+  return &measureUtf32Sse2<BigEndian>;
+#else
+  return &measureUtf32<BigEndian>;
+#endif
+}
+
+DecodeResult measureUtf8(const char *input, size_t inputSize, bool final) {
+  static const auto measure = selectMeasureUtf8();
+  return measure(input, inputSize, final);
+}
+
+DecodeResult measureUtf16LE(const char *input, size_t inputSize, bool final) {
+  static const auto measure = selectMeasureUtf16<false>();
+  return measure(input, inputSize, final);
+}
+
+DecodeResult measureUtf16BE(const char *input, size_t inputSize, bool final) {
+  static const auto measure = selectMeasureUtf16<true>();
+  return measure(input, inputSize, final);
+}
+
+DecodeResult measureUtf32LE(const char *input, size_t inputSize, bool final) {
+  static const auto measure = selectMeasureUtf32<false>();
+  return measure(input, inputSize, final);
+}
+
+DecodeResult measureUtf32BE(const char *input, size_t inputSize, bool final) {
+  static const auto measure = selectMeasureUtf32<true>();
+  return measure(input, inputSize, final);
+}
+
+typedef DecodeResult (*SingleByteDecodeFunction)(const uint16_t *table,
+                                                 const char *input,
+                                                 size_t inputSize,
+                                                 char *output,
+                                                 size_t outputSize);
+
+typedef size_t (*SingleByteMeasureFunction)(const uint16_t *table,
+                                            const char *input,
+                                            size_t inputSize);
+
+static SingleByteDecodeFunction selectDecodeSingleBytes() {
+#if defined(UTF8STREAMS_X86_64)
+  if (cpuSupportsAvx2()) {
+    return &decodeSingleBytesAvx2;
+  }
+  return &decodeSingleBytesSse2;
+#else
+  return &decodeSingleBytes;
+#endif
+}
+
+static SingleByteMeasureFunction selectMeasureSingleBytes() {
+#if defined(UTF8STREAMS_X86_64)
+  if (cpuSupportsAvx2()) {
+    return &measureSingleBytesAvx2;
+  }
+  return &measureSingleBytesSse2;
+#else
+  return &measureSingleBytes;
+#endif
+}
+
+static DecodeResult decodeWithTable(const uint16_t *table, const char *input,
+                                    size_t inputSize, char *output,
+                                    size_t outputSize) {
+  static const auto decode = selectDecodeSingleBytes();
+  return decode(table, input, inputSize, output, outputSize);
+}
+
+static DecodeResult measureWithTable(const uint16_t *table, const char *input,
+                                     size_t inputSize) {
+  static const auto measure = selectMeasureSingleBytes();
+  return success(inputSize, measure(table, input, inputSize));
+}
+
+static DecodeResult widenWithTable(const uint16_t *table, const char *input,
+                                   size_t inputSize, char32_t *output,
+                                   size_t outputSize) {
+#if defined(UTF8STREAMS_X86_64)
+  return widenSingleBytesSse2(table, input, inputSize, output, outputSize);
+#else
+  return widenSingleBytes(table, input, inputSize, output, outputSize);
+#endif
+}
+
+DecodeResult decodeLatin1(const char *input, size_t inputSize, char *output,
+                          size_t outputSize, bool) {
+  return decodeWithTable(LATIN1_TABLE, input, inputSize, output, outputSize);
+}
+
+DecodeResult decodeWindows1252(const char *input, size_t inputSize,
+                               char *output, size_t outputSize, bool) {
+  return decodeWithTable(WINDOWS1252_TABLE, input, inputSize, output,
+                         outputSize);
+}
+
+DecodeResult decodeIso8859_15(const char *input, size_t inputSize,
+                              char *output, size_t outputSize, bool) {
+  return decodeWithTable(ISO8859_15_TABLE, input, inputSize, output,
+                         outputSize);
+}
+
+DecodeResult measureLatin1(const char *input, size_t inputSize, bool) {
+  return measureWithTable(LATIN1_TABLE, input, inputSize);
+}
+
+DecodeResult measureWindows1252(const char *input, size_t inputSize, bool) {
+  return measureWithTable(WINDOWS1252_TABLE, input, inputSize);
+}
+
+DecodeResult measureIso8859_15(const char *input, size_t inputSize, bool) {
+  return measureWithTable(ISO8859_15_TABLE, input, inputSize);
+}
+
+DecodeResult widenLatin1(const char *input, size_t inputSize,
+                         char32_t *output, size_t outputSize, bool) {
+  return widenWithTable(LATIN1_TABLE, input, inputSize, output, outputSize);
+}
+
+DecodeResult widenWindows1252(const char *input, size_t inputSize,
+                              char32_t *output, size_t outputSize, bool) {
+  return widenWithTable(WINDOWS1252_TABLE, input, inputSize, output,
+                        outputSize);
+}
+
+DecodeResult widenIso8859_15(const char *input, size_t inputSize,
+                             char32_t *output, size_t outputSize, bool) {
+  return widenWithTable(ISO8859_15_TABLE, input, inputSize, output,
+                        outputSize);
+}
+
+typedef DecodeResult (*WidenFunction)(const char *input, size_t inputSize,
+                                      char32_t *output, size_t outputSize,
+                                      bool final);
+
+// Converts to UTF-16 (UnitSize 2) or UTF-32 (UnitSize 4) through a buffer of
+// code points instead of UTF-8
+template <WidenFunction Widen, size_t UnitSize, bool BigEndian>
+static DecodeResult transcodeUnits(const char *input, size_t inputSize,
+                                   char *output, size_t outputSize,
+                                   bool final) {
+  char32_t codePoints[1024];
+  size_t pos = 0;
+  size_t produced = 0;
+
+  while (true) {
+    // Even a surrogate pair fits for every code point
+    auto count = std::min(sizeof(codePoints) / sizeof(char32_t),
+                          (outputSize - produced) / 4);
+    if (count == 0) {
+      return success(pos, produced);
+    }
+
+    auto result =
+        Widen(input + pos, inputSize - pos, codePoints, count, final);
+    for (size_t i = 0; i < result.produced; ++i) {
+      produced +=
+          putUnit<UnitSize, BigEndian>(codePoints[i], output + produced);
+    }
+    pos += result.consumed;
+
+    if (result.error != DecodeError::None) {
+      return failure(pos, produced, result.error, result.invalidLength,
+                     result.codePoint);
+    }
+    if (result.produced < count) {
+      return success(pos, produced);
+    }
+  }
+}
+
+template <size_t UnitSize, bool BigEndian>
+static DecodeFunction transcoderTo(Encoding sourceEncoding) {
+  switch (sourceEncoding) {
+  case Encoding::Utf8:
+    return selectEncodeUnits<UnitSize, BigEndian>();
+  case Encoding::Utf16LE:
+    return &transcodeUnits<&widenUtf16LE, UnitSize, BigEndian>;
+  case Encoding::Utf16BE:
+    return &transcodeUnits<&widenUtf16BE, UnitSize, BigEndian>;
+  case Encoding::Utf32LE:
+    return &transcodeUnits<&widenUtf32LE, UnitSize, BigEndian>;
+  case Encoding::Utf32BE:
+    return &transcodeUnits<&widenUtf32BE, UnitSize, BigEndian>;
+  case Encoding::Latin1:
+    return &transcodeUnits<&widenLatin1, UnitSize, BigEndian>;
+  case Encoding::Windows1252:
+    return &transcodeUnits<&widenWindows1252, UnitSize, BigEndian>;
+  case Encoding::Iso8859_15:
+    return &transcodeUnits<&widenIso8859_15, UnitSize, BigEndian>;
+  default:
+    return nullptr;
+  }
+}
+
+DecodeFunction decoderFor(Encoding sourceEncoding) {
+  switch (sourceEncoding) {
+  case Encoding::Utf8:
+    return &decodeUtf8;
+  case Encoding::Utf16LE:
+    return &decodeUtf16LE;
+  case Encoding::Utf16BE:
+    return &decodeUtf16BE;
+  case Encoding::Utf32LE:
+    return &decodeUtf32LE;
+  case Encoding::Utf32BE:
+    return &decodeUtf32BE;
+  case Encoding::Latin1:
+    return &decodeLatin1;
+  case Encoding::Windows1252:
+    return &decodeWindows1252;
+  case Encoding::Iso8859_15:
+    return &decodeIso8859_15;
+  default:
+    return nullptr;
+  }
+}
+
+MeasureFunction measurerFor(Encoding sourceEncoding) {
+  switch (sourceEncoding) {
+  case Encoding::Utf8:
+    return &measureUtf8;
+  case Encoding::Utf16LE:
+    return &measureUtf16LE;
+  case Encoding::Utf16BE:
+    return &measureUtf16BE;
+  case Encoding::Utf32LE:
+    return &measureUtf32LE;
+  case Encoding::Utf32BE:
+    return &measureUtf32BE;
+  case Encoding::Latin1:
+    return &measureLatin1;
+  case Encoding::Windows1252:
+    return &measureWindows1252;
+  case Encoding::Iso8859_15:
+    return &measureIso8859_15;
+  default:
+    return nullptr;
+  }
+}
+
+DecodeFunction transcoderFor(Encoding sourceEncoding,
+                             Encoding targetEncoding) {
+  switch (targetEncoding) {
+  case Encoding::Utf8:
+    return decoderFor(sourceEncoding);
+  case Encoding::Utf16LE:
+    return transcoderTo<2, false>(sourceEncoding);
+  case Encoding::Utf16BE:
+    return transcoderTo<2, true>(sourceEncoding);
+  case Encoding::Utf32LE:
+    return transcoderTo<4, false>(sourceEncoding);
+  case Encoding::Utf32BE:
+    return transcoderTo<4, true>(sourceEncoding);
+  default:
+    return nullptr;
+  }
+}
+
+std::string errorMessage(const TranscodeResult &result) {
+  switch (result.error) {
+  case TranscodeError::IncompleteCodePoint:
+    return "Incomplete code point found";
+  case TranscodeError::UnpairedHighSurrogate:
+    return "High surrogate found without following low surrogate";
+  case TranscodeError::UnpairedLowSurrogate:
+    return "Low surrogate found without leading high surrogate";
+  case TranscodeError::InvalidSequence:
+    return "Invalid UTF-8 sequence found";
+  case TranscodeError::InvalidCodePoint:
+    return "Invalid Unicode sign " + std::to_string(result.codePoint);
+  default:
+    return "Unknown decoding error";
+  }
+}
+
+UnicodeError makeDecodeError(const DecodeResult &result) {
+  return UnicodeError(errorMessage(
+      TranscodeResult{result.consumed, result.produced,
+                      convertError(result.error), result.invalidLength,
+                      result.codePoint}));
+}
+
+} // namespace detail
+} // namespace utf8streams
@@ -0,0 +1,187 @@
+#pragma once
+#include "utf8streams.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Adds to a counter of StreamStats within DecodeTracker
+#ifdef UTF8STREAMS_STATS
+#define UTF8STREAMS_COUNT(counter, n) (counters.counter += (n))
+#else
+#define UTF8STREAMS_COUNT(counter, n) static_cast<void>(n)
+#endif
+
+namespace utf8streams {
+namespace detail {
+
+enum class DecodeError : uint8_t {
+  None,
+  IncompleteCodePoint,
+  UnpairedHighSurrogate,
+  UnpairedLowSurrogate,
+  InvalidCodePoint,
+  InvalidSequence
+};
+
+// U+FFFD in UTF-8
+constexpr char REPLACEMENT_CHARACTER[] = {'\xEF', '\xBF', '\xBD'};
+
+constexpr char32_t REPLACEMENT_CODE_POINT = 0xFFFD;
+
+// On error, consumed is the offset of the invalid sequence within the input
+// and invalidLength its length in bytes.
+struct DecodeResult {
+  size_t consumed;
+  size_t produced;
+  DecodeError error;
+  size_t invalidLength;
+  uint32_t codePoint;
+};
+
+typedef DecodeResult (*DecodeFunction)(const char *input, size_t inputSize,
+                                       char *output, size_t outputSize,
+                                       bool final);
+
+DecodeResult decodeUtf8(const char *input, size_t inputSize, char *output,
+                        size_t outputSize, bool final);
+
+DecodeResult decodeUtf16LE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final);
+
+DecodeResult decodeUtf16BE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final);
+
+DecodeResult decodeUtf32LE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final);
+
+DecodeResult decodeUtf32BE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final);
+
+// The single-byte decoders map every byte and never fail
+DecodeResult decodeLatin1(const char *input, size_t inputSize, char *output,
+                          size_t outputSize, bool final);
+
+DecodeResult decodeWindows1252(const char *input, size_t inputSize,
+                               char *output, size_t outputSize, bool final);
+
+DecodeResult decodeIso8859_15(const char *input, size_t inputSize,
+                              char *output, size_t outputSize, bool final);
+
+// Validate like the decoders, but only compute the length of the UTF-8 output
+// as produced
+DecodeResult measureUtf8(const char *input, size_t inputSize, bool final);
+
+DecodeResult measureUtf16LE(const char *input, size_t inputSize, bool final);
+
+DecodeResult measureUtf16BE(const char *input, size_t inputSize, bool final);
+
+DecodeResult measureUtf32LE(const char *input, size_t inputSize, bool final);
+
+DecodeResult measureUtf32BE(const char *input, size_t inputSize, bool final);
+
+DecodeResult measureLatin1(const char *input, size_t inputSize, bool final);
+
+DecodeResult measureWindows1252(const char *input, size_t inputSize,
+                                bool final);
+
+DecodeResult measureIso8859_15(const char *input, size_t inputSize,
+                               bool final);
+
+typedef DecodeResult (*MeasureFunction)(const char *input, size_t inputSize,
+                                        bool final);
+
+// The encoders convert UTF-8 input and report errors the same way
+DecodeResult encodeUtf16LE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final);
+
+DecodeResult encodeUtf16BE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final);
+
+DecodeResult encodeUtf32LE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final);
+
+DecodeResult encodeUtf32BE(const char *input, size_t inputSize, char *output,
+                           size_t outputSize, bool final);
+
+// Decode to code points, produced counts code points instead of bytes
+DecodeResult widenUtf8(const char *input, size_t inputSize, char32_t *output,
+                       size_t outputSize, bool final);
+
+DecodeResult widenUtf16LE(const char *input, size_t inputSize,
+                          char32_t *output, size_t outputSize, bool final);
+
+DecodeResult widenUtf16BE(const char *input, size_t inputSize,
+                          char32_t *output, size_t outputSize, bool final);
+
+DecodeResult widenUtf32LE(const char *input, size_t inputSize,
+                          char32_t *output, size_t outputSize, bool final);
+
+DecodeResult widenUtf32BE(const char *input, size_t inputSize,
+                          char32_t *output, size_t outputSize, bool final);
+
+DecodeResult widenLatin1(const char *input, size_t inputSize,
+                         char32_t *output, size_t outputSize, bool final);
+
+DecodeResult widenWindows1252(const char *input, size_t inputSize,
+                              char32_t *output, size_t outputSize, bool final);
+
+DecodeResult widenIso8859_15(const char *input, size_t inputSize,
+                             char32_t *output, size_t outputSize, bool final);
+
+// Return the decoder or measuring function of a source encoding, nullptr for
+// Encoding::Auto and Encoding::Unknown
+DecodeFunction decoderFor(Encoding sourceEncoding);
+
+MeasureFunction measurerFor(Encoding sourceEncoding);
+
+// Converts the source encoding directly to UTF-8, UTF-16 or UTF-32 and
+// reports errors like the decoders. Returns nullptr for other encodings.
+DecodeFunction transcoderFor(Encoding sourceEncoding, Encoding targetEncoding);
+
+// Returns U+FFFD in UTF-8, UTF-16 or UTF-32, nullptr for other encodings
+const char *replacementCharacter(Encoding encoding, size_t &size);
+
+// Size of the code units of the encoding in bytes
+constexpr std::streamsize unitSizeOf(Encoding encoding) {
+  return encoding == Encoding::Utf16LE || encoding == Encoding::Utf16BE   ? 2
+         : encoding == Encoding::Utf32LE || encoding == Encoding::Utf32BE ? 4
+                                                                          : 1;
+}
+
+// Reads what the source has buffered, but blocks for at most blockSize bytes
+// if nothing is buffered
+std::streamsize readAvailable(std::streambuf *source, char *buffer,
+                              std::streamsize n, std::streamsize blockSize);
+
+// Returns the current offset of a regular file and hints sequential access,
+// -1 for other descriptors
+std::streamoff prepareDescriptor(int descriptor);
+
+// Retries on EINTR and throws Error on failure. If offset is not -1, the read
+// is shortened to end at a block boundary and offset is advanced.
+size_t readDescriptor(int descriptor, char *buffer, size_t n,
+                      std::streamoff &offset);
+
+bool seekDescriptor(int descriptor, std::streamoff offset);
+
+// Adds the number of zero bytes at each offset modulo 4 to counts
+void countZeros(const char *input, size_t inputSize, size_t counts[4]);
+
+// Returns the index of the first occurrence of byte, or inputSize
+size_t findByte(const char *input, size_t inputSize, char byte);
+
+// Returns nullptr for Encoding::Unknown
+const char *byteOrderMark(Encoding encoding, size_t &bomSize);
+
+// Returns Encoding::Unknown and sets bomSize to 0 if no BOM is present
+Encoding detectBom(const char *data, size_t size, size_t &bomSize);
+
+UnicodeError makeDecodeError(const DecodeResult &result);
+
+TranscodeError convertError(DecodeError error);
+
+// Message of the UnicodeError thrown for the error of result
+std::string errorMessage(const TranscodeResult &result);
+
+} // namespace detail
+} // namespace utf8streams
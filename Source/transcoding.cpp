@@ -0,0 +1,68 @@
+#include "transcode.hpp"
+#include "utf8streams.hpp"
+
+namespace utf8streams {
+
+std::streamsize TranscodingStreamBuf::checkEncodings(Encoding sourceEncoding,
+                                                     Encoding targetEncoding) {
+  if (detail::transcoderFor(Encoding::Utf8, targetEncoding) == nullptr) {
+    throw Error("TranscodingStreamBuf can only transcode to UTF-8, UTF-16 or "
+                "UTF-32");
+  }
+  if (sourceEncoding == Encoding::Unknown) {
+    throw Error("Cannot create TranscodingStreamBuf with unknown encoding");
+  }
+
+  return detail::unitSizeOf(sourceEncoding);
+}
+
+void TranscodingStreamBuf::selectEncoding(Encoding encoding) {
+  sourceEncoding = encoding;
+  unitSize = detail::unitSizeOf(encoding);
+  transcodeCallback = detail::transcoderFor(encoding, outputEncoding);
+}
+
+size_t TranscodingStreamBuf::decodeInto(char *buffer, size_t n) {
+  if (sourceEncoding == Encoding::Auto) {
+    selectEncoding(detectSourceEncoding());
+  }
+
+  return decodeSource(transcodeCallback, buffer, n);
+}
+
+TranscodingStreamBuf::TranscodingStreamBuf(std::istream &stream,
+                                           Encoding sourceEncoding,
+                                           Encoding targetEncoding)
+    : SourceStreamBuf(stream, checkEncodings(sourceEncoding, targetEncoding)),
+      sourceEncoding(sourceEncoding), transcodeCallback(nullptr) {
+  outputEncoding = targetEncoding;
+  if (sourceEncoding != Encoding::Auto) {
+    selectEncoding(sourceEncoding);
+  }
+}
+
+TranscodingStreamBuf::TranscodingStreamBuf(int descriptor,
+                                           Encoding sourceEncoding,
+                                           Encoding targetEncoding)
+    : SourceStreamBuf(descriptor,
+                      checkEncodings(sourceEncoding, targetEncoding)),
+      sourceEncoding(sourceEncoding), transcodeCallback(nullptr) {
+  outputEncoding = targetEncoding;
+  if (sourceEncoding != Encoding::Auto) {
+    selectEncoding(sourceEncoding);
+  }
+}
+
+Encoding TranscodingStreamBuf::encoding() {
+  if (sourceEncoding == Encoding::Auto) {
+    selectEncoding(detectSourceEncoding());
+  }
+
+  return sourceEncoding;
+}
+
+Encoding TranscodingStreamBuf::targetEncoding() const {
+  return outputEncoding;
+}
+
+} // namespace utf8streams
@@ -1,6 +1,7 @@
 #include "utf8streams.hpp"
+#include "prefetch.hpp"
+#include "transcode.hpp"
 #include <algorithm>
-#include <cassert>
 #include <cstring>
 #include <initializer_list>
 #include <string>
@@ -8,55 +9,9 @@
 
 namespace utf8streams {
 
-static uint16_t swap16(uint16_t n) {
-  return (static_cast<uint32_t>(n & 0xFF00u) >> 8u) |
-         (static_cast<uint32_t>(n & 0xFFu) << 8u);
-}
-
-static uint16_t fromLE16(uint16_t n) {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  return n;
-#else
-  return swap16(n);
-#endif
-}
-
-static uint16_t fromBE16(uint16_t n) {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  return swap16(n);
-#else
-  return n;
-#endif
-}
-
-static uint32_t swap32(uint32_t n) {
-  return (n >> 24u) | ((n & 0xFF0000u) >> 8u) | ((n & 0xFF00u) << 8u) |
-         (n << 24u);
-}
-
-static uint32_t fromLE32(uint32_t n) {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  return n;
-#else
-  return swap32(n);
-#endif
-}
-
-static uint32_t fromBE32(uint32_t n) {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  return swap32(n);
-#else
-  return n;
-#endif
-}
-
-static bool isHighSurrogate(uint32_t codePoint) {
-  return codePoint >= 0xD800 && codePoint <= 0xDBFF;
-}
-
-static bool isLowSurrogate(uint32_t codePoint) {
-  return codePoint >= 0xDC00 && codePoint <= 0xDFFF;
-}
+// UTF-8 bytes between two checkpoints of the seek index, doubled whenever the
+// index is full
+constexpr std::streamoff CHECKPOINT_INTERVAL = 64 * 1024;
 
 [[noreturn]] static void unreachable() {
   throw std::runtime_error("Unreachable code reached");
@@ -81,29 +36,85 @@ static const EncodingInfo UTF32LE_INFO =
 static const EncodingInfo UTF32BE_INFO =
     EncodingInfo(Encoding::Utf32BE, sizeof(UTF32BE_BOM), UTF32BE_BOM);
 
-Encoding guessEncoding(std::istream &stream) {
-  uint8_t bom[4];
+// U+FFFD in the output encodings other than UTF-8
+constexpr char UTF16LE_REPLACEMENT[] = {'\xFD', '\xFF'};
+constexpr char UTF16BE_REPLACEMENT[] = {'\xFF', '\xFD'};
+constexpr char UTF32LE_REPLACEMENT[] = {'\xFD', '\xFF', '\x00', '\x00'};
+constexpr char UTF32BE_REPLACEMENT[] = {'\x00', '\x00', '\xFF', '\xFD'};
 
-  auto startPos = stream.tellg();
-  stream.read(reinterpret_cast<char *>(&bom[0]), sizeof(bom));
-  auto readBytes = static_cast<size_t>(stream.gcount());
-
-  stream.clear();
+namespace detail {
 
+Encoding detectBom(const char *data, size_t size, size_t &bomSize) {
   for (auto encodingInfo : std::initializer_list<EncodingInfo>{
            UTF32LE_INFO, UTF32BE_INFO, UTF16LE_INFO, UTF16BE_INFO, UTF8_INFO}) {
-    auto encoding = std::get<0>(encodingInfo);
     auto len = std::get<1>(encodingInfo);
-    auto data = std::get<2>(encodingInfo);
 
-    if (readBytes >= len && std::memcmp(bom, data, len) == 0) {
-      if (len != readBytes) {
-        stream.seekg(startPos);
-        stream.seekg(len, std::ios::cur);
-      }
+    if (size >= len && std::memcmp(data, std::get<2>(encodingInfo), len) == 0) {
+      bomSize = len;
+      return std::get<0>(encodingInfo);
+    }
+  }
+
+  bomSize = 0;
+  return Encoding::Unknown;
+}
+
+const char *byteOrderMark(Encoding encoding, size_t &bomSize) {
+  for (auto encodingInfo : std::initializer_list<EncodingInfo>{
+           UTF32LE_INFO, UTF32BE_INFO, UTF16LE_INFO, UTF16BE_INFO, UTF8_INFO}) {
+    if (std::get<0>(encodingInfo) == encoding) {
+      bomSize = std::get<1>(encodingInfo);
+      return static_cast<const char *>(std::get<2>(encodingInfo));
+    }
+  }
+
+  bomSize = 0;
+  return nullptr;
+}
+
+const char *replacementCharacter(Encoding encoding, size_t &size) {
+  switch (encoding) {
+  case Encoding::Utf8:
+    size = sizeof(REPLACEMENT_CHARACTER);
+    return REPLACEMENT_CHARACTER;
+  case Encoding::Utf16LE:
+    size = sizeof(UTF16LE_REPLACEMENT);
+    return UTF16LE_REPLACEMENT;
+  case Encoding::Utf16BE:
+    size = sizeof(UTF16BE_REPLACEMENT);
+    return UTF16BE_REPLACEMENT;
+  case Encoding::Utf32LE:
+    size = sizeof(UTF32LE_REPLACEMENT);
+    return UTF32LE_REPLACEMENT;
+  case Encoding::Utf32BE:
+    size = sizeof(UTF32BE_REPLACEMENT);
+    return UTF32BE_REPLACEMENT;
+  default:
+    size = 0;
+    return nullptr;
+  }
+}
+
+} // namespace detail
+
+Encoding guessEncoding(std::istream &stream) {
+  char bom[4];
+
+  auto startPos = stream.tellg();
+  stream.read(&bom[0], sizeof(bom));
+  auto readBytes = static_cast<size_t>(stream.gcount());
 
-      return encoding;
+  stream.clear();
+
+  size_t len;
+  auto encoding = detail::detectBom(bom, readBytes, len);
+  if (encoding != Encoding::Unknown) {
+    if (len != readBytes) {
+      stream.seekg(startPos);
+      stream.seekg(len, std::ios::cur);
     }
+
+    return encoding;
   }
 
   stream.seekg(startPos);
@@ -114,370 +125,662 @@ Error::Error(const std::string &message) : runtime_error(message) {}
 
 UnicodeError::UnicodeError(const std::string &message) : Error(message) {}
 
-UTF8StreamBuf::RingBuffer::RingBuffer() : pos(0), filled(0) {}
+namespace detail {
 
-void UTF8StreamBuf::RingBuffer::put(uint8_t byte) {
-  assert(filled < sizeof(data));
+ErrorTracker::ErrorTracker()
+    : policy(ErrorPolicy::Throw), errors(0), firstError(-1) {}
 
-  data[(pos + filled) % sizeof(data)] = byte;
-  ++filled;
+void ErrorTracker::countError(std::streamoff offset) {
+  if (errors++ == 0) {
+    firstError = offset;
+  }
 }
 
-uint8_t UTF8StreamBuf::RingBuffer::get() {
-  assert(filled > 0);
+void ErrorTracker::setErrorPolicy(ErrorPolicy errorPolicy) {
+  policy = errorPolicy;
+}
+
+ErrorPolicy ErrorTracker::errorPolicy() const { return policy; }
+
+size_t ErrorTracker::errorCount() const { return errors; }
 
-  auto byte = data[pos];
-  pos = (pos + 1) % sizeof(data);
-  --filled;
+std::streamoff ErrorTracker::firstErrorOffset() const { return firstError; }
 
-  return byte;
+StreamStats DecodeTracker::stats() const {
+#ifdef UTF8STREAMS_STATS
+  auto result = counters;
+  result.errors = errorCount() - errorsAtReset;
+  return result;
+#else
+  return StreamStats();
+#endif
 }
 
-uint8_t UTF8StreamBuf::RingBuffer::peek() {
-  assert(filled > 0);
+void DecodeTracker::resetStats() {
+#ifdef UTF8STREAMS_STATS
+  counters = StreamStats();
+  errorsAtReset = errorCount();
+#endif
+}
 
-  return data[pos];
+void DecodeTracker::setPendingError(const DecodeResult &result) {
+  pendingError = std::make_exception_ptr(makeDecodeError(result));
 }
 
-bool UTF8StreamBuf::RingBuffer::hasData() const { return filled != 0; }
+bool DecodeTracker::handleError(const DecodeResult &result,
+                                std::streamoff offset, char *output,
+                                size_t &produced, size_t n) {
+  switch (errorPolicy()) {
+  case ErrorPolicy::Throw:
+    setPendingError(result);
+    break;
+  case ErrorPolicy::Replace: {
+    size_t size;
+    auto replacement = replacementCharacter(outputEncoding, size);
+    if (n - produced < size) {
+      return false;
+    }
+    std::memcpy(output + produced, replacement, size);
+    produced += size;
+    break;
+  }
+  case ErrorPolicy::Skip:
+    break;
+  }
+
+  countError(offset);
+  return true;
+}
 
-void UTF8StreamBuf::putUnicode(uint32_t unicode) {
-  if (unicode < 0x80) {
-    byteBuff.put(static_cast<uint8_t>(unicode));
-  } else if (unicode < 0x800) {
-    byteBuff.put(static_cast<uint8_t>(0xC0u | (unicode >> 6u)));
-    byteBuff.put(static_cast<uint8_t>(0x80u | (unicode & 0x3Fu)));
-  } else if (unicode < 0x10000) {
-    byteBuff.put(static_cast<uint8_t>(0xE0u | (unicode >> 12u)));
-    byteBuff.put(static_cast<uint8_t>(0x80u | ((unicode >> 6u) & 0x3Fu)));
-    byteBuff.put(static_cast<uint8_t>(0x80u | (unicode & 0x3Fu)));
-  } else if (unicode < 0x10FFFF) {
-    byteBuff.put(static_cast<uint8_t>(0xF0u | (unicode >> 18u)));
-    byteBuff.put(static_cast<uint8_t>(0x80u | ((unicode >> 12u) & 0x3Fu)));
-    byteBuff.put(static_cast<uint8_t>(0x80u | ((unicode >> 6u) & 0x3Fu)));
-    byteBuff.put(static_cast<uint8_t>(0x80u | (unicode & 0x3Fu)));
-  } else {
-    throw UnicodeError("Invalid Unicode sign " + std::to_string(unicode));
+bool DecodeTracker::handleError(const DecodeResult &result,
+                                std::streamoff offset, char32_t *output,
+                                size_t &produced, size_t n) {
+  switch (errorPolicy()) {
+  case ErrorPolicy::Throw:
+    setPendingError(result);
+    break;
+  case ErrorPolicy::Replace:
+    if (produced == n) {
+      return false;
+    }
+    output[produced++] = REPLACEMENT_CODE_POINT;
+    break;
+  case ErrorPolicy::Skip:
+    break;
   }
+
+  countError(offset);
+  return true;
 }
 
-std::streamsize UTF8StreamBuf::xsgetnUtf8(char *buffer, std::streamsize n) {
-  return originalBuf->sgetn(buffer, n);
+void DecodeTracker::throwPendingError() {
+  auto error = pendingError;
+  pendingError = nullptr;
+  std::rethrow_exception(error);
 }
 
-int UTF8StreamBuf::underflowUtf8() { return originalBuf->sgetc(); }
+#ifdef UTF8STREAMS_STATS
+void DecodingStreamBuf::countOutput(const char *data, size_t n) {
+  size_t ascii = 0;
+  for (size_t i = 0; i < n; ++i) {
+    ascii += static_cast<unsigned char>(data[i]) < 0x80u;
+  }
 
-int UTF8StreamBuf::uflowUtf8() { return originalBuf->sbumpc(); }
+  counters.outputBytes += n;
+  counters.asciiBytes += ascii;
+}
+#endif
 
-std::streamsize UTF8StreamBuf::xsgetnUtf16LE(char *buffer, std::streamsize n) {
-  auto readBytes = 0;
+bool DecodingStreamBuf::fill() {
+  auto produced = decodeInto(outBuffer, sizeof(outBuffer));
+  setg(outBuffer, outBuffer, outBuffer + produced);
+#ifdef UTF8STREAMS_STATS
+  countOutput(outBuffer, produced);
+#endif
+
+  return produced != 0;
+}
+
+std::streamsize DecodingStreamBuf::xsgetn(char *buffer, std::streamsize n) {
+  UTF8STREAMS_COUNT(reads, 1);
+  std::streamsize readBytes = 0;
 
   while (n > 0) {
-    auto c = uflowUtf16LE();
-    if (c == std::char_traits<char>::eof()) {
-      break;
+    auto available = egptr() - gptr();
+    if (available == 0) {
+      if (pendingError) {
+        throwPendingError();
+      }
+
+      // Large reads bypass the get area and are decoded in place
+      if (n >= static_cast<std::streamsize>(sizeof(outBuffer))) {
+        auto produced = decodeInto(buffer, static_cast<size_t>(n));
+        if (produced == 0) {
+          break;
+        }
+#ifdef UTF8STREAMS_STATS
+        countOutput(buffer, produced);
+#endif
+
+        buffer += produced;
+        n -= static_cast<std::streamsize>(produced);
+        readBytes += static_cast<std::streamsize>(produced);
+        continue;
+      }
+
+      if (!fill()) {
+        break;
+      }
+      available = egptr() - gptr();
     }
-    *buffer = static_cast<char>(c);
 
-    ++buffer;
-    --n;
-    ++readBytes;
+    auto count = std::min<std::streamsize>(available, n);
+    std::memcpy(buffer, gptr(), static_cast<size_t>(count));
+    gbump(static_cast<int>(count));
+
+    buffer += count;
+    n -= count;
+    readBytes += count;
   }
 
   return readBytes;
 }
 
-int UTF8StreamBuf::underflowUtf16LE() {
-  if (byteBuff.hasData()) {
-    return byteBuff.peek();
+int DecodingStreamBuf::underflow() {
+  UTF8STREAMS_COUNT(underflows, 1);
+  if (gptr() < egptr()) {
+    return traits_type::to_int_type(*gptr());
   }
-
-  uint16_t codePoint = 0;
-  auto readBytes = originalBuf->sgetn(reinterpret_cast<char *>(&codePoint),
-                                      sizeof(codePoint));
-
-  if (readBytes == 0) {
-    return std::char_traits<char>::eof();
+  if (pendingError) {
+    throwPendingError();
   }
-  if (readBytes != sizeof(codePoint)) {
-    throw UnicodeError("Incomplete code point found");
+  if (!fill()) {
+    return traits_type::eof();
   }
+  return traits_type::to_int_type(*gptr());
+}
 
-  codePoint = fromLE16(codePoint);
-
-  uint32_t unicode = codePoint;
-  if (isHighSurrogate(codePoint)) {
-    uint16_t codePoint2 = 0;
-    readBytes = originalBuf->sgetn(reinterpret_cast<char *>(&codePoint2),
-                                   sizeof(codePoint2));
+std::streamsize readAvailable(std::streambuf *source, char *buffer,
+                              std::streamsize n, std::streamsize blockSize) {
+  std::streamsize readBytes = 0;
 
-    if (readBytes == 0) {
-      throw UnicodeError(
-          "High surrogate found without following low surrogate");
+  auto available = source->in_avail();
+  if (available <= 0) {
+    // Nothing is buffered, so only block for a single code unit
+    readBytes = source->sgetn(buffer, std::min(n, blockSize));
+    if (readBytes <= 0) {
+      return 0;
     }
-    if (readBytes != sizeof(codePoint)) {
-      throw UnicodeError("Incomplete code point found");
-    }
-
-    codePoint2 = fromLE16(codePoint2);
 
-    if (!isLowSurrogate(codePoint2)) {
-      throw UnicodeError(
-          "High surrogate found without following low surrogate");
-    }
+    buffer += readBytes;
+    n -= readBytes;
+    available = source->in_avail();
+  }
 
-    unicode = 0x10000 + ((static_cast<uint32_t>(codePoint - 0xD800) << 10u) |
-                         (static_cast<uint32_t>(codePoint2 - 0xDC00)));
-  } else if (isLowSurrogate(codePoint)) {
-    throw UnicodeError("Low surrogate found without leading high surrogate");
+  if (available > 0 && n > 0) {
+    readBytes += source->sgetn(buffer, std::min(n, available));
   }
 
-  putUnicode(unicode);
+  return readBytes;
+}
 
-  return byteBuff.peek();
+SourceReader::SourceReader(std::streambuf *source, std::streamsize unitSize)
+    : sourceStart(-1), originalBuf(source), descriptor(-1),
+      descriptorOffset(-1), sourceOffset(0), unitSize(unitSize),
+      sourceExhausted(false), inBegin(0), inEnd(0) {
+  if (originalBuf == nullptr) {
+    throw Error("Buffer of stream is not set");
+  }
+
+  sourceStart = originalBuf->pubseekoff(0, std::ios::cur, std::ios::in);
 }
 
-int UTF8StreamBuf::uflowUtf16LE() {
-  underflowUtf16LE();
-  if (!byteBuff.hasData()) {
-    return std::char_traits<char>::eof();
+SourceReader::SourceReader(int descriptor, std::streamsize unitSize)
+    : sourceStart(-1), originalBuf(nullptr), descriptor(descriptor),
+      descriptorOffset(-1), sourceOffset(0), unitSize(unitSize),
+      sourceExhausted(false), inBegin(0), inEnd(0) {
+  if (descriptor < 0) {
+    throw Error("Invalid file descriptor");
   }
-  return byteBuff.get();
+
+  sourceStart = prepareDescriptor(descriptor);
+  descriptorOffset = sourceStart;
 }
 
-std::streamsize UTF8StreamBuf::xsgetnUtf16BE(char *buffer, std::streamsize n) {
-  auto readBytes = 0;
+SourceReader::~SourceReader() = default;
 
-  while (n > 0) {
-    auto c = uflowUtf16BE();
-    if (c == std::char_traits<char>::eof()) {
-      break;
-    }
-    *buffer = static_cast<char>(c);
+void SourceReader::startPrefetching() {
+  if (prefetcher) {
+    return;
+  }
 
-    ++buffer;
-    --n;
-    ++readBytes;
+  if (originalBuf == nullptr) {
+    auto fd = descriptor;
+    auto offset = descriptorOffset;
+    prefetcher.reset(
+        new Prefetcher([fd, offset](char *buffer, size_t n) mutable {
+          return readDescriptor(fd, buffer, n, offset);
+        }));
+    return;
   }
 
-  return readBytes;
+  // Blocking for single bytes only, as the unit size may still change
+  auto source = originalBuf;
+  prefetcher.reset(new Prefetcher([source](char *buffer, size_t n) {
+    return static_cast<size_t>(
+        readAvailable(source, buffer, static_cast<std::streamsize>(n), 1));
+  }));
 }
 
-int UTF8StreamBuf::underflowUtf16BE() {
-  if (byteBuff.hasData()) {
-    return byteBuff.peek();
+std::streamsize SourceReader::readSource(char *buffer, std::streamsize n) {
+  std::streamsize readBytes;
+  if (prefetcher) {
+    readBytes = static_cast<std::streamsize>(
+        prefetcher->read(buffer, static_cast<size_t>(n)));
+  } else if (originalBuf != nullptr) {
+    readBytes = readAvailable(originalBuf, buffer, n, unitSize);
+  } else {
+    readBytes = static_cast<std::streamsize>(readDescriptor(
+        descriptor, buffer, static_cast<size_t>(n), descriptorOffset));
   }
 
-  uint16_t codePoint = 0;
-  auto readBytes = originalBuf->sgetn(reinterpret_cast<char *>(&codePoint),
-                                      sizeof(codePoint));
-
-  if (readBytes == 0) {
-    return std::char_traits<char>::eof();
-  }
-  if (readBytes != sizeof(codePoint)) {
-    throw UnicodeError("Incomplete code point found");
-  }
+  UTF8STREAMS_COUNT(sourceReads, 1);
+  UTF8STREAMS_COUNT(sourceBytes, static_cast<uint64_t>(readBytes));
+  return readBytes;
+}
 
-  codePoint = fromBE16(codePoint);
+template <typename Unit, typename Decode>
+size_t SourceReader::decodeUnits(Decode decode, Unit *buffer, size_t n) {
+  size_t produced = 0;
 
-  uint32_t unicode = codePoint;
-  if (isHighSurrogate(codePoint)) {
-    uint16_t codePoint2 = 0;
-    readBytes = originalBuf->sgetn(reinterpret_cast<char *>(&codePoint2),
-                                   sizeof(codePoint2));
+  while (true) {
+    if (inBegin != 0) {
+      std::memmove(inBuffer, inBuffer + inBegin, inEnd - inBegin);
+      inEnd -= inBegin;
+      sourceOffset += static_cast<std::streamoff>(inBegin);
+      inBegin = 0;
+    }
 
-    if (readBytes == 0) {
-      throw UnicodeError(
-          "High surrogate found without following low surrogate");
+    if (!sourceExhausted && inEnd < sizeof(inBuffer)) {
+      auto readBytes =
+          readSource(inBuffer + inEnd,
+                     static_cast<std::streamsize>(sizeof(inBuffer) - inEnd));
+      if (readBytes == 0) {
+        sourceExhausted = true;
+      }
+      inEnd += static_cast<size_t>(readBytes);
     }
-    if (readBytes != sizeof(codePoint)) {
-      throw UnicodeError("Incomplete code point found");
+
+    if (inEnd == 0 && sourceExhausted) {
+      return 0;
     }
 
-    codePoint2 = fromBE16(codePoint2);
+    // Unless the policy throws, decoding continues behind invalid sequences
+    while (true) {
+      auto result = decode(inBuffer + inBegin, inEnd - inBegin,
+                           buffer + produced, n - produced, sourceExhausted);
+      inBegin += result.consumed;
+      produced += result.produced;
+
+      if (result.error == DecodeError::None ||
+          !handleError(result,
+                       sourceOffset + static_cast<std::streamoff>(inBegin),
+                       buffer, produced, n)) {
+        break;
+      }
 
-    if (!isLowSurrogate(codePoint2)) {
-      throw UnicodeError(
-          "High surrogate found without following low surrogate");
+      inBegin += result.invalidLength;
+      if (pendingError) {
+        break;
+      }
     }
 
-    unicode = 0x10000 + ((static_cast<uint32_t>(codePoint - 0xD800) << 10u) |
-                         (static_cast<uint32_t>(codePoint2 - 0xDC00)));
-  } else if (isLowSurrogate(codePoint)) {
-    throw UnicodeError("Low surrogate found without leading high surrogate");
+    if (produced != 0) {
+      return produced;
+    }
+    if (pendingError) {
+      throwPendingError();
+    }
+    if (sourceExhausted && inBegin == inEnd) {
+      return 0;
+    }
   }
+}
 
-  putUnicode(unicode);
-
-  return byteBuff.peek();
+size_t SourceReader::decodeSource(WidenCallback widen, char32_t *buffer,
+                                  size_t n) {
+  return decodeUnits(widen, buffer, n);
 }
 
-int UTF8StreamBuf::uflowUtf16BE() {
-  underflowUtf16BE();
-  if (!byteBuff.hasData()) {
-    return std::char_traits<char>::eof();
+Encoding SourceReader::detectSourceEncoding() {
+  // The bytes are kept in the input buffer, so no seeking is required
+  while (!sourceExhausted && inEnd < 4) {
+    auto readBytes = readSource(inBuffer + inEnd,
+                               static_cast<std::streamsize>(4 - inEnd));
+    if (readBytes == 0) {
+      sourceExhausted = true;
+    }
+    inEnd += static_cast<size_t>(readBytes);
   }
-  return byteBuff.get();
+
+  auto encoding = detectBom(inBuffer, inEnd, inBegin);
+  return encoding == Encoding::Unknown ? Encoding::Utf8 : encoding;
 }
 
-std::streamsize UTF8StreamBuf::xsgetnUtf32LE(char *buffer, std::streamsize n) {
-  auto readBytes = 0;
+SourceStreamBuf::SourceStreamBuf(std::istream &stream, std::streamsize unitSize)
+    : SourceReader(stream.rdbuf(), unitSize), outputOffset(0),
+      getAreaOffset(0), checkpointCount(0),
+      checkpointInterval(CHECKPOINT_INTERVAL) {
+  stream.rdbuf(this);
+}
 
-  while (n > 0) {
-    auto c = uflowUtf32LE();
-    if (c == std::char_traits<char>::eof()) {
-      break;
-    }
-    *buffer = static_cast<char>(c);
+SourceStreamBuf::SourceStreamBuf(int descriptor, std::streamsize unitSize)
+    : SourceReader(descriptor, unitSize), outputOffset(0), getAreaOffset(0),
+      checkpointCount(0), checkpointInterval(CHECKPOINT_INTERVAL) {}
+
+SourceStreamBuf::~SourceStreamBuf() = default;
 
-    ++buffer;
-    --n;
-    ++readBytes;
+void SourceStreamBuf::recordCheckpoint() {
+  if (checkpointCount != 0 &&
+      outputOffset - checkpoints[checkpointCount - 1].utf8Offset <
+          checkpointInterval) {
+    return;
   }
 
-  return readBytes;
+  // A full index keeps every second checkpoint, so its size stays bounded
+  constexpr size_t maxCheckpoints = sizeof(checkpoints) / sizeof(Checkpoint);
+  if (checkpointCount == maxCheckpoints) {
+    for (size_t i = 1; i < maxCheckpoints / 2; ++i) {
+      checkpoints[i] = checkpoints[2 * i];
+    }
+    checkpointCount = maxCheckpoints / 2;
+    checkpointInterval *= 2;
+  }
+
+  auto sourcePos = sourceOffset + static_cast<std::streamoff>(inBegin);
+  checkpoints[checkpointCount++] = Checkpoint{outputOffset, sourcePos};
 }
 
-int UTF8StreamBuf::underflowUtf32LE() {
-  if (byteBuff.hasData()) {
-    return byteBuff.peek();
+bool SourceStreamBuf::skipTo(std::streamoff utf8Offset) {
+  while (true) {
+    auto available = egptr() - gptr();
+    auto distance = utf8Offset - (outputOffset - available);
+    if (distance <= available) {
+      gbump(static_cast<int>(distance));
+      return true;
+    }
+
+    gbump(static_cast<int>(available));
+    if (!fill()) {
+      return false;
+    }
   }
+}
 
-  uint32_t unicode = 0;
-  auto readBytes =
-      originalBuf->sgetn(reinterpret_cast<char *>(&unicode), sizeof(unicode));
+size_t SourceStreamBuf::copySource(char *buffer, size_t n) {
+  recordCheckpoint();
 
-  if (readBytes == 0) {
-    return std::char_traits<char>::eof();
-  }
-  if (readBytes != sizeof(unicode)) {
-    throw UnicodeError("Incomplete code point found");
+  // Bytes read during encoding detection come first
+  size_t count;
+  if (inBegin != inEnd) {
+    count = std::min(n, inEnd - inBegin);
+    std::memcpy(buffer, inBuffer + inBegin, count);
+    inBegin += count;
+  } else {
+    count = static_cast<size_t>(
+        readSource(buffer, static_cast<std::streamsize>(n)));
+    sourceOffset += static_cast<std::streamoff>(count);
   }
 
-  unicode = fromLE32(unicode);
-  putUnicode(unicode);
+  outputOffset += static_cast<std::streamoff>(count);
+  return count;
+}
 
-  return byteBuff.peek();
+template <SourceStreamBuf::DecodeCallback Decode>
+size_t SourceStreamBuf::decodeSource(char *buffer, size_t n) {
+  recordCheckpoint();
+  auto produced = decodeUnits(
+      [](const char *input, size_t inputSize, char *output, size_t outputSize,
+         bool final) {
+        return Decode(input, inputSize, output, outputSize, final);
+      },
+      buffer, n);
+  outputOffset += static_cast<std::streamoff>(produced);
+  return produced;
 }
 
-int UTF8StreamBuf::uflowUtf32LE() {
-  underflowUtf32LE();
-  if (!byteBuff.hasData()) {
-    return std::char_traits<char>::eof();
-  }
-  return byteBuff.get();
+size_t SourceStreamBuf::decodeSource(DecodeCallback decode, char *buffer,
+                                     size_t n) {
+  recordCheckpoint();
+  auto produced = decodeUnits(decode, buffer, n);
+  outputOffset += static_cast<std::streamoff>(produced);
+  return produced;
 }
 
-std::streamsize UTF8StreamBuf::xsgetnUtf32BE(char *buffer, std::streamsize n) {
-  auto readBytes = 0;
+bool SourceStreamBuf::fill() {
+  getAreaOffset = outputOffset;
+  return DecodingStreamBuf::fill();
+}
 
-  while (n > 0) {
-    auto c = uflowUtf32BE();
-    if (c == std::char_traits<char>::eof()) {
-      break;
-    }
-    *buffer = static_cast<char>(c);
+int SourceStreamBuf::sync() {
+  // The original stream belongs to the helper thread while prefetching
+  return prefetcher || originalBuf == nullptr ? 0 : originalBuf->pubsync();
+}
 
-    ++buffer;
-    --n;
-    ++readBytes;
+std::streamsize SourceStreamBuf::showmanyc() {
+  if (prefetcher || originalBuf == nullptr) {
+    return 0;
   }
 
-  return readBytes;
+  auto available = originalBuf->in_avail();
+  return available > 0 ? std::max<std::streamsize>(
+                             1, static_cast<std::streamsize>(available) / 4)
+                       : available;
 }
 
-int UTF8StreamBuf::underflowUtf32BE() {
-  if (byteBuff.hasData()) {
-    return byteBuff.peek();
+std::streambuf::pos_type SourceStreamBuf::seekoff(off_type off,
+                                                  std::ios::seekdir dir,
+                                                  std::ios::openmode which) {
+  if (dir == std::ios::beg) {
+    return seekpos(off, which);
+  }
+  if (dir != std::ios::cur || !(which & std::ios::in)) {
+    return pos_type(off_type(-1));
   }
 
-  uint32_t unicode = 0;
-  auto readBytes =
-      originalBuf->sgetn(reinterpret_cast<char *>(&unicode), sizeof(unicode));
+  auto current = outputOffset - (egptr() - gptr());
+  return off == 0 ? pos_type(current) : seekpos(current + off, which);
+}
 
-  if (readBytes == 0) {
-    return std::char_traits<char>::eof();
+std::streambuf::pos_type SourceStreamBuf::seekpos(pos_type pos,
+                                                  std::ios::openmode which) {
+  auto target = static_cast<std::streamoff>(pos);
+  if (target < 0 || !(which & std::ios::in)) {
+    return pos_type(off_type(-1));
   }
-  if (readBytes != sizeof(unicode)) {
-    throw UnicodeError("Incomplete code point found");
+
+  // The get area can be reused unless a large read bypassed it
+  auto areaSize = egptr() - eback();
+  if (getAreaOffset + areaSize == outputOffset &&
+      target >= getAreaOffset && target <= outputOffset) {
+    setg(eback(), eback() + (target - getAreaOffset), egptr());
+    return pos;
   }
 
-  unicode = fromBE32(unicode);
-  putUnicode(unicode);
+  auto checkpoint = std::upper_bound(
+      checkpoints, checkpoints + checkpointCount, target,
+      [](std::streamoff offset, const Checkpoint &checkpoint) {
+        return offset < checkpoint.utf8Offset;
+      });
+
+  // Decoding forward from the current position avoids seeking the source
+  auto current = outputOffset - (egptr() - gptr());
+  if (checkpoint != checkpoints &&
+      (target < current || (checkpoint - 1)->utf8Offset > current)) {
+    --checkpoint;
+    if (sourceStart == -1) {
+      return pos_type(off_type(-1));
+    }
 
-  return byteBuff.peek();
-}
+    // Data read ahead is stale after seeking
+    auto prefetching = prefetcher != nullptr;
+    prefetcher.reset();
+    auto sourcePos = sourceStart + checkpoint->sourceOffset;
+    auto seeked = originalBuf != nullptr
+                      ? originalBuf->pubseekpos(sourcePos, std::ios::in) !=
+                            pos_type(off_type(-1))
+                      : seekDescriptor(descriptor, sourcePos);
+    if (seeked && originalBuf == nullptr) {
+      descriptorOffset = sourcePos;
+    }
+    if (prefetching) {
+      startPrefetching();
+    }
+    if (!seeked) {
+      return pos_type(off_type(-1));
+    }
 
-int UTF8StreamBuf::uflowUtf32BE() {
-  underflowUtf32BE();
-  if (!byteBuff.hasData()) {
-    return std::char_traits<char>::eof();
+    pendingError = nullptr;
+    sourceOffset = checkpoint->sourceOffset;
+    sourceExhausted = false;
+    inBegin = 0;
+    inEnd = 0;
+    outputOffset = checkpoint->utf8Offset;
+    getAreaOffset = outputOffset;
+    setg(outBuffer, outBuffer, outBuffer);
+  } else if (target < current) {
+    return pos_type(off_type(-1));
   }
-  return byteBuff.get();
-}
-
-int UTF8StreamBuf::sync() { return originalBuf->pubsync(); }
 
-std::streamsize UTF8StreamBuf::showmanyc() {
-  auto available = originalBuf->in_avail();
-  return available > 0 ? std::max<std::streamsize>(
-                             1, static_cast<std::streamsize>(available) / 4)
-                       : available;
+  return skipTo(target) ? pos : pos_type(off_type(-1));
 }
 
-std::streamsize UTF8StreamBuf::xsgetn(char *buffer, std::streamsize n) {
-  return (this->*xsgetnCallback)(buffer, n);
+template <Encoding SourceEncoding>
+size_t SourceStreamBuf::decodeAs(char *buffer, size_t n, bool validateUtf8) {
+  // Resolved at compile time
+  switch (SourceEncoding) {
+  case Encoding::Utf8:
+    return validateUtf8 ? decodeSource<&detail::decodeUtf8>(buffer, n)
+                        : copySource(buffer, n);
+  case Encoding::Utf16LE:
+    return decodeSource<&detail::decodeUtf16LE>(buffer, n);
+  case Encoding::Utf16BE:
+    return decodeSource<&detail::decodeUtf16BE>(buffer, n);
+  case Encoding::Utf32LE:
+    return decodeSource<&detail::decodeUtf32LE>(buffer, n);
+  case Encoding::Utf32BE:
+    return decodeSource<&detail::decodeUtf32BE>(buffer, n);
+  case Encoding::Latin1:
+    return decodeSource<&detail::decodeLatin1>(buffer, n);
+  case Encoding::Windows1252:
+    return decodeSource<&detail::decodeWindows1252>(buffer, n);
+  case Encoding::Iso8859_15:
+    return decodeSource<&detail::decodeIso8859_15>(buffer, n);
+  default:
+    unreachable();
+  }
 }
 
-int UTF8StreamBuf::underflow() { return (this->*underflowCallback)(); }
+} // namespace detail
 
-int UTF8StreamBuf::uflow() { return (this->*uflowCallback)(); }
-
-UTF8StreamBuf::UTF8StreamBuf(std::istream &stream, Encoding sourceEncoding)
-    : originalBuf(stream.rdbuf()) {
-  stream.rdbuf(this);
+template <Encoding SourceEncoding>
+size_t BasicUTF8StreamBuf<SourceEncoding>::decodeInto(char *buffer, size_t n) {
+  return decodeAs<SourceEncoding>(buffer, n, validate);
+}
 
-  if (originalBuf == nullptr) {
-    throw Error("Buffer of stream is not set");
+template <Encoding SourceEncoding>
+BasicUTF8StreamBuf<SourceEncoding>::BasicUTF8StreamBuf(std::istream &stream,
+                                                       bool validateUtf8)
+    : SourceStreamBuf(stream, detail::unitSizeOf(SourceEncoding)),
+      validate(validateUtf8) {}
+
+template <Encoding SourceEncoding>
+BasicUTF8StreamBuf<SourceEncoding>::BasicUTF8StreamBuf(int descriptor,
+                                                       bool validateUtf8)
+    : SourceStreamBuf(descriptor, detail::unitSizeOf(SourceEncoding)),
+      validate(validateUtf8) {}
+
+template class BasicUTF8StreamBuf<Encoding::Utf8>;
+template class BasicUTF8StreamBuf<Encoding::Utf16LE>;
+template class BasicUTF8StreamBuf<Encoding::Utf16BE>;
+template class BasicUTF8StreamBuf<Encoding::Utf32LE>;
+template class BasicUTF8StreamBuf<Encoding::Utf32BE>;
+template class BasicUTF8StreamBuf<Encoding::Latin1>;
+template class BasicUTF8StreamBuf<Encoding::Windows1252>;
+template class BasicUTF8StreamBuf<Encoding::Iso8859_15>;
+
+size_t UTF8StreamBuf::decodeInto(char *buffer, size_t n) {
+  if (sourceEncoding == Encoding::Auto) {
+    resolveEncoding();
   }
 
-  switch (sourceEncoding) {
+  return (this->*decodePath)(buffer, n, validate);
+}
+
+void UTF8StreamBuf::selectEncoding(Encoding encoding) {
+  sourceEncoding = encoding;
+  unitSize = detail::unitSizeOf(encoding);
+
+  switch (encoding) {
   case Encoding::Unknown:
     throw Error("Cannot create UTF8StreamBuf with unknown encoding");
-  case Encoding::Utf8: {
-    xsgetnCallback = &UTF8StreamBuf::xsgetnUtf8;
-    underflowCallback = &UTF8StreamBuf::underflowUtf8;
-    uflowCallback = &UTF8StreamBuf::uflowUtf8;
+  case Encoding::Utf8:
+    decodePath = &UTF8StreamBuf::decodeAs<Encoding::Utf8>;
     break;
-  }
-  case Encoding::Utf16LE: {
-    xsgetnCallback = &UTF8StreamBuf::xsgetnUtf16LE;
-    underflowCallback = &UTF8StreamBuf::underflowUtf16LE;
-    uflowCallback = &UTF8StreamBuf::uflowUtf16LE;
+  case Encoding::Utf16LE:
+    decodePath = &UTF8StreamBuf::decodeAs<Encoding::Utf16LE>;
     break;
-  }
-  case Encoding::Utf16BE: {
-    xsgetnCallback = &UTF8StreamBuf::xsgetnUtf16BE;
-    underflowCallback = &UTF8StreamBuf::underflowUtf16BE;
-    uflowCallback = &UTF8StreamBuf::uflowUtf16BE;
+  case Encoding::Utf16BE:
+    decodePath = &UTF8StreamBuf::decodeAs<Encoding::Utf16BE>;
     break;
-  }
-  case Encoding::Utf32LE: {
-    xsgetnCallback = &UTF8StreamBuf::xsgetnUtf32LE;
-    underflowCallback = &UTF8StreamBuf::underflowUtf32LE;
-    uflowCallback = &UTF8StreamBuf::uflowUtf32LE;
+  case Encoding::Utf32LE:
+    decodePath = &UTF8StreamBuf::decodeAs<Encoding::Utf32LE>;
     break;
-  }
-  case Encoding::Utf32BE: {
-    xsgetnCallback = &UTF8StreamBuf::xsgetnUtf32BE;
-    underflowCallback = &UTF8StreamBuf::underflowUtf32BE;
-    uflowCallback = &UTF8StreamBuf::uflowUtf32BE;
+  case Encoding::Utf32BE:
+    decodePath = &UTF8StreamBuf::decodeAs<Encoding::Utf32BE>;
+    break;
+  case Encoding::Latin1:
+    decodePath = &UTF8StreamBuf::decodeAs<Encoding::Latin1>;
+    break;
+  case Encoding::Windows1252:
+    decodePath = &UTF8StreamBuf::decodeAs<Encoding::Windows1252>;
+    break;
+  case Encoding::Iso8859_15:
+    decodePath = &UTF8StreamBuf::decodeAs<Encoding::Iso8859_15>;
     break;
-  }
   default:
     unreachable();
   }
 }
 
+void UTF8StreamBuf::resolveEncoding() {
+  selectEncoding(detectSourceEncoding());
+}
+
+Encoding UTF8StreamBuf::encoding() {
+  if (sourceEncoding == Encoding::Auto) {
+    resolveEncoding();
+  }
+
+  return sourceEncoding;
+}
+
+UTF8StreamBuf::UTF8StreamBuf(std::istream &stream, Encoding sourceEncoding,
+                             bool validateUtf8)
+    : SourceStreamBuf(stream, 1), sourceEncoding(sourceEncoding),
+      decodePath(nullptr), validate(validateUtf8) {
+  if (sourceEncoding != Encoding::Auto) {
+    selectEncoding(sourceEncoding);
+  }
+}
+
+UTF8StreamBuf::UTF8StreamBuf(int descriptor, Encoding sourceEncoding,
+                             bool validateUtf8)
+    : SourceStreamBuf(descriptor, 1), sourceEncoding(sourceEncoding),
+      decodePath(nullptr), validate(validateUtf8) {
+  if (sourceEncoding != Encoding::Auto) {
+    selectEncoding(sourceEncoding);
+  }
+}
+
 } // namespace utf8streams
@@ -1,6 +1,23 @@
 #include <cstring>
+#include <fstream>
 #include <gtest/gtest.h>
+#include <thread>
 #include <utf8streams.hpp>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static std::string repeat(const std::string &content, size_t count) {
+  std::string result;
+  result.reserve(content.size() * count);
+  for (size_t i = 0; i < count; ++i) {
+    result += content;
+  }
+  return result;
+}
 
 TEST(guessEncoding, noBOMShort) {
   std::istringstream stream("0");
@@ -443,3 +460,2035 @@ TEST(Utf32BE, multiByteGet) {
   EXPECT_EQ(std::char_traits<char>::eof(), stream.get());
   EXPECT_TRUE(stream.eof());
 }
+
+TEST(Utf16LE, largeRead) {
+  std::string utf8Content =
+      repeat("a\xC3\xA4\xE2\x82\xAC\xF0\x9D\x84\x9E", 10000);
+  std::istringstream stream(
+      repeat(std::string("a\0\xE4\0\xAC\x20\x34\xD8\x1E\xDD", 10), 10000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16LE);
+
+  std::string result;
+  char buffer[1000];
+  while (stream.read(buffer, sizeof(buffer)) || stream.gcount() > 0) {
+    result.append(buffer, static_cast<size_t>(stream.gcount()));
+  }
+
+  EXPECT_EQ(utf8Content, result);
+}
+
+TEST(Utf16LE, largeReadAtOnce) {
+  std::string utf8Content =
+      repeat("a\xC3\xA4\xE2\x82\xAC\xF0\x9D\x84\x9E", 10000);
+  std::istringstream stream(
+      repeat(std::string("a\0\xE4\0\xAC\x20\x34\xD8\x1E\xDD", 10), 10000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16LE);
+
+  std::string result(utf8Content.size() + 1, '\0');
+  stream.read(&result[0], static_cast<std::streamsize>(result.size()));
+  result.resize(static_cast<size_t>(stream.gcount()));
+
+  EXPECT_EQ(utf8Content, result);
+}
+
+TEST(Utf16LE, largeGet) {
+  std::string utf8Content =
+      repeat("a\xC3\xA4\xE2\x82\xAC\xF0\x9D\x84\x9E", 10000);
+  std::istringstream stream(
+      repeat(std::string("a\0\xE4\0\xAC\x20\x34\xD8\x1E\xDD", 10), 10000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16LE);
+
+  std::string result;
+  for (auto c = stream.get(); c != std::char_traits<char>::eof();
+       c = stream.get()) {
+    result.push_back(static_cast<char>(c));
+  }
+
+  EXPECT_EQ(utf8Content, result);
+  EXPECT_TRUE(stream.eof());
+}
+
+TEST(Utf16LE, getline) {
+  std::istringstream stream(repeat(std::string("a\0b\0\n\0", 6), 5000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16LE);
+
+  size_t lines = 0;
+  std::string line;
+  while (std::getline(stream, line)) {
+    EXPECT_EQ("ab", line);
+    ++lines;
+  }
+
+  EXPECT_EQ(5000, lines);
+}
+
+TEST(Utf16LE, lowSurrogateError) {
+  std::istringstream stream(std::string("H\0\x1E\xDDi\0", 6));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16LE);
+  stream.exceptions(std::ios::badbit);
+
+  EXPECT_EQ('H', stream.get());
+  EXPECT_THROW(stream.get(), utf8streams::UnicodeError);
+}
+
+TEST(Utf16LE, highSurrogateError) {
+  std::istringstream stream(std::string("H\0\x34\xD8", 4));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16LE);
+  stream.exceptions(std::ios::badbit);
+
+  EXPECT_EQ('H', stream.get());
+  EXPECT_THROW(stream.get(), utf8streams::UnicodeError);
+}
+
+TEST(Utf16LE, incompleteError) {
+  std::istringstream stream(std::string("H\0i", 3));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16LE);
+
+  char buffer[128];
+  stream.read(buffer, sizeof(buffer));
+
+  EXPECT_TRUE(stream.bad());
+}
+
+TEST(Utf32BE, largeRead) {
+  std::string utf8Content =
+      repeat("a\xC3\xA4\xE2\x82\xAC\xF0\x9D\x84\x9E", 10000);
+  std::istringstream stream(repeat(
+      std::string("\0\0\0a\0\0\0\xE4\0\0\x20\xAC\0\x01\xD1\x1E", 16), 10000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf32BE);
+
+  std::string result;
+  char buffer[777];
+  while (stream.read(buffer, sizeof(buffer)) || stream.gcount() > 0) {
+    result.append(buffer, static_cast<size_t>(stream.gcount()));
+  }
+
+  EXPECT_EQ(utf8Content, result);
+}
+
+TEST(Utf32BE, invalidError) {
+  std::istringstream stream(std::string("\0\0\0H\0\x11\0\0", 8));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf32BE);
+  stream.exceptions(std::ios::badbit);
+
+  EXPECT_EQ('H', stream.get());
+  EXPECT_THROW(stream.get(), utf8streams::UnicodeError);
+}
+
+TEST(Utf16LE, asciiBlocks) {
+  std::istringstream stream(
+      repeat(std::string("x\0y\0z\0", 6), 20000) + std::string("!\0", 2));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16LE);
+
+  std::string result(70000, '\0');
+  stream.read(&result[0], static_cast<std::streamsize>(result.size()));
+  result.resize(static_cast<size_t>(stream.gcount()));
+
+  EXPECT_EQ(repeat("xyz", 20000) + "!", result);
+}
+
+TEST(Utf16LE, twoByteBlocks) {
+  std::istringstream stream(repeat(std::string("\x16\x04\xE4\0", 4), 10000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16LE);
+
+  std::string result(50000, '\0');
+  stream.read(&result[0], static_cast<std::streamsize>(result.size()));
+  result.resize(static_cast<size_t>(stream.gcount()));
+
+  EXPECT_EQ(repeat("\xD0\x96\xC3\xA4", 10000), result);
+}
+
+TEST(Utf16LE, threeByteBlocks) {
+  std::istringstream stream(repeat(std::string("\x2D\x4E\xAC\x20", 4), 10000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16LE);
+
+  std::string result(70000, '\0');
+  stream.read(&result[0], static_cast<std::streamsize>(result.size()));
+  result.resize(static_cast<size_t>(stream.gcount()));
+
+  EXPECT_EQ(repeat("\xE4\xB8\xAD\xE2\x82\xAC", 10000), result);
+}
+
+TEST(Utf16LE, mixedBlocks) {
+  std::istringstream stream(repeat(
+      std::string("a\0b\0c\0d\0e\0f\0g\0\xE4\0\x2D\x4E\x34\xD8\x1E\xDD", 22),
+      5000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16LE);
+
+  std::string result(100000, '\0');
+  stream.read(&result[0], static_cast<std::streamsize>(result.size()));
+  result.resize(static_cast<size_t>(stream.gcount()));
+
+  EXPECT_EQ(repeat("abcdefg\xC3\xA4\xE4\xB8\xAD\xF0\x9D\x84\x9E", 5000),
+            result);
+}
+
+TEST(Utf16LE, errorAfterBlocks) {
+  std::istringstream stream(repeat(std::string("x\0", 2), 1000) +
+                            std::string("\x1E\xDD", 2) +
+                            repeat(std::string("x\0", 2), 1000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16LE);
+  stream.exceptions(std::ios::badbit);
+
+  char buffer[1000];
+  stream.read(buffer, sizeof(buffer));
+
+  EXPECT_EQ(1000, stream.gcount());
+  EXPECT_EQ(repeat("x", 1000), std::string(buffer, sizeof(buffer)));
+  EXPECT_THROW(stream.get(), utf8streams::UnicodeError);
+}
+
+TEST(Utf16BE, asciiBlocks) {
+  std::istringstream stream(
+      repeat(std::string("\0x\0y\0z", 6), 20000) + std::string("\0!", 2));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16BE);
+
+  std::string result(70000, '\0');
+  stream.read(&result[0], static_cast<std::streamsize>(result.size()));
+  result.resize(static_cast<size_t>(stream.gcount()));
+
+  EXPECT_EQ(repeat("xyz", 20000) + "!", result);
+}
+
+TEST(Utf16BE, threeByteBlocks) {
+  std::istringstream stream(repeat(std::string("\x4E\x2D\x20\xAC", 4), 10000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16BE);
+
+  std::string result(70000, '\0');
+  stream.read(&result[0], static_cast<std::streamsize>(result.size()));
+  result.resize(static_cast<size_t>(stream.gcount()));
+
+  EXPECT_EQ(repeat("\xE4\xB8\xAD\xE2\x82\xAC", 10000), result);
+}
+
+TEST(Utf16BE, highSurrogateErrorAfterBlocks) {
+  std::istringstream stream(repeat(std::string("\0x", 2), 999) +
+                            std::string("\xD8\x34\0x", 4));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf16BE);
+  stream.exceptions(std::ios::badbit);
+
+  char buffer[999];
+  stream.read(buffer, sizeof(buffer));
+
+  EXPECT_EQ(999, stream.gcount());
+  EXPECT_THROW(stream.get(), utf8streams::UnicodeError);
+}
+
+TEST(Utf32LE, maxCodePoint) {
+  std::istringstream stream(std::string("\xFF\xFF\x10\0", 4));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf32LE);
+
+  char buffer[128];
+  stream.read(buffer, sizeof(buffer));
+
+  EXPECT_EQ(4, stream.gcount());
+  EXPECT_EQ(0, std::memcmp("\xF4\x8F\xBF\xBF", buffer, 4));
+}
+
+TEST(Utf32LE, surrogateError) {
+  std::istringstream stream(std::string("H\0\0\0\x00\xD8\0\0", 8));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf32LE);
+  stream.exceptions(std::ios::badbit);
+
+  EXPECT_EQ('H', stream.get());
+  EXPECT_THROW(stream.get(), utf8streams::UnicodeError);
+}
+
+TEST(Utf32LE, asciiBlocks) {
+  std::istringstream stream(
+      repeat(std::string("x\0\0\0y\0\0\0z\0\0\0", 12), 20000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf32LE);
+
+  std::string result(70000, '\0');
+  stream.read(&result[0], static_cast<std::streamsize>(result.size()));
+  result.resize(static_cast<size_t>(stream.gcount()));
+
+  EXPECT_EQ(repeat("xyz", 20000), result);
+}
+
+TEST(Utf32LE, bmpBlocks) {
+  std::istringstream stream(
+      repeat(std::string("\x16\x04\0\0\x2D\x4E\0\0a\0\0\0", 12), 10000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf32LE);
+
+  std::string result(70000, '\0');
+  stream.read(&result[0], static_cast<std::streamsize>(result.size()));
+  result.resize(static_cast<size_t>(stream.gcount()));
+
+  EXPECT_EQ(repeat("\xD0\x96\xE4\xB8\xAD"
+                   "a",
+                   10000),
+            result);
+}
+
+TEST(Utf32LE, supplementaryBlocks) {
+  std::istringstream stream(
+      repeat(std::string("\x1E\xD1\x01\0\x00\xF6\x01\0", 8), 10000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf32LE);
+
+  std::string result(90000, '\0');
+  stream.read(&result[0], static_cast<std::streamsize>(result.size()));
+  result.resize(static_cast<size_t>(stream.gcount()));
+
+  EXPECT_EQ(repeat("\xF0\x9D\x84\x9E\xF0\x9F\x98\x80", 10000), result);
+}
+
+TEST(Utf32LE, tooLargeErrorAfterBlocks) {
+  std::istringstream stream(repeat(std::string("x\0\0\0", 4), 1000) +
+                            std::string("\0\0\x11\0", 4));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf32LE);
+  stream.exceptions(std::ios::badbit);
+
+  char buffer[1000];
+  stream.read(buffer, sizeof(buffer));
+
+  EXPECT_EQ(1000, stream.gcount());
+  EXPECT_THROW(stream.get(), utf8streams::UnicodeError);
+}
+
+TEST(Utf32BE, bmpBlocks) {
+  std::istringstream stream(
+      repeat(std::string("\0\0\x04\x16\0\0\x4E\x2D\0\0\0a", 12), 10000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf32BE);
+
+  std::string result(70000, '\0');
+  stream.read(&result[0], static_cast<std::streamsize>(result.size()));
+  result.resize(static_cast<size_t>(stream.gcount()));
+
+  EXPECT_EQ(repeat("\xD0\x96\xE4\xB8\xAD"
+                   "a",
+                   10000),
+            result);
+}
+
+TEST(Utf32BE, surrogateErrorAfterBlocks) {
+  std::istringstream stream(repeat(std::string("\0\0\0x", 4), 1000) +
+                            std::string("\0\0\xDF\xFF", 4));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf32BE);
+  stream.exceptions(std::ios::badbit);
+
+  char buffer[1000];
+  stream.read(buffer, sizeof(buffer));
+
+  EXPECT_EQ(1000, stream.gcount());
+  EXPECT_THROW(stream.get(), utf8streams::UnicodeError);
+}
+
+TEST(Utf8, validatedMultiByte) {
+  std::istringstream stream("\xC3\xA4 \xE2\x82\xAC \xF0\x9D\x84\x9E");
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf8,
+                                       true);
+
+  char buffer[128];
+  stream.read(buffer, sizeof(buffer));
+
+  EXPECT_EQ(11, stream.gcount());
+  EXPECT_EQ(0,
+            std::memcmp("\xC3\xA4 \xE2\x82\xAC \xF0\x9D\x84\x9E", buffer, 11));
+}
+
+TEST(Utf8, validatedBlocks) {
+  std::string content =
+      repeat("Hello \xC3\xA4 \xE2\x82\xAC \xF0\x9D\x84\x9E World", 10000);
+  std::istringstream stream(content);
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf8,
+                                       true);
+
+  std::string result;
+  for (auto c = stream.get(); c != std::char_traits<char>::eof();
+       c = stream.get()) {
+    result.push_back(static_cast<char>(c));
+  }
+
+  EXPECT_EQ(content, result);
+}
+
+TEST(Utf8, unvalidatedInvalid) {
+  std::istringstream stream("a\xC0\x80");
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf8);
+
+  char buffer[128];
+  stream.read(buffer, sizeof(buffer));
+
+  EXPECT_EQ(3, stream.gcount());
+}
+
+TEST(Utf8, overlongError) {
+  std::istringstream stream("a\xC0\x80");
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf8,
+                                       true);
+  stream.exceptions(std::ios::badbit);
+
+  EXPECT_EQ('a', stream.get());
+  EXPECT_THROW(stream.get(), utf8streams::UnicodeError);
+}
+
+TEST(Utf8, surrogateError) {
+  std::istringstream stream("a\xED\xA0\x80");
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf8,
+                                       true);
+  stream.exceptions(std::ios::badbit);
+
+  EXPECT_EQ('a', stream.get());
+  EXPECT_THROW(stream.get(), utf8streams::UnicodeError);
+}
+
+TEST(Utf8, tooLargeError) {
+  std::istringstream stream("a\xF4\x90\x80\x80");
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf8,
+                                       true);
+  stream.exceptions(std::ios::badbit);
+
+  EXPECT_EQ('a', stream.get());
+  EXPECT_THROW(stream.get(), utf8streams::UnicodeError);
+}
+
+TEST(Utf8, truncatedError) {
+  std::istringstream stream("a\xE2\x82");
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf8,
+                                       true);
+  stream.exceptions(std::ios::badbit);
+
+  EXPECT_EQ('a', stream.get());
+  EXPECT_THROW(stream.get(), utf8streams::UnicodeError);
+}
+
+TEST(Utf8, errorAfterBlocks) {
+  std::istringstream stream(repeat("x\xC3\xA4", 1000) + "\x80" +
+                            repeat("x", 1000));
+  utf8streams::UTF8StreamBuf streamBuf(stream, utf8streams::Encoding::Utf8,
+                                       true);
+  stream.exceptions(std::ios::badbit);
+
+  char buffer[3000];
+  stream.read(buffer, sizeof(buffer));
+
+  EXPECT_EQ(3000, stream.gcount());
+  EXPECT_THROW(stream.get(), utf8streams::UnicodeError);
+}
+
+static std::string writeTempFile(const std::string &name,
+                                 const std::string &content) {
+  auto path = ::testing::TempDir() + name;
+  std::ofstream file(path, std::ios::binary);
+  file << content;
+  return path;
+}
+
+static std::string readAll(std::streambuf &buf) {
+  std::istream stream(&buf);
+  std::string content;
+  char buffer[1000];
+  while (stream.read(buffer, sizeof(buffer)) || stream.gcount() != 0) {
+    content.append(buffer, static_cast<size_t>(stream.gcount()));
+  }
+  return content;
+}
+
+TEST(Mapped, utf8NoBOM) {
+  auto text = repeat("H\xC3\xA4llo W\xE2\x82\xACrld \xF0\x9F\x98\x80\n", 10000);
+  auto path = writeTempFile("utf8streams_mapped1.txt", text);
+
+  utf8streams::MappedUTF8StreamBuf buf(path);
+  EXPECT_EQ(utf8streams::Encoding::Utf8, buf.encoding());
+  EXPECT_EQ(text, readAll(buf));
+}
+
+TEST(Mapped, utf8BOM) {
+  auto path = writeTempFile("utf8streams_mapped2.txt", "\xEF\xBB\xBFHi\nyou");
+
+  utf8streams::MappedUTF8StreamBuf buf(path);
+  std::istream stream(&buf);
+  std::string line;
+
+  EXPECT_EQ(utf8streams::Encoding::Utf8, buf.encoding());
+  std::getline(stream, line);
+  EXPECT_EQ("Hi", line);
+  std::getline(stream, line);
+  EXPECT_EQ("you", line);
+  EXPECT_TRUE(stream.eof());
+}
+
+TEST(Mapped, utf16LEBOM) {
+  auto path = writeTempFile(
+      "utf8streams_mapped3.txt",
+      std::string("\xFF\xFE" "a\0a\0a\0" "\xAC\x20", 10));
+
+  utf8streams::MappedUTF8StreamBuf buf(path);
+  EXPECT_EQ(utf8streams::Encoding::Utf16LE, buf.encoding());
+  EXPECT_EQ("aaa\xE2\x82\xAC", readAll(buf));
+}
+
+TEST(Mapped, explicitEncoding) {
+  auto text = repeat(std::string("\0\0\0a\0\x01\xF6\x00", 8), 10000);
+  auto path = writeTempFile("utf8streams_mapped4.txt", text);
+
+  utf8streams::MappedUTF8StreamBuf buf(path, utf8streams::Encoding::Utf32BE);
+  EXPECT_EQ(repeat("a\xF0\x9F\x98\x80", 10000), readAll(buf));
+}
+
+TEST(Mapped, validatedError) {
+  auto path = writeTempFile("utf8streams_mapped5.txt",
+                            repeat("abc", 20000) + "\xC0\xAF");
+
+  utf8streams::MappedUTF8StreamBuf buf(path, true);
+  std::istream stream(&buf);
+  stream.exceptions(std::ios::badbit);
+
+  std::string content;
+  EXPECT_THROW(
+      {
+        char c;
+        while (stream.get(c)) {
+          content += c;
+        }
+      },
+      utf8streams::UnicodeError);
+  EXPECT_EQ(repeat("abc", 20000), content);
+}
+
+TEST(Mapped, emptyFile) {
+  auto path = writeTempFile("utf8streams_mapped6.txt", "");
+
+  utf8streams::MappedUTF8StreamBuf buf(path);
+  EXPECT_EQ("", readAll(buf));
+}
+
+TEST(Mapped, missingFile) {
+  EXPECT_THROW(utf8streams::MappedUTF8StreamBuf(::testing::TempDir() +
+                                                "utf8streams_missing.txt"),
+               utf8streams::Error);
+}
+
+TEST(Output, utf16LE) {
+  std::ostringstream stream;
+  {
+    utf8streams::UTF8OutputStreamBuf buf(stream,
+                                         utf8streams::Encoding::Utf16LE);
+    stream << "Hello \xE2\x82\xAC\xF0\x9F\x98\x80";
+  }
+
+  EXPECT_EQ(std::string("H\0e\0l\0l\0o\0 \0\xAC\x20\x3D\xD8\x00\xDE", 18),
+            stream.str());
+}
+
+TEST(Output, utf16BEBOM) {
+  std::ostringstream stream;
+  {
+    utf8streams::UTF8OutputStreamBuf buf(
+        stream, utf8streams::Encoding::Utf16BE, true);
+    stream << "a\xC3\xA4";
+  }
+
+  EXPECT_EQ(std::string("\xFE\xFF\0a\0\xE4", 6), stream.str());
+}
+
+TEST(Output, utf32) {
+  std::ostringstream streamLE;
+  std::ostringstream streamBE;
+  {
+    utf8streams::UTF8OutputStreamBuf bufLE(streamLE,
+                                           utf8streams::Encoding::Utf32LE);
+    utf8streams::UTF8OutputStreamBuf bufBE(streamBE,
+                                           utf8streams::Encoding::Utf32BE);
+    streamLE << "a\xF0\x9F\x98\x80";
+    streamBE << "a\xF0\x9F\x98\x80";
+  }
+
+  EXPECT_EQ(std::string("a\0\0\0\x00\xF6\x01\x00", 8), streamLE.str());
+  EXPECT_EQ(std::string("\0\0\0a\x00\x01\xF6\x00", 8), streamBE.str());
+}
+
+TEST(Output, splitSequences) {
+  auto text = repeat("abc\xE2\x82\xAC\xF0\x9F\x98\x80", 10000);
+  std::ostringstream stream;
+  {
+    utf8streams::UTF8OutputStreamBuf buf(stream,
+                                         utf8streams::Encoding::Utf16LE);
+    stream.write(text.data(), 5);
+    stream.write(text.data() + 5, 20000);
+    for (size_t i = 20005; i < 20100; ++i) {
+      stream.put(text[i]);
+    }
+    stream.write(text.data() + 20100, 40000);
+    stream.write(text.data() + 60100, text.size() - 60100);
+  }
+
+  std::istringstream input(stream.str());
+  utf8streams::UTF8StreamBuf buf(input, utf8streams::Encoding::Utf16LE);
+  std::string content((std::istreambuf_iterator<char>(input)),
+                      std::istreambuf_iterator<char>());
+
+  EXPECT_EQ(text, content);
+}
+
+TEST(Output, largeBlocks) {
+  auto text = repeat("Hello World \xC3\xA4\xE2\x82\xAC\n", 20000);
+  std::ostringstream stream;
+  {
+    utf8streams::UTF8OutputStreamBuf buf(stream,
+                                         utf8streams::Encoding::Utf32BE);
+    stream << text;
+  }
+
+  std::istringstream input(stream.str());
+  utf8streams::UTF8StreamBuf buf(input, utf8streams::Encoding::Utf32BE);
+  std::string content((std::istreambuf_iterator<char>(input)),
+                      std::istreambuf_iterator<char>());
+
+  EXPECT_EQ(text, content);
+}
+
+TEST(Output, invalidError) {
+  std::ostringstream stream;
+  utf8streams::UTF8OutputStreamBuf buf(stream,
+                                       utf8streams::Encoding::Utf16LE);
+  stream.exceptions(std::ios::badbit);
+
+  stream << "ab\xFF";
+  EXPECT_THROW(stream.flush(), utf8streams::UnicodeError);
+  EXPECT_EQ(std::string("a\0b\0", 4), stream.str());
+}
+
+TEST(Output, invalidEncoding) {
+  // The stream keeps its buffer if the constructor throws
+  std::ostringstream stream;
+  auto original = stream.rdbuf();
+  for (auto encoding :
+       {utf8streams::Encoding::Unknown, utf8streams::Encoding::Auto,
+        utf8streams::Encoding::Latin1}) {
+    EXPECT_THROW(utf8streams::UTF8OutputStreamBuf(stream, encoding),
+                 utf8streams::Error);
+    EXPECT_EQ(original, stream.rdbuf());
+  }
+
+  stream << "abc";
+  EXPECT_EQ("abc", stream.str());
+}
+
+// Hands out one byte at a time and cannot seek, like a pipe
+class PipeBuf : public std::streambuf {
+private:
+  std::string content;
+  size_t pos;
+  char current;
+
+protected:
+  int underflow() override {
+    if (pos == content.size()) {
+      return traits_type::eof();
+    }
+
+    current = content[pos++];
+    setg(&current, &current, &current + 1);
+    return traits_type::to_int_type(current);
+  }
+
+public:
+  explicit PipeBuf(const std::string &content)
+      : content(content), pos(0), current(0) {}
+};
+
+TEST(Auto, utf16LEBOM) {
+  PipeBuf pipe(std::string("\xFF\xFEH\0i\0\xAC\x20", 8));
+  std::istream stream(&pipe);
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Auto);
+
+  EXPECT_EQ(utf8streams::Encoding::Utf16LE, buf.encoding());
+  std::string content((std::istreambuf_iterator<char>(stream)),
+                      std::istreambuf_iterator<char>());
+  EXPECT_EQ("Hi\xE2\x82\xAC", content);
+}
+
+TEST(Auto, utf32BEBOM) {
+  PipeBuf pipe(std::string("\0\0\xFE\xFF\0\0\0a", 8));
+  std::istream stream(&pipe);
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Auto);
+
+  std::string content((std::istreambuf_iterator<char>(stream)),
+                      std::istreambuf_iterator<char>());
+  EXPECT_EQ("a", content);
+  EXPECT_EQ(utf8streams::Encoding::Utf32BE, buf.encoding());
+}
+
+TEST(Auto, utf8BOM) {
+  PipeBuf pipe("\xEF\xBB\xBFHello");
+  std::istream stream(&pipe);
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Auto);
+
+  std::string content;
+  stream >> content;
+  EXPECT_EQ("Hello", content);
+  EXPECT_EQ(utf8streams::Encoding::Utf8, buf.encoding());
+}
+
+TEST(Auto, noBOM) {
+  auto text = repeat("Hello World\n", 10000);
+  PipeBuf pipe(text);
+  std::istream stream(&pipe);
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Auto);
+
+  std::string content((std::istreambuf_iterator<char>(stream)),
+                      std::istreambuf_iterator<char>());
+  EXPECT_EQ(text, content);
+  EXPECT_EQ(utf8streams::Encoding::Utf8, buf.encoding());
+}
+
+TEST(Auto, shortInput) {
+  std::istringstream stream("ab");
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Auto, true);
+
+  std::string content;
+  stream >> content;
+  EXPECT_EQ("ab", content);
+  EXPECT_TRUE(stream.eof());
+}
+
+TEST(Auto, emptyInput) {
+  std::istringstream stream("");
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Auto);
+
+  EXPECT_EQ(utf8streams::Encoding::Utf8, buf.encoding());
+  EXPECT_EQ(std::char_traits<char>::eof(), stream.get());
+}
+
+static std::string encode(const std::string &text,
+                          utf8streams::Encoding encoding) {
+  std::ostringstream stream;
+  {
+    utf8streams::UTF8OutputStreamBuf buf(stream, encoding);
+    stream << text;
+  }
+  return stream.str();
+}
+
+TEST(detectEncoding, bom) {
+  auto guess = utf8streams::detectEncoding("\xFF\xFE\0\0", 4);
+
+  EXPECT_EQ(utf8streams::Encoding::Utf32LE, guess.encoding);
+  EXPECT_EQ(1.0, guess.confidence);
+}
+
+TEST(detectEncoding, latin) {
+  auto text = repeat("Hello W\xC3\xB6rld \xE2\x82\xAC\n", 100);
+
+  for (auto encoding :
+       {utf8streams::Encoding::Utf8, utf8streams::Encoding::Utf16LE,
+        utf8streams::Encoding::Utf16BE, utf8streams::Encoding::Utf32LE,
+        utf8streams::Encoding::Utf32BE}) {
+    auto sample = encode(text, encoding);
+    auto guess = utf8streams::detectEncoding(sample.data(), sample.size());
+
+    EXPECT_EQ(encoding, guess.encoding);
+    EXPECT_GT(guess.confidence, 0.5);
+    EXPECT_LT(guess.confidence, 1.0);
+  }
+}
+
+TEST(detectEncoding, cjkUtf16) {
+  auto text = repeat("\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E\xF0\x9F\x98\x80"
+                     "\xE4\xB8\xAD\xE6\x96\x87",
+                     100);
+
+  auto sample = encode(text, utf8streams::Encoding::Utf16LE);
+  auto guess = utf8streams::detectEncoding(sample.data(), sample.size());
+  EXPECT_EQ(utf8streams::Encoding::Utf16LE, guess.encoding);
+
+  sample = encode(text, utf8streams::Encoding::Utf16BE);
+  guess = utf8streams::detectEncoding(sample.data(), sample.size());
+  EXPECT_EQ(utf8streams::Encoding::Utf16BE, guess.encoding);
+
+  guess = utf8streams::detectEncoding(text.data(), text.size());
+  EXPECT_EQ(utf8streams::Encoding::Utf8, guess.encoding);
+}
+
+TEST(detectEncoding, truncatedSample) {
+  auto sample = encode(repeat("Hello \xF0\x9F\x98\x80", 100),
+                       utf8streams::Encoding::Utf16LE);
+  auto guess = utf8streams::detectEncoding(sample.data(), sample.size() - 3);
+
+  EXPECT_EQ(utf8streams::Encoding::Utf16LE, guess.encoding);
+}
+
+TEST(detectEncoding, unknown) {
+  auto guess = utf8streams::detectEncoding("\xDC\x00\xFF\xDC\x00\xDC", 6);
+
+  EXPECT_EQ(utf8streams::Encoding::Unknown, guess.encoding);
+  EXPECT_EQ(0.0, guess.confidence);
+}
+
+TEST(detectEncoding, stream) {
+  std::istringstream stream(
+      encode(repeat("Hello World\n", 100), utf8streams::Encoding::Utf16BE));
+  auto guess = utf8streams::detectEncoding(stream);
+
+  EXPECT_EQ(utf8streams::Encoding::Utf16BE, guess.encoding);
+  EXPECT_EQ(0, stream.tellg());
+}
+
+TEST(detectEncoding, streamBOM) {
+  std::istringstream stream("\xEF\xBB\xBFHello World");
+  auto guess = utf8streams::detectEncoding(stream);
+
+  EXPECT_EQ(utf8streams::Encoding::Utf8, guess.encoding);
+  EXPECT_EQ(3, stream.tellg());
+}
+
+TEST(BasicUTF8StreamBuf, utf16LE) {
+  auto text = repeat("Hello W\xC3\xB6rld \xE2\x82\xAC\xF0\x9F\x98\x80\n", 5000);
+  std::istringstream stream(encode(text, utf8streams::Encoding::Utf16LE));
+  utf8streams::BasicUTF8StreamBuf<utf8streams::Encoding::Utf16LE> buf(stream);
+
+  std::string content((std::istreambuf_iterator<char>(stream)),
+                      std::istreambuf_iterator<char>());
+  EXPECT_EQ(text, content);
+}
+
+TEST(BasicUTF8StreamBuf, utf32BE) {
+  std::istringstream stream(std::string("\0\0\0a\0\x01\xF6\x00", 8));
+  utf8streams::BasicUTF8StreamBuf<utf8streams::Encoding::Utf32BE> buf(stream);
+
+  std::string content;
+  stream >> content;
+  EXPECT_EQ("a\xF0\x9F\x98\x80", content);
+}
+
+TEST(BasicUTF8StreamBuf, utf8) {
+  std::istringstream stream("Hello\xC0");
+  utf8streams::BasicUTF8StreamBuf<utf8streams::Encoding::Utf8> buf(stream);
+
+  std::string content;
+  stream >> content;
+  EXPECT_EQ("Hello\xC0", content);
+}
+
+TEST(BasicUTF8StreamBuf, validatedUtf8Error) {
+  std::istringstream stream("Hello\xC0");
+  utf8streams::BasicUTF8StreamBuf<utf8streams::Encoding::Utf8> buf(stream,
+                                                                  true);
+  stream.exceptions(std::ios::badbit);
+
+  std::string content;
+  EXPECT_THROW(stream >> content, utf8streams::UnicodeError);
+}
+
+TEST(toUtf8, utf16LE) {
+  auto text = repeat("Hello W\xC3\xB6rld \xE2\x82\xAC\xF0\x9F\x98\x80\n", 1000);
+  auto input = encode(text, utf8streams::Encoding::Utf16LE);
+  std::string output(text.size(), '\0');
+
+  auto result =
+      utf8streams::toUtf8(utf8streams::Encoding::Utf16LE, input.data(),
+                          input.size(), &output[0], output.size());
+  EXPECT_EQ(utf8streams::TranscodeError::None, result.error);
+  EXPECT_EQ(input.size(), result.consumed);
+  EXPECT_EQ(text.size(), result.produced);
+  EXPECT_EQ(text, output);
+}
+
+TEST(toUtf8, autoBOM) {
+  char output[16];
+  auto result = utf8streams::toUtf8(utf8streams::Encoding::Auto,
+                                    "\xFE\xFF\0a\0b", 6, output,
+                                    sizeof(output));
+
+  EXPECT_EQ(utf8streams::TranscodeError::None, result.error);
+  EXPECT_EQ(6u, result.consumed);
+  EXPECT_EQ("ab", std::string(output, result.produced));
+}
+
+TEST(toUtf8, outputFull) {
+  char output[5];
+  auto result = utf8streams::toUtf8(utf8streams::Encoding::Utf32LE,
+                                    "a\0\0\0\x00\xF6\x01\x00", 8, output,
+                                    sizeof(output) - 1);
+
+  EXPECT_EQ(utf8streams::TranscodeError::None, result.error);
+  EXPECT_EQ(4u, result.consumed);
+  EXPECT_EQ(1u, result.produced);
+}
+
+TEST(toUtf8, incomplete) {
+  char output[16];
+  auto result = utf8streams::toUtf8(utf8streams::Encoding::Utf16LE,
+                                    "a\0\x3D\xD8", 4, output, sizeof(output),
+                                    false);
+
+  EXPECT_EQ(utf8streams::TranscodeError::None, result.error);
+  EXPECT_EQ(2u, result.consumed);
+
+  result = utf8streams::toUtf8(utf8streams::Encoding::Utf16LE, "a\0\x3D\xD8",
+                               4, output, sizeof(output));
+  EXPECT_EQ(utf8streams::TranscodeError::UnpairedHighSurrogate, result.error);
+  EXPECT_EQ(2u, result.consumed);
+  EXPECT_EQ(2u, result.invalidLength);
+  EXPECT_EQ(1u, result.produced);
+}
+
+TEST(toUtf8, invalidCodePoint) {
+  char output[16];
+  auto result = utf8streams::toUtf8(utf8streams::Encoding::Utf32BE,
+                                    "\0\x11\0\0", 4, output, sizeof(output));
+
+  EXPECT_EQ(utf8streams::TranscodeError::InvalidCodePoint, result.error);
+  EXPECT_EQ(0x110000u, result.codePoint);
+}
+
+TEST(toUtf8, unknownEncoding) {
+  char output[16];
+  auto result = utf8streams::toUtf8(utf8streams::Encoding::Unknown, "a", 1,
+                                    output, sizeof(output));
+
+  EXPECT_EQ(utf8streams::TranscodeError::UnknownEncoding, result.error);
+  EXPECT_EQ(0u, result.consumed);
+}
+
+TEST(fromUtf8, utf32BE) {
+  char output[16];
+  auto result = utf8streams::fromUtf8(utf8streams::Encoding::Utf32BE,
+                                      "a\xF0\x9F\x98\x80", 5, output,
+                                      sizeof(output));
+
+  EXPECT_EQ(utf8streams::TranscodeError::None, result.error);
+  EXPECT_EQ(std::string("\0\0\0a\0\x01\xF6\x00", 8),
+            std::string(output, result.produced));
+}
+
+TEST(fromUtf8, invalidSequence) {
+  char output[16];
+  auto result = utf8streams::fromUtf8(utf8streams::Encoding::Utf16LE,
+                                      "ab\xE2\x28", 4, output, sizeof(output));
+
+  EXPECT_EQ(utf8streams::TranscodeError::InvalidSequence, result.error);
+  EXPECT_EQ(2u, result.consumed);
+  EXPECT_EQ(4u, result.produced);
+}
+
+static void expectSameAsToUtf8(utf8streams::Encoding encoding,
+                               const std::string &input, size_t outputSize,
+                               unsigned threadCount) {
+  std::string expected(outputSize, '\0');
+  std::string output(outputSize, '\0');
+
+  auto expectedResult =
+      utf8streams::toUtf8(encoding, input.data(), input.size(), &expected[0],
+                          expected.size());
+  auto result = utf8streams::toUtf8Parallel(encoding, input.data(),
+                                            input.size(), &output[0],
+                                            output.size(), threadCount);
+
+  EXPECT_EQ(expectedResult.error, result.error);
+  EXPECT_EQ(expectedResult.consumed, result.consumed);
+  EXPECT_EQ(expectedResult.produced, result.produced);
+  EXPECT_EQ(expectedResult.invalidLength, result.invalidLength);
+  EXPECT_EQ(expected.substr(0, expectedResult.produced),
+            output.substr(0, result.produced));
+}
+
+TEST(toUtf8Parallel, encodings) {
+  auto text = repeat("Hello W\xC3\xB6rld \xE2\x82\xAC\xF0\x9F\x98\x80\n",
+                     200000);
+
+  for (auto encoding :
+       {utf8streams::Encoding::Utf8, utf8streams::Encoding::Utf16LE,
+        utf8streams::Encoding::Utf16BE, utf8streams::Encoding::Utf32LE,
+        utf8streams::Encoding::Utf32BE}) {
+    auto input = encode(text, encoding);
+    std::string output(text.size(), '\0');
+
+    auto result = utf8streams::toUtf8Parallel(
+        encoding, input.data(), input.size(), &output[0], output.size(), 4);
+    EXPECT_EQ(utf8streams::TranscodeError::None, result.error);
+    EXPECT_EQ(input.size(), result.consumed);
+    EXPECT_EQ(text.size(), result.produced);
+    EXPECT_EQ(text, output);
+  }
+}
+
+TEST(toUtf8Parallel, splitSequences) {
+  // Odd chunk counts move the boundaries into surrogate pairs and sequences
+  auto text = "a" + repeat("\xF0\x9F\x98\x80", 1000001);
+
+  for (unsigned threadCount = 2; threadCount < 8; ++threadCount) {
+    expectSameAsToUtf8(utf8streams::Encoding::Utf8, text, text.size(),
+                       threadCount);
+    expectSameAsToUtf8(utf8streams::Encoding::Utf16BE,
+                       encode(text, utf8streams::Encoding::Utf16BE),
+                       text.size(), threadCount);
+  }
+}
+
+TEST(toUtf8Parallel, autoBOM) {
+  auto text = repeat("Hello W\xC3\xB6rld\n", 500000);
+  std::string input = "\xFF\xFE" + encode(text, utf8streams::Encoding::Utf16LE);
+  std::string output(text.size(), '\0');
+
+  auto result = utf8streams::toUtf8Parallel(utf8streams::Encoding::Auto,
+                                            input.data(), input.size(),
+                                            &output[0], output.size(), 4);
+  EXPECT_EQ(utf8streams::TranscodeError::None, result.error);
+  EXPECT_EQ(input.size(), result.consumed);
+  EXPECT_EQ(text, output);
+
+  // Inputs too small to split skip the BOM as well
+  expectSameAsToUtf8(utf8streams::Encoding::Auto,
+                     std::string("\xFF\xFEH\0i\0", 6), 8, 4);
+  expectSameAsToUtf8(utf8streams::Encoding::Auto, "\xEF\xBB\xBFHi", 8, 4);
+}
+
+TEST(toUtf8Parallel, firstError) {
+  auto input = encode(repeat("Hello W\xC3\xB6rld\n", 500000),
+                      utf8streams::Encoding::Utf16LE);
+  input[input.size() / 2 + 1] = '\xDC';
+  input[input.size() - 1] = '\xD8';
+
+  expectSameAsToUtf8(utf8streams::Encoding::Utf16LE, input, input.size(), 4);
+}
+
+TEST(toUtf8Parallel, outputFull) {
+  auto text = repeat("Hello W\xC3\xB6rld\n", 500000);
+
+  expectSameAsToUtf8(utf8streams::Encoding::Utf32BE,
+                     encode(text, utf8streams::Encoding::Utf32BE),
+                     text.size() / 3 * 2 + 1, 4);
+}
+
+TEST(utf8Length, encodings) {
+  auto text = repeat("Hello W\xC3\xB6rld \xE2\x82\xAC\xF0\x9F\x98\x80\n", 1000);
+
+  for (auto encoding :
+       {utf8streams::Encoding::Utf8, utf8streams::Encoding::Utf16LE,
+        utf8streams::Encoding::Utf16BE, utf8streams::Encoding::Utf32LE,
+        utf8streams::Encoding::Utf32BE}) {
+    auto input = encode(text, encoding);
+
+    EXPECT_EQ(text.size(),
+              utf8streams::utf8Length(encoding, input.data(), input.size()));
+
+    auto result = utf8streams::checkedUtf8Length(encoding, input.data(),
+                                                 input.size());
+    EXPECT_EQ(utf8streams::TranscodeError::None, result.error);
+    EXPECT_EQ(input.size(), result.consumed);
+    EXPECT_EQ(text.size(), result.produced);
+  }
+}
+
+TEST(utf8Length, autoBOM) {
+  EXPECT_EQ(2u, utf8streams::utf8Length(utf8streams::Encoding::Auto,
+                                        "\xFF\xFE\xE4\0", 4));
+}
+
+TEST(utf8Length, invalid) {
+  auto input = repeat(std::string("a\0", 2), 100) + std::string("\0\xDC", 2) +
+               repeat(std::string("b\0", 2), 100);
+
+  EXPECT_EQ(203u, utf8streams::utf8Length(utf8streams::Encoding::Utf16LE,
+                                          input.data(), input.size()));
+
+  auto result = utf8streams::checkedUtf8Length(
+      utf8streams::Encoding::Utf16LE, input.data(), input.size());
+  EXPECT_EQ(utf8streams::TranscodeError::UnpairedLowSurrogate, result.error);
+  EXPECT_EQ(200u, result.consumed);
+  EXPECT_EQ(100u, result.produced);
+}
+
+TEST(readAll, utf16BOM) {
+  auto text =
+      repeat("Hello W\xC3\xB6rld \xE2\x82\xAC\xF0\x9F\x98\x80\n", 10000);
+  std::istringstream stream("\xFF\xFE" +
+                            encode(text, utf8streams::Encoding::Utf16LE));
+
+  EXPECT_EQ(text, utf8streams::readAll(stream));
+  EXPECT_TRUE(stream.eof());
+}
+
+TEST(readAll, seekableBlocks) {
+  // Surrogate pairs and the BOM lie across the measured blocks
+  auto text = repeat("x\xF0\x9F\x98\x80 \xE2\x82\xAC", 40000);
+  std::istringstream stream(
+      "skip\xFE\xFF" + encode(text, utf8streams::Encoding::Utf16BE));
+  stream.seekg(4);
+
+  EXPECT_EQ(text, utf8streams::readAll(stream));
+  EXPECT_TRUE(stream.eof());
+
+  std::istringstream invalid(
+      encode(text, utf8streams::Encoding::Utf32LE) + "\xFF\xFF\xFF\xFF");
+  EXPECT_THROW(
+      utf8streams::readAll(invalid, utf8streams::Encoding::Utf32LE),
+      utf8streams::UnicodeError);
+}
+
+TEST(readAll, pipe) {
+  auto text = repeat("Hello World\n", 10000);
+  PipeBuf pipe(encode(text, utf8streams::Encoding::Utf32BE));
+  std::istream stream(&pipe);
+
+  EXPECT_EQ(text,
+            utf8streams::readAll(stream, utf8streams::Encoding::Utf32BE));
+}
+
+TEST(readAll, utf8) {
+  std::istringstream stream("\xEF\xBB\xBFHello\xC0");
+
+  EXPECT_EQ("Hello\xC0", utf8streams::readAll(stream));
+}
+
+TEST(readAll, error) {
+  std::istringstream stream("Hello\xC0");
+
+  EXPECT_THROW(
+      utf8streams::readAll(stream, utf8streams::Encoding::Utf8, true),
+      utf8streams::UnicodeError);
+}
+
+TEST(ErrorPolicy, replace) {
+  std::istringstream stream(
+      std::string("\xFF\xFE" "a\0\x00\xDC" "b\0\x3D\xD8", 10));
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Auto);
+  buf.setErrorPolicy(utf8streams::ErrorPolicy::Replace);
+
+  EXPECT_EQ("a\xEF\xBF\xBD" "b\xEF\xBF\xBD", readAll(buf));
+  EXPECT_EQ(2u, buf.errorCount());
+  EXPECT_EQ(4, buf.firstErrorOffset());
+}
+
+TEST(ErrorPolicy, skip) {
+  // Errors in both halves of the input buffer
+  auto text = repeat("abc", 10000) + "\xC0\xAF" + repeat("def", 10000) + "\xFF";
+  std::istringstream stream(text);
+  utf8streams::BasicUTF8StreamBuf<utf8streams::Encoding::Utf8> buf(stream,
+                                                                    true);
+  buf.setErrorPolicy(utf8streams::ErrorPolicy::Skip);
+
+  EXPECT_EQ(repeat("abc", 10000) + repeat("def", 10000), readAll(buf));
+  EXPECT_EQ(3u, buf.errorCount());
+  EXPECT_EQ(30000, buf.firstErrorOffset());
+}
+
+TEST(ErrorPolicy, throwCounts) {
+  std::istringstream stream(std::string("\0\0\0H\0\x11\0\0", 8));
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Utf32BE);
+
+  EXPECT_EQ(0u, buf.errorCount());
+  EXPECT_EQ(-1, buf.firstErrorOffset());
+
+  std::istream input(&buf);
+  input.exceptions(std::ios::badbit);
+  EXPECT_EQ('H', input.get());
+  EXPECT_THROW(input.get(), utf8streams::UnicodeError);
+  EXPECT_EQ(1u, buf.errorCount());
+  EXPECT_EQ(4, buf.firstErrorOffset());
+}
+
+TEST(ErrorPolicy, replaceFullOutput) {
+  // Each replacement character is larger than its invalid sequence
+  auto text = repeat("\xFF", 40000);
+  auto path = writeTempFile("utf8streams_policy1.txt", "a" + text);
+
+  utf8streams::MappedUTF8StreamBuf buf(path, utf8streams::Encoding::Utf8,
+                                       true);
+  buf.setErrorPolicy(utf8streams::ErrorPolicy::Replace);
+
+  EXPECT_EQ("a" + repeat("\xEF\xBF\xBD", 40000), readAll(buf));
+  EXPECT_EQ(40000u, buf.errorCount());
+  EXPECT_EQ(1, buf.firstErrorOffset());
+}
+
+TEST(ErrorPolicy, output) {
+  std::ostringstream stream;
+  {
+    utf8streams::UTF8OutputStreamBuf buf(stream,
+                                         utf8streams::Encoding::Utf16BE);
+    buf.setErrorPolicy(utf8streams::ErrorPolicy::Replace);
+    std::ostream output(&buf);
+
+    // Each byte of an encoded surrogate is a separate error
+    output << "ab\xFF" "c\xED\xA0\x80";
+    output.flush();
+    EXPECT_EQ(4u, buf.errorCount());
+    EXPECT_EQ(2, buf.firstErrorOffset());
+  }
+
+  EXPECT_EQ(std::string("\0a\0b\xFF\xFD\0c", 8) + repeat("\xFF\xFD", 3),
+            stream.str());
+}
+
+static std::string numberedLines(size_t count) {
+  std::string result;
+  for (size_t i = 0; i < count; ++i) {
+    result += std::to_string(i) + " \xC3\xB6\xE2\x82\xAC\xF0\x9F\x98\x80\n";
+  }
+  return result;
+}
+
+TEST(Seek, utf16) {
+  auto text = numberedLines(50000);
+  std::istringstream stream(encode(text, utf8streams::Encoding::Utf16LE));
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Utf16LE);
+
+  std::string content(300000, '\0');
+  stream.read(&content[0], 300000);
+  EXPECT_EQ(300000, stream.tellg());
+
+  for (std::streamoff pos : {250000, 12345, 0, 299999, 400000, 123456}) {
+    stream.seekg(pos);
+    EXPECT_EQ(pos, stream.tellg());
+
+    char buffer[100];
+    stream.read(buffer, sizeof(buffer));
+    EXPECT_EQ(text.substr(static_cast<size_t>(pos), sizeof(buffer)),
+              std::string(buffer, sizeof(buffer)));
+  }
+
+  stream.seekg(-100, std::ios::cur);
+  EXPECT_EQ(123456, stream.tellg());
+  EXPECT_EQ(text[123456], static_cast<char>(stream.get()));
+}
+
+TEST(Seek, autoBOM) {
+  auto text = numberedLines(10000);
+  std::istringstream stream(std::string("\0\0\xFE\xFF", 4) +
+                            encode(text, utf8streams::Encoding::Utf32BE));
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Auto);
+
+  std::string content((std::istreambuf_iterator<char>(stream)),
+                      std::istreambuf_iterator<char>());
+  EXPECT_EQ(text, content);
+
+  stream.clear();
+  stream.seekg(0);
+  EXPECT_EQ(text.substr(0, 10000), readAll(buf).substr(0, 10000));
+}
+
+TEST(Seek, largeIndex) {
+  // More checkpoints than the index holds
+  auto text = repeat("0123456789abcdef", 1200000);
+  std::istringstream stream(text);
+  utf8streams::BasicUTF8StreamBuf<utf8streams::Encoding::Utf8> buf(stream,
+                                                                    true);
+
+  std::string content(text.size(), '\0');
+  stream.read(&content[0], static_cast<std::streamsize>(content.size()));
+  EXPECT_EQ(text, content);
+
+  for (std::streamoff pos : {19000001, 5, 7000003, 16777217}) {
+    stream.seekg(pos);
+    EXPECT_EQ(text[static_cast<size_t>(pos)], static_cast<char>(stream.get()));
+  }
+}
+
+TEST(Seek, pipe) {
+  auto text = numberedLines(10000);
+  PipeBuf pipe(text);
+  std::istream stream(&pipe);
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Utf8, true);
+
+  stream.seekg(50000);
+  EXPECT_EQ(text[50000], static_cast<char>(stream.get()));
+
+  // Within the get area
+  stream.seekg(50000);
+  EXPECT_EQ(text[50000], static_cast<char>(stream.get()));
+
+  stream.seekg(100000);
+  EXPECT_EQ(text[100000], static_cast<char>(stream.get()));
+  stream.seekg(0);
+  EXPECT_TRUE(stream.fail());
+}
+
+#ifdef UTF8STREAMS_STATS
+TEST(Stats, counters) {
+  auto text = repeat("a\xC3\xB6", 1000);
+  std::istringstream stream(encode(text, utf8streams::Encoding::Utf16BE) +
+                            std::string("\xDC\x00", 2));
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Utf16BE);
+  buf.setErrorPolicy(utf8streams::ErrorPolicy::Skip);
+
+  EXPECT_EQ(text, readAll(buf));
+
+  auto stats = buf.stats();
+  EXPECT_LE(2u, stats.sourceReads);
+  EXPECT_EQ(4002u, stats.sourceBytes);
+  EXPECT_LE(1u, stats.reads);
+  EXPECT_EQ(text.size(), stats.outputBytes);
+  EXPECT_EQ(1000u, stats.asciiBytes);
+  EXPECT_EQ(1u, stats.errors);
+
+  buf.resetStats();
+  EXPECT_EQ(0u, buf.stats().outputBytes);
+  EXPECT_EQ(0u, buf.stats().errors);
+}
+
+TEST(Stats, underflows) {
+  std::istringstream stream("abc");
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Utf8);
+
+  while (stream.get() != EOF) {
+  }
+  EXPECT_EQ(2u, buf.stats().underflows);
+  EXPECT_EQ(3u, buf.stats().outputBytes);
+}
+#else
+TEST(Stats, disabled) {
+  std::istringstream stream("abc");
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Utf8);
+
+  EXPECT_EQ("abc", readAll(buf));
+  EXPECT_EQ(0u, buf.stats().outputBytes);
+}
+#endif
+
+TEST(Prefetch, utf16) {
+  auto text = numberedLines(100000);
+  std::istringstream stream(encode(text, utf8streams::Encoding::Utf16BE));
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Utf16BE);
+  buf.startPrefetching();
+
+  EXPECT_EQ(text, readAll(buf));
+}
+
+TEST(Prefetch, pipeAutoBOM) {
+  auto text = numberedLines(1000);
+  PipeBuf pipe("\xFF\xFE" + encode(text, utf8streams::Encoding::Utf16LE));
+  std::istream stream(&pipe);
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Auto);
+  buf.startPrefetching();
+
+  EXPECT_EQ(text, readAll(buf));
+  EXPECT_EQ(utf8streams::Encoding::Utf16LE, buf.encoding());
+}
+
+TEST(Prefetch, seek) {
+  auto text = numberedLines(50000);
+  std::istringstream stream(encode(text, utf8streams::Encoding::Utf32LE));
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Utf32LE);
+  buf.startPrefetching();
+
+  std::string content(300000, '\0');
+  stream.read(&content[0], 300000);
+  EXPECT_EQ(text.substr(0, 300000), content);
+
+  stream.seekg(1000);
+  EXPECT_EQ(text.substr(1000), readAll(buf));
+}
+
+// Fails on the first read
+class FailingBuf : public std::streambuf {
+protected:
+  int underflow() override { throw std::runtime_error("Read failed"); }
+};
+
+TEST(Prefetch, sourceError) {
+  FailingBuf failing;
+  std::istream stream(&failing);
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Utf16LE);
+  buf.startPrefetching();
+  stream.exceptions(std::ios::badbit);
+
+  EXPECT_THROW(stream.get(), std::runtime_error);
+}
+
+static const char32_t CODE_POINTS[] = U"Hello Wörld €\U0001F600\n";
+
+TEST(CodePointReader, encodings) {
+  auto text =
+      repeat("Hello W\xC3\xB6rld \xE2\x82\xAC\xF0\x9F\x98\x80\n", 1000);
+  std::u32string expected;
+  for (int i = 0; i < 1000; ++i) {
+    expected += CODE_POINTS;
+  }
+
+  for (auto encoding :
+       {utf8streams::Encoding::Utf8, utf8streams::Encoding::Utf16LE,
+        utf8streams::Encoding::Utf16BE, utf8streams::Encoding::Utf32LE,
+        utf8streams::Encoding::Utf32BE}) {
+    std::istringstream stream(encode(text, encoding));
+    utf8streams::CodePointReader reader(stream, encoding);
+
+    std::u32string result;
+    char32_t buffer[1000];
+    while (auto count = reader.read(buffer, sizeof(buffer) / 4)) {
+      result.append(buffer, count);
+    }
+    EXPECT_EQ(expected, result);
+  }
+}
+
+TEST(CodePointReader, iterator) {
+  auto text = encode("a\xF0\x9F\x98\x80z", utf8streams::Encoding::Utf16BE);
+  std::istringstream stream("\xFE\xFF" + text);
+  utf8streams::CodePointReader reader(stream);
+
+  std::u32string result(reader.begin(), reader.end());
+  EXPECT_EQ(U"a\U0001F600z", result);
+  EXPECT_EQ(utf8streams::Encoding::Utf16BE, reader.encoding());
+}
+
+TEST(CodePointReader, nextAndRead) {
+  std::istringstream stream("abc");
+  utf8streams::CodePointReader reader(stream, utf8streams::Encoding::Utf8);
+
+  char32_t codePoint;
+  EXPECT_TRUE(reader.next(codePoint));
+  EXPECT_EQ(U'a', codePoint);
+
+  char32_t buffer[4];
+  EXPECT_EQ(2u, reader.read(buffer, 4));
+  EXPECT_EQ(U'c', buffer[1]);
+  EXPECT_FALSE(reader.next(codePoint));
+  EXPECT_EQ(0u, reader.read(buffer, 4));
+}
+
+TEST(CodePointReader, pipe) {
+  auto text = repeat("a\xC3\xB6\xE2\x82\xAC", 1000);
+  PipeBuf pipe(text);
+  std::istream stream(&pipe);
+  utf8streams::CodePointReader reader(stream);
+
+  std::u32string result(reader.begin(), reader.end());
+  EXPECT_EQ(3000u, result.size());
+  EXPECT_EQ(U'€', result.back());
+}
+
+TEST(CodePointReader, errors) {
+  std::istringstream stream(std::string("a\0\0\0\0\xD8\0\0b\0\0\0", 12));
+  utf8streams::CodePointReader reader(stream, utf8streams::Encoding::Utf32LE);
+
+  char32_t buffer[4];
+  EXPECT_EQ(1u, reader.read(buffer, 4));
+  EXPECT_THROW(reader.read(buffer, 4), utf8streams::UnicodeError);
+  EXPECT_EQ(1u, reader.read(buffer, 4));
+  EXPECT_EQ(U'b', buffer[0]);
+  EXPECT_EQ(4, reader.firstErrorOffset());
+
+  std::istringstream stream2("a\xFF" "b\xE2\x82");
+  utf8streams::CodePointReader reader2(stream2, utf8streams::Encoding::Utf8);
+  reader2.setErrorPolicy(utf8streams::ErrorPolicy::Replace);
+
+  EXPECT_EQ(U"a�b�", std::u32string(reader2.begin(), reader2.end()));
+  EXPECT_EQ(2u, reader2.errorCount());
+}
+
+static std::vector<std::string> readLines(utf8streams::LineReader &reader) {
+  std::vector<std::string> lines;
+  utf8streams::Line line;
+  while (reader.next(line)) {
+    lines.push_back(line.str());
+  }
+  return lines;
+}
+
+TEST(LineReader, utf16) {
+  // Lines cross the boundaries of the decoded blocks
+  auto text = numberedLines(20000);
+  std::istringstream stream(encode(text, utf8streams::Encoding::Utf16LE));
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Utf16LE);
+  utf8streams::LineReader reader(buf);
+
+  std::istringstream expected(text);
+  std::string expectedLine;
+  for (const auto &line : readLines(reader)) {
+    ASSERT_TRUE(std::getline(expected, expectedLine));
+    EXPECT_EQ(expectedLine, line);
+  }
+  EXPECT_FALSE(std::getline(expected, expectedLine));
+}
+
+TEST(LineReader, carriageReturn) {
+  std::istringstream stream("a\r\n\r\nb\rc\n\nlast\r");
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Utf8);
+  utf8streams::LineReader reader(buf, true);
+
+  EXPECT_EQ((std::vector<std::string>{"a", "", "b\rc", "", "last"}),
+            readLines(reader));
+}
+
+TEST(LineReader, longLine) {
+  auto text = repeat("x", 100000) + "\n" + repeat("y", 70000);
+  auto path = writeTempFile("utf8streams_lines1.txt", text);
+  utf8streams::MappedUTF8StreamBuf buf(path, utf8streams::Encoding::Utf8,
+                                       true);
+  utf8streams::LineReader reader(buf);
+
+  EXPECT_EQ((std::vector<std::string>{repeat("x", 100000),
+                                      repeat("y", 70000)}),
+            readLines(reader));
+}
+
+TEST(LineReader, mixedWithStream) {
+  std::istringstream source("first\nsecond\nthird");
+  utf8streams::UTF8StreamBuf buf(source, utf8streams::Encoding::Utf8);
+  std::istream stream(&buf);
+  utf8streams::LineReader reader(buf);
+
+  utf8streams::Line line;
+  ASSERT_TRUE(reader.next(line));
+  EXPECT_EQ("first", line.str());
+
+  std::string word;
+  stream >> word;
+  EXPECT_EQ("second", word);
+
+  ASSERT_TRUE(reader.next(line));
+  EXPECT_EQ("", line.str());
+  ASSERT_TRUE(reader.next(line));
+  EXPECT_EQ("third", line.str());
+  EXPECT_FALSE(reader.next(line));
+}
+
+TEST(SingleByte, latin1) {
+  std::istringstream stream("Gr\xFC\xDF" "e \xA4\x80");
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Latin1);
+
+  EXPECT_EQ("Gr\xC3\xBC\xC3\x9F" "e \xC2\xA4\xC2\x80", readAll(buf));
+}
+
+TEST(SingleByte, windows1252) {
+  std::istringstream stream("\x80 \x93q\x94 \x81\x9F");
+  utf8streams::UTF8StreamBuf buf(stream, utf8streams::Encoding::Windows1252);
+
+  EXPECT_EQ("\xE2\x82\xAC \xE2\x80\x9Cq\xE2\x80\x9D \xC2\x81\xC5\xB8",
+            readAll(buf));
+}
+
+TEST(SingleByte, iso8859_15) {
+  std::istringstream stream("\xA4\xBC\xE9\x80");
+  utf8streams::BasicUTF8StreamBuf<utf8streams::Encoding::Iso8859_15> buf(
+      stream);
+
+  EXPECT_EQ("\xE2\x82\xAC\xC5\x92\xC3\xA9\xC2\x80", readAll(buf));
+}
+
+TEST(SingleByte, largeInput) {
+  // ASCII runs of varying length around the non-ASCII bytes
+  auto input = repeat("Hello W\xF6rld \x80\x80 and a longer ASCII run\n\xE9",
+                      60000);
+  auto text = repeat("Hello W\xC3\xB6rld \xE2\x82\xAC\xE2\x82\xAC"
+                     " and a longer ASCII run\n\xC3\xA9",
+                     60000);
+  auto encoding = utf8streams::Encoding::Windows1252;
+
+  std::istringstream stream(input);
+  utf8streams::UTF8StreamBuf streamBuf(stream, encoding);
+  EXPECT_EQ(text, readAll(streamBuf));
+
+  auto path = writeTempFile("utf8streams_single1.txt", input);
+  utf8streams::MappedUTF8StreamBuf mappedBuf(path, encoding);
+  EXPECT_EQ(text, readAll(mappedBuf));
+
+  EXPECT_EQ(text.size(),
+            utf8streams::utf8Length(encoding, input.data(), input.size()));
+  std::string output(text.size(), '\0');
+  auto result = utf8streams::toUtf8Parallel(
+      encoding, input.data(), input.size(), &output[0], output.size(), 4);
+  EXPECT_EQ(input.size(), result.consumed);
+  EXPECT_EQ(text, output);
+
+  std::istringstream codePointStream(input);
+  utf8streams::CodePointReader reader(codePointStream, encoding);
+  std::u32string codePoints(reader.begin(), reader.end());
+  EXPECT_EQ(input.size(), codePoints.size());
+  EXPECT_EQ(U'€', codePoints[12]);
+  EXPECT_EQ(U'é', codePoints.back());
+}
+
+TEST(SingleByte, sourceOnly) {
+  char output[4];
+  auto result = utf8streams::fromUtf8(utf8streams::Encoding::Latin1, "a", 1,
+                                      output, sizeof(output));
+  EXPECT_EQ(utf8streams::TranscodeError::UnknownEncoding, result.error);
+
+  std::ostringstream stream;
+  EXPECT_THROW(utf8streams::UTF8OutputStreamBuf(
+                   stream, utf8streams::Encoding::Windows1252),
+               utf8streams::Error);
+}
+
+static std::string readFile(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>());
+}
+
+TEST(Batch, encodings) {
+  auto text = repeat("Hello W\xC3\xB6rld \xE2\x82\xAC\n", 100);
+  const utf8streams::Encoding encodings[] = {
+      utf8streams::Encoding::Utf8, utf8streams::Encoding::Utf16LE,
+      utf8streams::Encoding::Utf16BE, utf8streams::Encoding::Utf32LE};
+
+  std::vector<utf8streams::BatchFile> files;
+  for (size_t i = 0; i < 200; ++i) {
+    auto encoding = encodings[i % 4];
+    // Every second file has a BOM
+    auto bom = i % 8 < 4 ? "" : "\xEF\xBB\xBF";
+    auto name = "utf8streams_batch" + std::to_string(i);
+    files.push_back(utf8streams::BatchFile{
+        writeTempFile(name + ".in",
+                      encode(bom + std::to_string(i) + text, encoding)),
+        ::testing::TempDir() + name + ".out", utf8streams::Encoding::Auto});
+  }
+
+  auto results = utf8streams::transcodeFiles(
+      files, utf8streams::ErrorPolicy::Throw, 4);
+  ASSERT_EQ(files.size(), results.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    EXPECT_EQ("", results[i].error);
+    EXPECT_EQ(encodings[i % 4], results[i].encoding);
+    auto expected = std::to_string(i) + text;
+    EXPECT_EQ(expected, readFile(files[i].outputPath));
+    EXPECT_EQ(expected.size(), results[i].outputBytes);
+  }
+}
+
+TEST(Batch, explicitEncodingBOM) {
+  auto text = std::string("Hello W\xC3\xB6rld\n");
+  std::vector<utf8streams::BatchFile> files;
+  for (auto encoding :
+       {utf8streams::Encoding::Utf8, utf8streams::Encoding::Utf16LE,
+        utf8streams::Encoding::Utf32BE}) {
+    auto name = "utf8streams_batch_bom" + std::to_string(files.size());
+    files.push_back(utf8streams::BatchFile{
+        writeTempFile(name + ".in", encode("\xEF\xBB\xBF" + text, encoding)),
+        ::testing::TempDir() + name + ".out", encoding});
+  }
+
+  auto results = utf8streams::transcodeFiles(files);
+  for (size_t i = 0; i < files.size(); ++i) {
+    EXPECT_EQ("", results[i].error);
+    EXPECT_EQ(text, readFile(files[i].outputPath));
+  }
+}
+
+TEST(Batch, errors) {
+  auto dir = ::testing::TempDir();
+  std::vector<utf8streams::BatchFile> files{
+      {dir + "utf8streams_batch_missing.in", dir + "utf8streams_batch_a.out",
+       utf8streams::Encoding::Auto},
+      {writeTempFile("utf8streams_batch_b.in", "ab\xFF" "c"),
+       dir + "utf8streams_batch_b.out", utf8streams::Encoding::Utf8},
+      {writeTempFile("utf8streams_batch_c.in", "caf\xE9"),
+       dir + "utf8streams_batch_c.out", utf8streams::Encoding::Latin1},
+      {writeTempFile("utf8streams_batch_d.in", ""),
+       dir + "utf8streams_batch_d.out", utf8streams::Encoding::Auto}};
+  std::remove(files[1].outputPath.c_str());
+
+  auto results = utf8streams::transcodeFiles(files);
+  EXPECT_EQ("Cannot read file " + files[0].inputPath, results[0].error);
+  EXPECT_EQ("Invalid UTF-8 sequence found at offset 2 of " +
+                files[1].inputPath,
+            results[1].error);
+  EXPECT_FALSE(std::ifstream(files[1].outputPath).good());
+  EXPECT_EQ("", results[2].error);
+  EXPECT_EQ("caf\xC3\xA9", readFile(files[2].outputPath));
+  EXPECT_EQ("", results[3].error);
+  EXPECT_EQ(utf8streams::Encoding::Utf8, results[3].encoding);
+  EXPECT_EQ("", readFile(files[3].outputPath));
+
+  results = utf8streams::transcodeFiles(
+      files, utf8streams::ErrorPolicy::Replace, 2);
+  EXPECT_EQ("", results[1].error);
+  EXPECT_EQ(1u, results[1].errorCount);
+  EXPECT_EQ("ab\xEF\xBF\xBD" "c", readFile(files[1].outputPath));
+}
+
+TEST(Batch, empty) {
+  EXPECT_TRUE(utf8streams::transcodeFiles({}).empty());
+}
+
+#ifndef _WIN32
+
+// Writes data in pieces of pieceSize bytes to a pipe on a separate thread
+class PipeWriter {
+  int fds[2];
+  std::thread thread;
+
+public:
+  PipeWriter(const std::string &data, size_t pieceSize) {
+    if (pipe(fds) != 0) {
+      throw std::runtime_error("Cannot create pipe");
+    }
+
+    auto fd = fds[1];
+    thread = std::thread([fd, data, pieceSize]() {
+      for (size_t pos = 0; pos < data.size(); pos += pieceSize) {
+        auto count = std::min(pieceSize, data.size() - pos);
+        if (write(fd, data.data() + pos, count) !=
+            static_cast<ssize_t>(count)) {
+          break;
+        }
+      }
+      close(fd);
+    });
+  }
+
+  // Drains the pipe, so the writer cannot block
+  ~PipeWriter() {
+    char buffer[4096];
+    while (read(fds[0], buffer, sizeof(buffer)) > 0) {
+    }
+    close(fds[0]);
+    thread.join();
+  }
+
+  int readEnd() const { return fds[0]; }
+};
+
+TEST(Descriptor, pipeSplitUnits) {
+  auto text = repeat("Hello W\xC3\xB6rld \xF0\x9F\x98\x80\n", 2000);
+  PipeWriter writer(encode(text, utf8streams::Encoding::Utf16BE), 3);
+  utf8streams::UTF8StreamBuf buf(writer.readEnd(),
+                                 utf8streams::Encoding::Utf16BE);
+
+  EXPECT_EQ(text, readAll(buf));
+}
+
+TEST(Descriptor, pipeAutoBOM) {
+  auto text = repeat("a\xE2\x82\xAC", 50000);
+  PipeWriter writer("\xFF\xFE" + encode(text, utf8streams::Encoding::Utf16LE),
+                    70000);
+  utf8streams::UTF8StreamBuf buf(writer.readEnd(),
+                                 utf8streams::Encoding::Auto);
+  buf.startPrefetching();
+
+  EXPECT_EQ(text, readAll(buf));
+  EXPECT_EQ(utf8streams::Encoding::Utf16LE, buf.encoding());
+}
+
+TEST(Descriptor, codePoints) {
+  auto text = repeat("a\xE2\x82\xAC\xF0\x9F\x98\x80", 20000);
+  auto data = "\xFE\xFF" + encode(text, utf8streams::Encoding::Utf16BE);
+  PipeWriter writer(data, 5000);
+  utf8streams::CodePointReader reader(writer.readEnd());
+  reader.startPrefetching();
+
+  std::u32string result(reader.begin(), reader.end());
+  EXPECT_EQ(60000u, result.size());
+  EXPECT_EQ(U'\U0001F600', result.back());
+  EXPECT_EQ(utf8streams::Encoding::Utf16BE, reader.encoding());
+#ifdef UTF8STREAMS_STATS
+  EXPECT_EQ(data.size(), reader.stats().sourceBytes);
+#endif
+}
+
+TEST(Descriptor, fileSeek) {
+  auto text = numberedLines(50000);
+  auto path = writeTempFile("utf8streams_descriptor1.txt",
+                            encode(text, utf8streams::Encoding::Utf32LE));
+  auto fd = open(path.c_str(), O_RDONLY);
+  ASSERT_NE(-1, fd);
+
+  {
+    utf8streams::BasicUTF8StreamBuf<utf8streams::Encoding::Utf32LE> buf(fd);
+    std::istream stream(&buf);
+
+    std::string content(300000, '\0');
+    stream.read(&content[0], 300000);
+    EXPECT_EQ(text.substr(0, 300000), content);
+
+    stream.seekg(1000);
+    EXPECT_EQ(text.substr(1000), readAll(buf));
+  }
+  close(fd);
+}
+
+TEST(Descriptor, fileOffset) {
+  auto path = writeTempFile("utf8streams_descriptor2.txt",
+                            "skipped\n" + repeat("abc\n", 5000));
+  auto fd = open(path.c_str(), O_RDONLY);
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(8, lseek(fd, 8, SEEK_SET));
+
+  {
+    utf8streams::UTF8StreamBuf buf(fd, utf8streams::Encoding::Utf8, true);
+    std::istream stream(&buf);
+
+    EXPECT_EQ(repeat("abc\n", 5000), readAll(buf));
+    stream.seekg(4);
+    std::string line;
+    std::getline(stream, line);
+    EXPECT_EQ("abc", line);
+  }
+  close(fd);
+}
+
+TEST(Descriptor, errors) {
+  EXPECT_THROW(utf8streams::UTF8StreamBuf(-1, utf8streams::Encoding::Utf8),
+               utf8streams::Error);
+
+  auto path = writeTempFile("utf8streams_descriptor3.txt", "abc");
+  auto fd = open(path.c_str(), O_WRONLY);
+  ASSERT_NE(-1, fd);
+  {
+    utf8streams::UTF8StreamBuf buf(fd, utf8streams::Encoding::Utf8);
+    std::istream stream(&buf);
+    stream.exceptions(std::ios::badbit);
+    EXPECT_THROW(stream.get(), utf8streams::Error);
+  }
+  close(fd);
+}
+
+#endif
+
+static const utf8streams::Encoding UNICODE_ENCODINGS[] = {
+    utf8streams::Encoding::Utf8, utf8streams::Encoding::Utf16LE,
+    utf8streams::Encoding::Utf16BE, utf8streams::Encoding::Utf32LE,
+    utf8streams::Encoding::Utf32BE};
+
+TEST(Transcoding, allPairs) {
+  auto text = repeat("Hello W\xC3\xB6rld \xD0\x9F\xD1\x80\xD0\xB8\xD0\xB2"
+                     "\xD0\xB5\xD1\x82 \xE2\x82\xAC\xF0\x9F\x98\x80\n",
+                     1000);
+
+  for (auto source : UNICODE_ENCODINGS) {
+    for (auto target : UNICODE_ENCODINGS) {
+      std::istringstream stream(encode(text, source));
+      utf8streams::TranscodingStreamBuf buf(stream, source, target);
+
+      EXPECT_EQ(encode(text, target), readAll(buf));
+      EXPECT_EQ(target, buf.targetEncoding());
+    }
+  }
+}
+
+TEST(Transcoding, twoByteSequences) {
+  auto text = repeat("\xC3\x9F\xC3\xA9\xD0\xB6 \xCE\xB1\xCE\xB2", 50);
+
+  for (size_t offset = 0; offset < 40; ++offset) {
+    auto input = std::string(offset, 'a') + text + "\xC3";
+    for (auto target : UNICODE_ENCODINGS) {
+      std::istringstream stream(input);
+      utf8streams::TranscodingStreamBuf buf(
+          stream, utf8streams::Encoding::Utf8, target);
+      buf.setErrorPolicy(utf8streams::ErrorPolicy::Replace);
+
+      EXPECT_EQ(
+          encode(input.substr(0, input.size() - 1) + "\xEF\xBF\xBD", target),
+          readAll(buf));
+      EXPECT_EQ(1u, buf.errorCount());
+    }
+  }
+}
+
+TEST(Transcoding, singleByteSource) {
+  std::istringstream stream("caf\xE9 \x80");
+  utf8streams::TranscodingStreamBuf buf(stream,
+                                        utf8streams::Encoding::Windows1252,
+                                        utf8streams::Encoding::Utf16BE);
+
+  EXPECT_EQ(std::string("\0c\0a\0f\0\xE9\0 \x20\xAC", 12), readAll(buf));
+}
+
+TEST(Transcoding, errors) {
+  auto input = std::string("a\0\0\xDC" "b\0", 6);
+  {
+    std::istringstream stream(input);
+    utf8streams::TranscodingStreamBuf buf(stream,
+                                          utf8streams::Encoding::Utf16LE,
+                                          utf8streams::Encoding::Utf32BE);
+    buf.setErrorPolicy(utf8streams::ErrorPolicy::Replace);
+
+    EXPECT_EQ(std::string("\0\0\0a\0\0\xFF\xFD\0\0\0b", 12), readAll(buf));
+    EXPECT_EQ(2, buf.firstErrorOffset());
+  }
+  {
+    std::istringstream stream(input);
+    utf8streams::TranscodingStreamBuf buf(stream,
+                                          utf8streams::Encoding::Utf16LE,
+                                          utf8streams::Encoding::Utf16LE);
+    std::istream reader(&buf);
+    reader.exceptions(std::ios::badbit);
+
+    char output[4];
+    EXPECT_THROW(reader.read(output, sizeof(output)),
+                 utf8streams::UnicodeError);
+  }
+
+  // The stream keeps its buffer if the target encoding is rejected
+  std::istringstream stream("abc");
+  auto original = stream.rdbuf();
+  EXPECT_THROW(utf8streams::TranscodingStreamBuf(
+                   stream, utf8streams::Encoding::Utf8,
+                   utf8streams::Encoding::Latin1),
+               utf8streams::Error);
+  EXPECT_EQ(original, stream.rdbuf());
+
+  std::istringstream stream2("abc");
+  utf8streams::TranscodingStreamBuf buf(stream2, utf8streams::Encoding::Utf8,
+                                        utf8streams::Encoding::Utf16LE);
+  EXPECT_THROW(utf8streams::LineReader reader(buf), utf8streams::Error);
+}
+
+TEST(Transcoding, autoAndSeek) {
+  auto text = repeat("line \xE2\x82\xAC\n", 20000);
+  std::istringstream stream("\xFE\xFF" +
+                            encode(text, utf8streams::Encoding::Utf16BE));
+  utf8streams::TranscodingStreamBuf buf(stream, utf8streams::Encoding::Auto,
+                                        utf8streams::Encoding::Utf32LE);
+  std::istream reader(&buf);
+
+  EXPECT_EQ(utf8streams::Encoding::Utf16BE, buf.encoding());
+  auto expected = encode(text, utf8streams::Encoding::Utf32LE);
+  EXPECT_EQ(expected, readAll(buf));
+
+  reader.clear();
+  reader.seekg(4 * 7 * 1000);
+  char output[8];
+  reader.read(output, sizeof(output));
+  EXPECT_EQ(expected.substr(4 * 7 * 1000, 8), std::string(output, 8));
+}
+
+// Feeds the input in chunks of chunkSize, resending what was not consumed
+static std::string decodeChunks(utf8streams::Decoder &decoder,
+                                const std::string &input, size_t chunkSize,
+                                size_t outputSize = 16) {
+  std::string result;
+  std::vector<char> output(outputSize);
+  size_t pos = 0;
+  while (true) {
+    auto size = std::min(chunkSize, input.size() - pos);
+    auto final = pos + size == input.size();
+    auto decoded = decoder.decode(input.data() + pos, size, output.data(),
+                                  output.size(), final);
+    EXPECT_EQ(utf8streams::TranscodeError::None, decoded.error);
+    result.append(output.data(), decoded.produced);
+    pos += decoded.consumed;
+    if (final && decoded.consumed == size) {
+      return result;
+    }
+  }
+}
+
+TEST(Decoder, chunks) {
+  auto text = repeat("Hello W\xC3\xB6rld \xD0\x9F\xD1\x80\xD0\xB8\xD0\xB2"
+                     "\xD0\xB5\xD1\x82 \xE2\x82\xAC\xF0\x9F\x98\x80\n",
+                     20);
+
+  for (auto source : UNICODE_ENCODINGS) {
+    auto input = encode(text, source);
+    for (size_t chunkSize = 1; chunkSize < 12; ++chunkSize) {
+      utf8streams::Decoder decoder(source);
+      EXPECT_EQ(text, decodeChunks(decoder, input, chunkSize));
+    }
+
+    utf8streams::Decoder decoder(source);
+    EXPECT_EQ(text, decodeChunks(decoder, input, 1000, 1000));
+  }
+}
+
+TEST(Decoder, targetEncoding) {
+  auto text = repeat("a\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80", 30);
+  auto input = encode(text, utf8streams::Encoding::Utf16BE);
+
+  for (auto target : UNICODE_ENCODINGS) {
+    for (size_t chunkSize = 1; chunkSize < 6; ++chunkSize) {
+      utf8streams::Decoder decoder(utf8streams::Encoding::Utf16BE, target);
+      EXPECT_EQ(encode(text, target), decodeChunks(decoder, input, chunkSize));
+    }
+  }
+
+  EXPECT_THROW(utf8streams::Decoder(utf8streams::Encoding::Utf8,
+                                    utf8streams::Encoding::Latin1),
+               utf8streams::Error);
+  EXPECT_THROW(utf8streams::Decoder(utf8streams::Encoding::Unknown),
+               utf8streams::Error);
+}
+
+TEST(Decoder, detectBom) {
+  auto input = std::string("\xFF\xFE\0\0", 4) +
+               encode("caf\xC3\xA9", utf8streams::Encoding::Utf32LE);
+  utf8streams::Decoder decoder;
+  char output[16];
+
+  auto decoded = decoder.decode(input.data(), 3, output, sizeof(output));
+  EXPECT_EQ(3u, decoded.consumed);
+  EXPECT_EQ(0u, decoded.produced);
+  EXPECT_EQ(utf8streams::Encoding::Auto, decoder.encoding());
+
+  decoded = decoder.decode(input.data() + 3, input.size() - 3, output,
+                           sizeof(output), true);
+  EXPECT_EQ(input.size() - 3, decoded.consumed);
+  EXPECT_EQ("caf\xC3\xA9", std::string(output, decoded.produced));
+  EXPECT_EQ(utf8streams::Encoding::Utf32LE, decoder.encoding());
+
+  decoder.reset();
+  EXPECT_EQ(utf8streams::Encoding::Auto, decoder.encoding());
+  decoded = decoder.decode("ab", 2, output, sizeof(output), true);
+  EXPECT_EQ("ab", std::string(output, decoded.produced));
+  EXPECT_EQ(utf8streams::Encoding::Utf8, decoder.encoding());
+}
+
+TEST(Decoder, errors) {
+  // An unpaired high surrogate split across chunks and a truncated end
+  auto input = std::string("a\0\0\xD8", 4) + std::string("b\0c", 3);
+  {
+    utf8streams::Decoder decoder(utf8streams::Encoding::Utf16LE);
+    decoder.setErrorPolicy(utf8streams::ErrorPolicy::Replace);
+
+    EXPECT_EQ("a\xEF\xBF\xBD" "b\xEF\xBF\xBD",
+              decodeChunks(decoder, input, 3));
+    EXPECT_EQ(2u, decoder.errorCount());
+    EXPECT_EQ(2, decoder.firstErrorOffset());
+  }
+  {
+    utf8streams::Decoder decoder(utf8streams::Encoding::Utf16LE);
+    decoder.setErrorPolicy(utf8streams::ErrorPolicy::Skip);
+
+    EXPECT_EQ("ab", decodeChunks(decoder, input, 1));
+    EXPECT_EQ(2u, decoder.errorCount());
+  }
+
+  utf8streams::Decoder decoder(utf8streams::Encoding::Utf8);
+  char output[16];
+  auto decoded = decoder.decode("ab\xC3(cd", 6, output, sizeof(output));
+  EXPECT_EQ(utf8streams::TranscodeError::InvalidSequence, decoded.error);
+  EXPECT_EQ(3u, decoded.consumed);
+  EXPECT_EQ("ab", std::string(output, decoded.produced));
+  EXPECT_EQ(2, decoder.firstErrorOffset());
+
+  decoded = decoder.decode("(cd\xE2\x82", 5, output, sizeof(output));
+  EXPECT_EQ(utf8streams::TranscodeError::None, decoded.error);
+  EXPECT_EQ(5u, decoded.consumed);
+  EXPECT_EQ("(cd", std::string(output, decoded.produced));
+
+  decoded = decoder.decode(nullptr, 0, output, sizeof(output), true);
+  EXPECT_EQ(utf8streams::TranscodeError::IncompleteCodePoint, decoded.error);
+  EXPECT_EQ(2u, decoded.invalidLength);
+  EXPECT_EQ(0u, decoded.produced);
+  EXPECT_EQ(2u, decoder.errorCount());
+}
+
+TEST(Decoder, smallOutput) {
+  // Incomplete sequences are carried over between the calls
+  auto input = repeat("\xF0\x9F\x98\x80 \xE2\x82\xAC\xFF", 100) + "\xFF\xFF";
+  auto text = repeat("\xF0\x9F\x98\x80 \xE2\x82\xAC\xEF\xBF\xBD", 100) +
+              "\xEF\xBF\xBD\xEF\xBF\xBD";
+  for (auto target :
+       {utf8streams::Encoding::Utf8, utf8streams::Encoding::Utf16LE,
+        utf8streams::Encoding::Utf32BE}) {
+    utf8streams::Decoder decoder(utf8streams::Encoding::Auto, target);
+    decoder.setErrorPolicy(utf8streams::ErrorPolicy::Replace);
+    // The smallest output decode() supports
+    char output[16];
+    std::string result;
+    size_t pos = 0;
+    while (pos < input.size()) {
+      auto size = std::min<size_t>(3, input.size() - pos);
+      auto final = pos + size == input.size();
+      auto decoded = decoder.decode(input.data() + pos, size, output,
+                                    sizeof(output), final);
+      result.append(output, decoded.produced);
+      pos += decoded.consumed;
+    }
+
+    EXPECT_EQ(encode(text, target), result);
+
+    // A final call writes the replacements of all bytes kept for the BOM
+    utf8streams::Decoder bomDecoder(utf8streams::Encoding::Auto, target);
+    bomDecoder.setErrorPolicy(utf8streams::ErrorPolicy::Replace);
+    auto decoded = bomDecoder.decode("\x80\x80\x80\x80", 4, output,
+                                     sizeof(output), true);
+    EXPECT_EQ(encode(repeat("\xEF\xBF\xBD", 4), target),
+              std::string(output, decoded.produced));
+  }
+}
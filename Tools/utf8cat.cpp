@@ -0,0 +1,286 @@
+// Concatenates files to standard output in UTF-8, see usage() for options.
+// Regular files are memory-mapped, other input such as pipes is read from its
+// file descriptor, and output is written without buffering in large blocks.
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utf8streams.hpp>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+constexpr size_t BUFFER_SIZE = 1024 * 1024;
+
+struct Options {
+  utf8streams::Encoding encoding = utf8streams::Encoding::Auto;
+  utf8streams::ErrorPolicy errorPolicy = utf8streams::ErrorPolicy::Throw;
+  bool validate = false;
+  bool stats = false;
+  std::vector<std::string> files;
+};
+
+static void usage() {
+  std::fputs(
+      "Usage: utf8cat [options] [file...]\n"
+      "\n"
+      "Converts the files, or standard input if none or - is given, to UTF-8.\n"
+      "\n"
+      "  -e, --encoding NAME  auto (default), utf-8, utf-16le, utf-16be,\n"
+      "                       utf-32le, utf-32be, latin1, windows-1252 or\n"
+      "                       iso-8859-15. auto detects a BOM, files without\n"
+      "                       one are also judged by their content.\n"
+      "  --validate           Check UTF-8 input instead of copying it\n"
+      "  --errors POLICY      throw (default, stop at the first error),\n"
+      "                       replace (with U+FFFD) or skip\n"
+      "  --stats              Print throughput and errors to standard error\n",
+      stderr);
+}
+
+static bool parseEncoding(const std::string &name,
+                          utf8streams::Encoding &encoding) {
+  static const struct {
+    const char *name;
+    utf8streams::Encoding encoding;
+  } names[] = {{"auto", utf8streams::Encoding::Auto},
+               {"utf-8", utf8streams::Encoding::Utf8},
+               {"utf-16le", utf8streams::Encoding::Utf16LE},
+               {"utf-16be", utf8streams::Encoding::Utf16BE},
+               {"utf-32le", utf8streams::Encoding::Utf32LE},
+               {"utf-32be", utf8streams::Encoding::Utf32BE},
+               {"latin1", utf8streams::Encoding::Latin1},
+               {"iso-8859-1", utf8streams::Encoding::Latin1},
+               {"windows-1252", utf8streams::Encoding::Windows1252},
+               {"cp1252", utf8streams::Encoding::Windows1252},
+               {"iso-8859-15", utf8streams::Encoding::Iso8859_15}};
+
+  for (const auto &entry : names) {
+    if (name == entry.name) {
+      encoding = entry.encoding;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool parseOptions(int argc, char const *const *argv, Options &options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if ((arg == "-e" || arg == "--encoding") && i + 1 < argc) {
+      if (!parseEncoding(argv[++i], options.encoding)) {
+        return false;
+      }
+    } else if (arg == "--errors" && i + 1 < argc) {
+      std::string policy(argv[++i]);
+      if (policy == "throw") {
+        options.errorPolicy = utf8streams::ErrorPolicy::Throw;
+      } else if (policy == "replace") {
+        options.errorPolicy = utf8streams::ErrorPolicy::Replace;
+      } else if (policy == "skip") {
+        options.errorPolicy = utf8streams::ErrorPolicy::Skip;
+      } else {
+        return false;
+      }
+    } else if (arg == "--validate") {
+      options.validate = true;
+    } else if (arg == "--stats") {
+      options.stats = true;
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      return false;
+    } else {
+      options.files.push_back(arg);
+    }
+  }
+
+  if (options.files.empty()) {
+    options.files.push_back("-");
+  }
+  return true;
+}
+
+static bool writeAll(const char *data, size_t size) {
+  while (size > 0) {
+#ifdef _WIN32
+    auto written = _write(1, data, static_cast<unsigned>(size));
+#else
+    auto written = write(1, data, size);
+#endif
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+
+    data += written;
+    size -= static_cast<size_t>(written);
+  }
+  return true;
+}
+
+// Weak guesses come from scripts told apart by byte statistics alone, which
+// short single-byte text also passes
+constexpr double MIN_CONFIDENCE = 0.5;
+
+static bool isRegularFile(const std::string &path) {
+  struct stat fileStat;
+  return stat(path.c_str(), &fileStat) == 0 &&
+         (fileStat.st_mode & S_IFMT) == S_IFREG;
+}
+
+// Content-based detection needs a sample, so only regular files get it
+static utf8streams::Encoding detectFileEncoding(const std::string &path) {
+  std::ifstream stream(path, std::ios::binary);
+  auto guess = utf8streams::detectEncoding(stream);
+
+  // The stream buffer skips a BOM itself
+  return guess.encoding == utf8streams::Encoding::Unknown ||
+                 guess.confidence == 1.0 || guess.confidence < MIN_CONFIDENCE
+             ? utf8streams::Encoding::Auto
+             : guess.encoding;
+}
+
+static std::unique_ptr<utf8streams::detail::DecodingStreamBuf>
+openInput(const std::string &path, const Options &options, int &descriptor) {
+  descriptor = -1;
+  if (path == "-") {
+#ifdef _WIN32
+    _setmode(0, _O_BINARY);
+#endif
+    return std::unique_ptr<utf8streams::detail::DecodingStreamBuf>(
+        new utf8streams::UTF8StreamBuf(0, options.encoding, options.validate));
+  }
+
+  if (isRegularFile(path)) {
+    auto encoding = options.encoding == utf8streams::Encoding::Auto
+                        ? detectFileEncoding(path)
+                        : options.encoding;
+    return std::unique_ptr<utf8streams::detail::DecodingStreamBuf>(
+        new utf8streams::MappedUTF8StreamBuf(path, encoding,
+                                             options.validate));
+  }
+
+  // Pipes and devices can only be read once
+#ifdef _WIN32
+  descriptor = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+  descriptor = open(path.c_str(), O_RDONLY);
+#endif
+  if (descriptor == -1) {
+    throw utf8streams::Error("Cannot open file " + path);
+  }
+  return std::unique_ptr<utf8streams::detail::DecodingStreamBuf>(
+      new utf8streams::UTF8StreamBuf(descriptor, options.encoding,
+                                     options.validate));
+}
+
+static const char *encodingName(utf8streams::Encoding encoding) {
+  switch (encoding) {
+  case utf8streams::Encoding::Utf8:
+    return "UTF-8";
+  case utf8streams::Encoding::Utf16LE:
+    return "UTF-16LE";
+  case utf8streams::Encoding::Utf16BE:
+    return "UTF-16BE";
+  case utf8streams::Encoding::Utf32LE:
+    return "UTF-32LE";
+  case utf8streams::Encoding::Utf32BE:
+    return "UTF-32BE";
+  case utf8streams::Encoding::Latin1:
+    return "ISO-8859-1";
+  case utf8streams::Encoding::Windows1252:
+    return "WINDOWS-1252";
+  case utf8streams::Encoding::Iso8859_15:
+    return "ISO-8859-15";
+  default:
+    return "unknown";
+  }
+}
+
+// Returns false if the input could not be converted or written completely
+static bool concatenate(const std::string &path, const Options &options,
+                        char *buffer) {
+  auto start = std::chrono::steady_clock::now();
+  uint64_t outputBytes = 0;
+  int descriptor = -1;
+  std::unique_ptr<utf8streams::detail::DecodingStreamBuf> buf;
+  auto success = true;
+
+  try {
+    buf = openInput(path, options, descriptor);
+    buf->setErrorPolicy(options.errorPolicy);
+
+    while (auto count = buf->sgetn(buffer, BUFFER_SIZE)) {
+      if (!writeAll(buffer, static_cast<size_t>(count))) {
+        std::fprintf(stderr, "utf8cat: Cannot write output: %s\n",
+                     std::strerror(errno));
+        success = false;
+        break;
+      }
+      outputBytes += static_cast<uint64_t>(count);
+    }
+  } catch (const utf8streams::Error &error) {
+    std::fprintf(stderr, "utf8cat: %s: %s\n", path.c_str(), error.what());
+    success = false;
+  }
+
+  if (options.stats && buf) {
+    std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+    auto mapped = dynamic_cast<utf8streams::MappedUTF8StreamBuf *>(buf.get());
+    auto streamBuf = dynamic_cast<utf8streams::UTF8StreamBuf *>(buf.get());
+    auto encoding = mapped != nullptr ? mapped->encoding()
+                                      : streamBuf->encoding();
+
+    std::fprintf(stderr,
+                 "utf8cat: %s: %s, %llu bytes in %.3f s, %.1f MB/s, %zu "
+                 "errors\n",
+                 path.c_str(), encodingName(encoding),
+                 static_cast<unsigned long long>(outputBytes), seconds.count(),
+                 static_cast<double>(outputBytes) / seconds.count() / 1e6,
+                 buf->errorCount());
+  }
+
+  buf.reset();
+  if (descriptor != -1) {
+#ifdef _WIN32
+    _close(descriptor);
+#else
+    close(descriptor);
+#endif
+  }
+  return success;
+}
+
+int main(int argc, char const *const *argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    usage();
+    return 2;
+  }
+
+#ifdef _WIN32
+  _setmode(1, _O_BINARY);
+#endif
+
+  std::unique_ptr<char[]> buffer(new char[BUFFER_SIZE]);
+  auto status = 0;
+  for (const auto &path : options.files) {
+    if (!concatenate(path, options, buffer.get())) {
+      status = 1;
+    }
+  }
+
+  return status;
+}